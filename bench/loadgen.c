@@ -0,0 +1,755 @@
+/**
+ * file: loadgen.c
+ *
+ * Load generator for the chat server.  Opens many connections over
+ * loopback, registers each of them through the binary protocol,
+ * spreads them over rooms of a given size and has every one of them
+ * say something at a given rate.  Every message carries the time it
+ * was sent, so each copy the server fans out gives one sample of
+ * delivery latency
+ */
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+
+#define DEFAULT_PORT        9004
+#define DEFAULT_THREADS     4
+#define DEFAULT_CONNS       1000
+#define DEFAULT_ROOM_SIZE   10
+#define DEFAULT_RATE        1.0
+#define DEFAULT_DURATION    10
+#define DEFAULT_SIZE        64
+#define SETUP_TIMEOUT_MS    30000
+#define DRAIN_MS            1000
+#define TICK_MS             1
+#define MAX_EVENTS          256
+#define BASE_10             10
+
+#define HEADER_LEN          16
+#define MAX_FRAME           (64 * 1024)
+#define IN_BUFFER           (2 * MAX_FRAME)
+#define OUT_BUFFER          (16 * 1024)
+#define MAX_PAYLOAD         4000
+#define STAMP_LEN           8
+
+#define FRAME_HELLO         1
+#define FRAME_WELCOME       2
+#define FRAME_MSG           3
+#define FRAME_CMD           4
+#define FRAME_JOIN          6
+
+/* latency histogram: 2^SUB_BITS buckets per power of two of ns */
+#define SUB_BITS            5
+#define BUCKETS             (64 << SUB_BITS)
+
+/** Type definitions **/
+
+/**
+ * What the whole run is doing
+ *
+ * PHASE_SETUP      Connecting, registering and joining rooms
+ * PHASE_RUN        Sending and measuring
+ * PHASE_DRAIN      No longer sending, still counting what arrives
+ * PHASE_DONE       Threads exit
+ */
+enum phase {
+    PHASE_SETUP,
+    PHASE_RUN,
+    PHASE_DRAIN,
+    PHASE_DONE
+};
+
+/**
+ * Where a connection is in its setup
+ *
+ * CONN_PROMPT      Skipping the text prompt up to the server's zero byte
+ * CONN_HELLO       Waiting for WELCOME
+ * CONN_JOINING     Waiting for its own JOIN into its room
+ * CONN_READY       Set up
+ * CONN_DEAD        Closed
+ */
+enum conn_state {
+    CONN_PROMPT,
+    CONN_HELLO,
+    CONN_JOINING,
+    CONN_READY,
+    CONN_DEAD
+};
+
+/**
+ * A client connection
+ *
+ * sock      Socket
+ * state     Where it is in its setup
+ * index     Number of the connection in the whole run
+ * id        User id the server assigned it
+ * room      Id of the room it is in
+ * in/nin    Bytes received and not parsed yet
+ * out/nout  Bytes not sent yet
+ */
+struct conn {
+    int sock;
+    enum conn_state state;
+    unsigned index;
+    uint32_t id;
+    uint32_t room;
+    char *in;
+    size_t nin;
+    char *out;
+    size_t nout;
+};
+
+/**
+ * Counters of one thread, merged once the run is over
+ */
+struct stats {
+    unsigned long long sent;
+    unsigned long long delivered;
+    unsigned long long dropped;
+    unsigned long long bytes;
+    unsigned long long buckets[BUCKETS];
+    unsigned long long max;
+};
+
+/**
+ * A load generating thread and the connections it drives.  Each has
+ * its own payload, as every message sent is stamped with its time
+ */
+struct worker {
+    pthread_t thread;
+    int epfd;
+    struct conn *conns;
+    unsigned nconns;
+    unsigned first;
+    unsigned next_sender;
+    struct stats stats;
+    char payload[MAX_PAYLOAD];
+};
+
+/**
+ * Options of the run
+ */
+struct options {
+    struct sockaddr_in addr;
+    unsigned threads;
+    unsigned conns;
+    unsigned room_size;
+    double rate;
+    unsigned duration;
+    unsigned size;
+};
+
+/** Declarations **/
+
+static void usage(const char *prog_name);
+static int parse_number(const char *str, long min, long max, long *value);
+static long long now_ns(void);
+static unsigned bucket_of(unsigned long long ns);
+static unsigned long long bucket_value(unsigned b);
+static unsigned long long percentile(const struct stats *s, double p);
+static void conn_close(struct worker *w, struct conn *c);
+static int conn_open(struct worker *w, struct conn *c);
+static int conn_flush(struct worker *w, struct conn *c);
+static int conn_frame(struct worker *w, struct conn *c, unsigned type,
+        uint32_t room, const char *payload, size_t len);
+static void conn_handle(struct worker *w, struct conn *c, const char *frame,
+        size_t len);
+static void conn_read(struct worker *w, struct conn *c);
+static void worker_send(struct worker *w, long long run_start,
+        unsigned long long *due);
+static void *worker_run(void *arg);
+
+/** Definitions **/
+
+static struct options opts;
+static _Atomic enum phase phase = PHASE_SETUP;
+static atomic_uint nready;
+static atomic_uint ndead;
+static atomic_llong run_start_ns;
+
+/** Helper functions **/
+
+static void usage(const char *prog_name)
+{
+    fprintf(stderr, "usage: %s [-h host] [-p port] [-t threads] [-c connections]"
+            " [-r room_size] [-R rate] [-d seconds] [-s size]\n", prog_name);
+    fprintf(stderr, "  -h   server address (default 127.0.0.1)\n");
+    fprintf(stderr, "  -p   server port (default %d)\n", DEFAULT_PORT);
+    fprintf(stderr, "  -t   load generating threads (default %d)\n", DEFAULT_THREADS);
+    fprintf(stderr, "  -c   connections to open (default %d)\n", DEFAULT_CONNS);
+    fprintf(stderr, "  -r   connections per room, 0 keeps everyone in the lobby"
+            " (default %d)\n", DEFAULT_ROOM_SIZE);
+    fprintf(stderr, "  -R   messages each connection sends per second (default %.0f)\n",
+            DEFAULT_RATE);
+    fprintf(stderr, "  -d   seconds to send for (default %d)\n", DEFAULT_DURATION);
+    fprintf(stderr, "  -s   bytes of each message (default %d)\n", DEFAULT_SIZE);
+}
+
+static int parse_number(const char *str, long min, long max, long *value)
+{
+    char *canary = NULL;
+    long v;
+
+    v = strtol(str, &canary, BASE_10);
+    if (canary == str || *canary != '\0' || v < min || v > max)
+        return -1;
+
+    *value = v;
+    return 0;
+}
+
+static long long now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+/**
+ * Buckets are exact below 2^SUB_BITS ns and within 1/2^SUB_BITS of
+ * the value above
+ */
+static unsigned bucket_of(unsigned long long ns)
+{
+    unsigned msb;
+
+    if (ns < (1ULL << SUB_BITS))
+        return (unsigned)ns;
+
+    msb = 63U - (unsigned)__builtin_clzll(ns);
+    return ((msb - SUB_BITS + 1) << SUB_BITS)
+        + (unsigned)((ns >> (msb - SUB_BITS)) & ((1U << SUB_BITS) - 1));
+}
+
+static unsigned long long bucket_value(unsigned b)
+{
+    unsigned shift;
+
+    if (b < (1U << SUB_BITS))
+        return b;
+
+    shift = (b >> SUB_BITS) - 1;
+    return ((1ULL << SUB_BITS) | (b & ((1U << SUB_BITS) - 1))) << shift;
+}
+
+static unsigned long long percentile(const struct stats *s, double p)
+{
+    unsigned long long want, seen = 0;
+    unsigned b;
+
+    if (s->delivered == 0)
+        return 0;
+
+    want = (unsigned long long)(p * (double)s->delivered);
+    if (want >= s->delivered)
+        want = s->delivered - 1;
+
+    for (b = 0; b < BUCKETS; b++) {
+        seen += s->buckets[b];
+        if (seen > want)
+            return bucket_value(b);
+    }
+
+    return s->max;
+}
+
+/** Connection functions **/
+
+static void conn_close(struct worker *w, struct conn *c)
+{
+    (void)w;
+
+    if (c->state == CONN_DEAD)
+        return;
+
+    if (c->state != CONN_READY)
+        atomic_fetch_add(&nready, 1);
+    atomic_fetch_add(&ndead, 1);
+
+    close(c->sock);
+    c->state = CONN_DEAD;
+}
+
+/**
+ * Connects, selects binary frames and registers a handle
+ *
+ * \return          0 on success, -1 on failure
+ */
+static int conn_open(struct worker *w, struct conn *c)
+{
+    struct epoll_event ev;
+    char handle[32];
+    int err, one = 1;
+
+    c->sock = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
+    if (c->sock == -1) {
+        perror("[loadgen:socket]");
+        return -1;
+    }
+
+    setsockopt(c->sock, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    err = connect(c->sock, (struct sockaddr*)&opts.addr, sizeof(opts.addr));
+    if (err == -1 && errno != EINPROGRESS) {
+        perror("[loadgen:connect]");
+        close(c->sock);
+        return -1;
+    }
+
+    ev.events = EPOLLIN | EPOLLOUT | EPOLLET;
+    ev.data.ptr = c;
+    if (epoll_ctl(w->epfd, EPOLL_CTL_ADD, c->sock, &ev) == -1) {
+        perror("[loadgen:epoll_ctl]");
+        close(c->sock);
+        return -1;
+    }
+
+    c->state = CONN_PROMPT;
+    c->out[0] = '\0';
+    c->nout = 1;
+
+    snprintf(handle, sizeof(handle), "lg%d_%u", (int)(getpid() % 10000), c->index);
+    return conn_frame(w, c, FRAME_HELLO, 0, handle, strlen(handle));
+}
+
+/**
+ * Writes as much queued output as the socket takes
+ *
+ * \return          0 on success, -1 if the connection was closed
+ */
+static int conn_flush(struct worker *w, struct conn *c)
+{
+    ssize_t n;
+
+    while (c->nout > 0) {
+        n = send(c->sock, c->out, c->nout, MSG_NOSIGNAL);
+        if (n == -1) {
+            if (errno == EAGAIN || errno == ENOTCONN)
+                return 0;
+            conn_close(w, c);
+            return -1;
+        }
+
+        memmove(c->out, c->out + n, c->nout - (size_t)n);
+        c->nout -= (size_t)n;
+    }
+
+    return 0;
+}
+
+/**
+ * Queues a frame and tries to send it
+ *
+ * \return          0 on success, -1 if it did not fit or the
+ *                  connection was closed
+ */
+static int conn_frame(struct worker *w, struct conn *c, unsigned type,
+        uint32_t room, const char *payload, size_t len)
+{
+    unsigned char *h;
+    uint32_t word;
+
+    if (c->nout + HEADER_LEN + len > OUT_BUFFER)
+        return -1;
+
+    h = (unsigned char*)c->out + c->nout;
+    memset(h, 0, HEADER_LEN);
+    word = htonl((uint32_t)(HEADER_LEN - 4 + len));
+    memcpy(h, &word, 4);
+    h[4] = (unsigned char)type;
+    word = htonl(room);
+    memcpy(h + 12, &word, 4);
+    memcpy(h + HEADER_LEN, payload, len);
+    c->nout += HEADER_LEN + len;
+
+    return conn_flush(w, c);
+}
+
+/**
+ * Handles one frame from the server, without its length field
+ */
+static void conn_handle(struct worker *w, struct conn *c, const char *frame,
+        size_t len)
+{
+    unsigned type;
+    uint32_t sender, room;
+    long long stamp, lat;
+    char cmd[32];
+
+    if (len < HEADER_LEN - 4)
+        return;
+
+    type = (unsigned char)frame[0];
+    memcpy(&sender, frame + 4, 4);
+    memcpy(&room, frame + 8, 4);
+    sender = ntohl(sender);
+    room = ntohl(room);
+    frame += HEADER_LEN - 4;
+    len -= HEADER_LEN - 4;
+
+    if (type == FRAME_WELCOME && c->state == CONN_HELLO) {
+        c->id = sender;
+        if (opts.room_size == 0) {
+            c->state = CONN_READY;
+            atomic_fetch_add(&nready, 1);
+        } else {
+            c->state = CONN_JOINING;
+            snprintf(cmd, sizeof(cmd), "join bench%u", c->index / opts.room_size);
+            conn_frame(w, c, FRAME_CMD, 0, cmd, strlen(cmd));
+        }
+    } else if (type == FRAME_JOIN && c->state == CONN_JOINING
+            && sender == c->id && room != 0) {
+        c->room = room;
+        c->state = CONN_READY;
+        atomic_fetch_add(&nready, 1);
+    } else if (type == FRAME_MSG && len >= STAMP_LEN) {
+        memcpy(&stamp, frame, STAMP_LEN);
+
+        /* history replayed on join predates the run */
+        if (stamp < atomic_load(&run_start_ns))
+            return;
+
+        lat = now_ns() - stamp;
+        if (lat < 0)
+            lat = 0;
+        w->stats.delivered++;
+        w->stats.buckets[bucket_of((unsigned long long)lat)]++;
+        if ((unsigned long long)lat > w->stats.max)
+            w->stats.max = (unsigned long long)lat;
+    }
+}
+
+/**
+ * Reads until the socket is drained, handling every whole frame
+ */
+static void conn_read(struct worker *w, struct conn *c)
+{
+    ssize_t n;
+    size_t off, flen;
+    uint32_t word;
+    char *zero;
+
+    for (;;) {
+        n = recv(c->sock, c->in + c->nin, IN_BUFFER - c->nin, 0);
+        if (n == 0 || (n == -1 && errno != EAGAIN)) {
+            conn_close(w, c);
+            return;
+        } else if (n == -1) {
+            return;
+        }
+
+        w->stats.bytes += (unsigned long long)n;
+        c->nin += (size_t)n;
+        off = 0;
+
+        /* everything up to the server's zero byte is the text prompt */
+        if (c->state == CONN_PROMPT) {
+            zero = memchr(c->in, '\0', c->nin);
+            if (zero == NULL) {
+                c->nin = 0;
+                continue;
+            }
+            off = (size_t)(zero - c->in) + 1;
+            c->state = CONN_HELLO;
+        }
+
+        while (c->nin - off >= 4) {
+            memcpy(&word, c->in + off, 4);
+            flen = ntohl(word);
+            if (flen < HEADER_LEN - 4 || flen > MAX_FRAME) {
+                fprintf(stderr, "[loadgen] malformed frame, closing connection\n");
+                conn_close(w, c);
+                return;
+            }
+            if (c->nin - off < 4 + flen)
+                break;
+
+            conn_handle(w, c, c->in + off + 4, flen);
+            if (c->state == CONN_DEAD)
+                return;
+            off += 4 + flen;
+        }
+
+        memmove(c->in, c->in + off, c->nin - off);
+        c->nin -= off;
+    }
+}
+
+/** Worker functions **/
+
+/**
+ * Sends whatever the rate says is due by now, round robin over the
+ * worker's connections
+ */
+static void worker_send(struct worker *w, long long run_start,
+        unsigned long long *due)
+{
+    struct conn *c;
+    unsigned long long target;
+    long long stamp;
+    unsigned tries;
+
+    target = (unsigned long long)((double)(now_ns() - run_start) / 1e9
+            * opts.rate * w->nconns);
+
+    for (; *due < target; (*due)++) {
+        for (tries = 0; tries < w->nconns; tries++) {
+            c = &w->conns[w->next_sender];
+            w->next_sender = (w->next_sender + 1) % w->nconns;
+            if (c->state == CONN_READY)
+                break;
+        }
+        if (tries == w->nconns)
+            return;
+
+        stamp = now_ns();
+        memcpy(w->payload, &stamp, STAMP_LEN);
+        if (conn_frame(w, c, FRAME_MSG, c->room, w->payload, opts.size) == 0)
+            w->stats.sent++;
+        else
+            w->stats.dropped++;
+    }
+}
+
+static void *worker_run(void *arg)
+{
+    struct worker *w;
+    struct epoll_event events[MAX_EVENTS];
+    struct conn *c;
+    unsigned long long due = 0;
+    long long run_start = 0;
+    enum phase ph;
+    int i, n;
+
+    w = arg;
+    for (i = 0; (unsigned)i < w->nconns; i++) {
+        if (conn_open(w, &w->conns[i]) == -1) {
+            w->conns[i].state = CONN_DEAD;
+            atomic_fetch_add(&nready, 1);
+            atomic_fetch_add(&ndead, 1);
+        }
+    }
+
+    while ((ph = atomic_load(&phase)) != PHASE_DONE) {
+        n = epoll_wait(w->epfd, events, MAX_EVENTS, TICK_MS);
+        for (i = 0; i < n; i++) {
+            c = events[i].data.ptr;
+            if (c->state == CONN_DEAD)
+                continue;
+            if (events[i].events & EPOLLOUT)
+                conn_flush(w, c);
+            if (c->state != CONN_DEAD && events[i].events & (EPOLLIN | EPOLLERR | EPOLLHUP))
+                conn_read(w, c);
+        }
+
+        if (ph == PHASE_RUN) {
+            if (run_start == 0)
+                run_start = atomic_load(&run_start_ns);
+            worker_send(w, run_start, &due);
+        }
+    }
+
+    return NULL;
+}
+
+/** Main **/
+
+int main(int argc, char *argv[])
+{
+    struct worker *workers;
+    struct stats total;
+    struct rlimit rl;
+    long long start, setup_ns, run_ns;
+    long value;
+    unsigned i, j, per, ready;
+    int opt;
+
+    memset(&opts, 0, sizeof(opts));
+    opts.addr.sin_family = AF_INET;
+    opts.addr.sin_port = htons(DEFAULT_PORT);
+    opts.addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    opts.threads = DEFAULT_THREADS;
+    opts.conns = DEFAULT_CONNS;
+    opts.room_size = DEFAULT_ROOM_SIZE;
+    opts.rate = DEFAULT_RATE;
+    opts.duration = DEFAULT_DURATION;
+    opts.size = DEFAULT_SIZE;
+
+    while ((opt = getopt(argc, argv, "h:p:t:c:r:R:d:s:")) != -1) {
+        switch (opt) {
+            case 'h':
+                if (inet_pton(AF_INET, optarg, &opts.addr.sin_addr) != 1) {
+                    fprintf(stderr, "[loadgen] -h must be an IPv4 address\n");
+                    return EXIT_FAILURE;
+                }
+                break;
+            case 'p':
+                if (parse_number(optarg, 1, 65535, &value) == -1) {
+                    fprintf(stderr, "[loadgen] -p invalid.  Must be 1-65535\n");
+                    return EXIT_FAILURE;
+                }
+                opts.addr.sin_port = htons((unsigned short)value);
+                break;
+            case 't':
+            case 'c':
+            case 'r':
+            case 'd':
+                if (parse_number(optarg, opt == 'r' ? 0 : 1, 1000000, &value) == -1) {
+                    fprintf(stderr, "[loadgen] -%c invalid\n", opt);
+                    return EXIT_FAILURE;
+                }
+                if (opt == 't')
+                    opts.threads = (unsigned)value;
+                else if (opt == 'c')
+                    opts.conns = (unsigned)value;
+                else if (opt == 'r')
+                    opts.room_size = (unsigned)value;
+                else
+                    opts.duration = (unsigned)value;
+                break;
+            case 'R':
+                opts.rate = strtod(optarg, NULL);
+                if (opts.rate <= 0) {
+                    fprintf(stderr, "[loadgen] -R must be above 0\n");
+                    return EXIT_FAILURE;
+                }
+                break;
+            case 's':
+                if (parse_number(optarg, STAMP_LEN, MAX_PAYLOAD, &value) == -1) {
+                    fprintf(stderr, "[loadgen] -s invalid.  Must be %d-%d\n",
+                            STAMP_LEN, MAX_PAYLOAD);
+                    return EXIT_FAILURE;
+                }
+                opts.size = (unsigned)value;
+                break;
+            default:
+                usage(argv[0]);
+                return EXIT_FAILURE;
+        }
+    }
+
+    if (opts.threads > opts.conns)
+        opts.threads = opts.conns;
+
+    /* every connection needs a descriptor */
+    if (getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur < rl.rlim_max) {
+        rl.rlim_cur = rl.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &rl);
+    }
+
+    signal(SIGPIPE, SIG_IGN);
+
+    workers = calloc(opts.threads, sizeof(*workers));
+    if (workers == NULL) {
+        perror("[loadgen:calloc]");
+        return EXIT_FAILURE;
+    }
+
+    per = opts.conns / opts.threads;
+    for (i = 0; i < opts.threads; i++) {
+        struct worker *w = &workers[i];
+
+        w->first = i * per;
+        w->nconns = i + 1 == opts.threads ? opts.conns - w->first : per;
+        w->conns = calloc(w->nconns, sizeof(*w->conns));
+        w->epfd = epoll_create1(0);
+        memset(w->payload, 'x', sizeof(w->payload));
+        if (w->conns == NULL || w->epfd == -1) {
+            perror("[loadgen:init]");
+            return EXIT_FAILURE;
+        }
+
+        for (j = 0; j < w->nconns; j++) {
+            w->conns[j].index = w->first + j;
+            w->conns[j].in = malloc(IN_BUFFER);
+            w->conns[j].out = malloc(OUT_BUFFER);
+            if (w->conns[j].in == NULL || w->conns[j].out == NULL) {
+                perror("[loadgen:malloc]");
+                return EXIT_FAILURE;
+            }
+        }
+    }
+
+    printf("[loadgen] %u connections on %u threads, rooms of %u, %.2f msg/s each,"
+            " %u byte messages, %u s\n", opts.conns, opts.threads, opts.room_size,
+            opts.rate, opts.size, opts.duration);
+
+    atomic_store(&run_start_ns, (long long)1 << 62);
+    start = now_ns();
+    for (i = 0; i < opts.threads; i++) {
+        if (pthread_create(&workers[i].thread, NULL, worker_run, &workers[i]) != 0) {
+            fprintf(stderr, "[loadgen:pthread_create]: failed to create thread\n");
+            return EXIT_FAILURE;
+        }
+    }
+
+    while ((ready = atomic_load(&nready)) < opts.conns
+            && now_ns() - start < SETUP_TIMEOUT_MS * 1000000LL)
+        usleep(1000);
+    setup_ns = now_ns() - start;
+
+    atomic_store(&run_start_ns, now_ns());
+    atomic_store(&phase, PHASE_RUN);
+    sleep(opts.duration);
+    atomic_store(&phase, PHASE_DRAIN);
+    run_ns = now_ns() - atomic_load(&run_start_ns);
+    usleep(DRAIN_MS * 1000);
+    atomic_store(&phase, PHASE_DONE);
+
+    memset(&total, 0, sizeof(total));
+    for (i = 0; i < opts.threads; i++) {
+        struct worker *w = &workers[i];
+
+        pthread_join(w->thread, NULL);
+        total.sent += w->stats.sent;
+        total.delivered += w->stats.delivered;
+        total.dropped += w->stats.dropped;
+        total.bytes += w->stats.bytes;
+        if (w->stats.max > total.max)
+            total.max = w->stats.max;
+        for (j = 0; j < BUCKETS; j++)
+            total.buckets[j] += w->stats.buckets[j];
+
+        for (j = 0; j < w->nconns; j++) {
+            if (w->conns[j].state != CONN_DEAD)
+                close(w->conns[j].sock);
+            free(w->conns[j].in);
+            free(w->conns[j].out);
+        }
+        free(w->conns);
+        close(w->epfd);
+    }
+    free(workers);
+
+    printf("connections   %u of %u set up in %.3f s (%.0f conn/s), %u closed\n",
+            ready - atomic_load(&ndead), opts.conns, (double)setup_ns / 1e9,
+            (double)ready / ((double)setup_ns / 1e9), atomic_load(&ndead));
+    printf("sent          %llu messages (%.0f msg/s), %llu not sent\n",
+            total.sent, (double)total.sent / ((double)run_ns / 1e9), total.dropped);
+    printf("delivered     %llu messages (%.0f msg/s), %.1f MB received\n",
+            total.delivered, (double)total.delivered / ((double)run_ns / 1e9),
+            (double)total.bytes / 1e6);
+    printf("latency       p50 %.1f us  p99 %.1f us  p999 %.1f us  max %.1f us\n",
+            (double)percentile(&total, 0.5) / 1e3, (double)percentile(&total, 0.99) / 1e3,
+            (double)percentile(&total, 0.999) / 1e3, (double)total.max / 1e3);
+
+    return EXIT_SUCCESS;
+}
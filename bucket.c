@@ -0,0 +1,49 @@
+/**
+ * file: bucket.c
+ *
+ * Token buckets for limiting how fast a client may send
+ */
+
+#include "bucket.h"
+
+/* levels are kept in thousandths of a token, so a rate per second drips per ms */
+#define BUCKET_SCALE    1000
+
+/** Bucket functions **/
+
+void bucket_init(struct bucket *b, long burst, long long now)
+{
+    b->level = (long long)burst * BUCKET_SCALE;
+    b->stamp = now;
+}
+
+long bucket_fill(struct bucket *b, long rate, long burst, long long now)
+{
+    long long cap;
+
+    cap = (long long)burst * BUCKET_SCALE;
+    if (now > b->stamp) {
+        b->level += (now - b->stamp) * rate;
+        if (b->level > cap)
+            b->level = cap;
+        b->stamp = now;
+    }
+
+    return (long)(b->level / BUCKET_SCALE);
+}
+
+void bucket_take(struct bucket *b, long n)
+{
+    b->level -= (long long)n * BUCKET_SCALE;
+}
+
+long bucket_wait(const struct bucket *b, long rate)
+{
+    long long missing;
+
+    missing = BUCKET_SCALE - b->level;
+    if (missing <= 0)
+        return 0;
+
+    return (long)((missing + rate - 1) / rate);
+}
@@ -0,0 +1,62 @@
+/**
+ * file: bucket.h
+ *
+ * Token buckets for limiting how fast a client may send.  Tokens
+ * drip in at a steady rate up to a burst, and a bucket may go into
+ * debt, which later refills must pay off first
+ */
+
+#ifndef ALLISONK_BUCKET_H
+#define ALLISONK_BUCKET_H
+
+/**
+ * Represents a token bucket.  The rate and burst are the caller's,
+ * so one setting can serve every connection
+ *
+ * level     Tokens held, in thousandths so refills round nothing away.
+ *           Negative while in debt
+ * stamp     Monotonic time (ms) of the last refill
+ */
+struct bucket {
+    long long level;
+    long long stamp;
+};
+
+/**
+ * Fills a bucket to its burst
+ *
+ * \param b         Bucket to fill
+ * \param burst     Most tokens the bucket holds
+ * \param now       Current monotonic time (ms)
+ */
+void bucket_init(struct bucket *b, long burst, long long now);
+
+/**
+ * Adds the tokens that dripped in since the last refill
+ *
+ * \param b         Bucket to refill
+ * \param rate      Tokens added per second
+ * \param burst     Most tokens the bucket holds
+ * \param now       Current monotonic time (ms)
+ * \return          Whole tokens held, negative while in debt
+ */
+long bucket_fill(struct bucket *b, long rate, long burst, long long now);
+
+/**
+ * Takes tokens, going into debt if there are not enough
+ *
+ * \param b         Bucket to take from
+ * \param n         Tokens to take
+ */
+void bucket_take(struct bucket *b, long n);
+
+/**
+ * Returns how long until a bucket holds a whole token again
+ *
+ * \param b         Bucket to check, refilled by the caller
+ * \param rate      Tokens added per second
+ * \return          Time in ms, 0 if it holds one now
+ */
+long bucket_wait(const struct bucket *b, long rate);
+
+#endif
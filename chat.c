@@ -4,14 +4,22 @@
  * Implementation of a chat client
  */
 
-#include <poll.h>
+#include <stdatomic.h>
 #include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
-#include <pthread.h>
 
 #include "chat.h"
-#include "generic/generic_list.h"
+#include "directory.h"
+#include "message.h"
+#include "msglog.h"
+#include "proto.h"
+#include "reactor.h"
+#include "room.h"
+#include "stats.h"
+#include "generic/generic_pool.h"
+#include "generic/generic_queue.h"
+#include "generic/generic_slotmap.h"
 
 #define SERVER_NAME         "neptune"
 
@@ -19,9 +27,14 @@
 #define MAX_HANDLE_LEN      28
 #define MAX_BUFFER          256
 #define MAX_CMD_LEN         10
-#define MAX_MSG_LEN         MAX_HANDLE_LEN + MAX_BUFFER + TAG_PADDING
 #define FMT_REGISTER_DONE   "'%s' has joined the chat!"
-#define FMT_MESSAGE         "[%s] %s\n"
+#define FMT_MESSAGE         "[%s] %.*s\n"
+#define FMT_ROOM_JOIN       "'%s' has joined %s"
+#define FMT_ROOM_PART       "'%s' has left %s"
+#define FMT_DIRECT_TAG      "%s -> %s"
+
+/* Messages queued for a shard before more are dropped */
+#define SHARD_INBOX         65536
 
 #define TAG_INFO            "info"
 #define TAG_ADMIN           "admin"
@@ -29,65 +42,314 @@
 
 /** Declarations **/
 
-struct user {
-    int sock;
-    char handle[MAX_HANDLE_LEN];
+/**
+ * Columns of a shard's user table.  Fan-out only scans the
+ * connections, so handles are kept out of its way
+ *
+ * USER_CI      Connection of the user (struct client_info *)
+ * USER_ID      Id identifying the user in binary frames (uint32_t)
+ * USER_HANDLE  Registered handle (char[MAX_HANDLE_LEN])
+ * USER_ROOM    Name of the room the user is in (char[ROOM_NAME_LEN])
+ */
+enum user_column {
+    USER_CI,
+    USER_ID,
+    USER_HANDLE,
+    USER_ROOM,
+    USER_COLUMNS
+};
+
+/**
+ * A message queued for delivery by another shard, either to its
+ * members of a room or to one of its users.  The shard holds a
+ * reference to both forms of the message for as long as it is queued
+ */
+struct shard_msg {
+    uint32_t room;
+    unsigned long user;
+    struct message *text;
+    struct message *frame;
+};
+
+/**
+ * A shard of the chat owned by a single reactor thread
+ *
+ * users        Users connected through the shard's reactor, by the id
+ *              stored in their connection.  Only ever touched by that
+ *              reactor's thread
+ * reactor      Reactor that owns the shard
+ * inbox        Messages posted by other shards, oldest first
+ * signalled    Set once a poster has woken the reactor, until the
+ *              reactor starts draining the inbox
+ */
+struct shard {
+    struct slotmap *users;
+    struct reactor *reactor;
+    struct mpsc *inbox;
+    atomic_int signalled;
 };
 
-void user_deallocate(void *p);
-int user_compare(void *puser, void *psock);
 void trim_ending(char *line);
+void handle_cmd(struct client_info *ci, char *cmd);
+static int chat_send(struct client_info *ci, const char *msg, size_t len);
+static int chat_notice(struct client_info *ci, unsigned type,
+        const char *msg, size_t len);
+static void chat_prompt(struct client_info *ci);
+static int chat_flood(struct client_info *ci);
+static const char *chat_handle(struct client_info *ci);
+static uint32_t chat_user_id(struct client_info *ci);
+static struct message *chat_text(const char *tag, const char *msg, size_t len);
+static void chat_say(struct client_info *ci, const char *msg, size_t len);
+static void chat_info(struct client_info *ci, const char *msg);
+static void chat_announce(struct client_info *ci, unsigned type,
+        const char *fmt);
+static void chat_join(struct client_info *ci, const char *name);
+static void chat_rooms(struct client_info *ci);
+static void chat_who(struct client_info *ci, const char *page);
+static void chat_replay(struct client_info *ci);
+static void chat_page_in(unsigned shard, uint32_t room, const char *name);
+static void chat_direct(struct client_info *ci, const char *handle,
+        const char *msg, size_t len);
+static int chat_line(void *pci, char *line, size_t len);
+static int chat_printable(const char *name);
+static int chat_frame(void *pci, char *body, size_t len);
+static void shard_post(unsigned from, struct shard *sh, uint32_t room,
+        unsigned long user, struct message *text, struct message *frame);
+static void shard_fanout(struct shard *sh, uint32_t room,
+        struct message *text, struct message *frame);
+static void shard_direct(struct shard *sh, unsigned long user,
+        struct message *text, struct message *frame);
 
 /** Definitions **/
 
 static char str_register_user[] = "enter handle: ";
 static char str_handle_too_long[] = "handle too long\n";
+static char str_handle_taken[] = "handle already in use\n";
+static char str_handle_invalid[] = "handle may not hold control characters\n";
+static char str_room_too_long[] = "room name too long\n";
+static char str_room_invalid[] = "room name may not hold control characters\n";
+static char str_room_full[] = "no more rooms can be created\n";
+static char str_room_same[] = "already in that room\n";
+static char str_room_lobby[] = "already in the lobby\n";
+static char str_room_wrong[] = "not in that room\n";
+static char str_no_such_user[] = "no such user\n";
+static char str_no_such_page[] = "no such page\n";
+static char str_flooding[] = "sending too fast, messages dropped\n";
+
+static struct shard *shards;
+static unsigned nshards;
+
+/* Inbox entries, allocated by posters and freed by receivers */
+static struct pool *shard_msgs;
+
+/* Log of everything said, NULL when history is not kept on disk */
+static struct msglog *journal;
 
-static struct list *users;
-static pthread_mutex_t mtx_user_list;
+/* Binary clients connected; broadcasts skip framing while there are none */
+static atomic_uint nbinary;
+/* Next id handed to a registering user, 0 is the server */
+static atomic_uint next_user_id = 1;
 
-/** User list functions **/
+/** Chat functions **/
 
-void user_deallocate(void *p)
+void chat_global_init(struct reactor **reactors, unsigned n,
+        const struct server_config *cfg)
 {
-    struct user *u;
-    u = (struct user*)p;
-    free(u);
+    unsigned i;
+    size_t sizes[USER_COLUMNS];
+
+    sizes[USER_CI] = sizeof(struct client_info*);
+    sizes[USER_ID] = sizeof(uint32_t);
+    sizes[USER_HANDLE] = MAX_HANDLE_LEN;
+    sizes[USER_ROOM] = ROOM_NAME_LEN;
+
+    shards = calloc(n, sizeof(*shards));
+    if (shards == NULL) {
+        perror("[chat:init:calloc]");
+        exit(EXIT_FAILURE);
+    }
+
+    pool_init(&shard_msgs, sizeof(struct shard_msg));
+    if (shard_msgs == NULL) {
+        perror("[chat:init:pool_init]");
+        exit(EXIT_FAILURE);
+    }
+
+    nshards = n;
+    for (i = 0; i < n; i++) {
+        shards[i].reactor = reactors[i];
+        mpsc_init(&shards[i].inbox, SHARD_INBOX);
+        if (shards[i].inbox == NULL) {
+            perror("[chat:init:mpsc_init]");
+            exit(EXIT_FAILURE);
+        }
+        /* Initialize the shard's user table */
+        slotmap_init(&shards[i].users, USER_COLUMNS, sizes);
+        if (shards[i].users == NULL) {
+            perror("[chat:init:slotmap_init]");
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    /* Every reactor thread reads the handle directory as its shard */
+    if (directory_init(n) == -1) {
+        perror("[chat:init:directory_init]");
+        exit(EXIT_FAILURE);
+    }
+
+    if (room_global_init(n) == -1) {
+        perror("[chat:init:room_global_init]");
+        exit(EXIT_FAILURE);
+    }
+
+    /* the lobby picks up where the last run left off */
+    if (cfg->log_dir != NULL) {
+        if (msglog_open(&journal, cfg->log_dir, cfg->log_fsync) == -1) {
+            fprintf(stderr, "[chat:init:msglog_open]: failed to open %s\n",
+                    cfg->log_dir);
+            exit(EXIT_FAILURE);
+        }
+        chat_page_in(0, ROOM_LOBBY, ROOM_LOBBY_NAME);
+    }
 }
 
-int user_compare(void *puser, void *psock)
+void chat_global_destroy(void)
 {
-    int sock;
-    struct user *u;
+    unsigned i;
+    struct shard_msg *m;
+
+    for (i = 0; i < nshards; i++) {
+        while (shards[i].inbox != NULL
+                && (m = mpsc_pop(shards[i].inbox)) != NULL) {
+            message_unref(m->text);
+            message_unref(m->frame);
+            pool_free(shard_msgs, m);
+        }
+
+        slotmap_destroy(&shards[i].users);
+        mpsc_destroy(&shards[i].inbox);
+    }
+
+    msglog_close(&journal);
 
-    u = (struct user*)puser;
-    sock = (int)psock;
+    if (shards != NULL) {
+        room_global_destroy();
+        directory_destroy();
+    }
+    pool_destroy(&shard_msgs);
 
-    return (u->sock < sock ? -1 :
-            (u->sock == sock ? 0 : 1));
+    free(shards);
+    shards = NULL;
+    nshards = 0;
 }
 
-/** Chat functions **/
+/** Shard functions **/
+
+/**
+ * Queues a message on another shard's inbox without taking a lock,
+ * waking its reactor unless someone already has.  It goes to the
+ * shard's members of a room, or only to user unless that is
+ * SLOTMAP_NONE.  from is the shard of the calling thread; a message
+ * that finds the inbox full is dropped and counted there
+ */
+static void shard_post(unsigned from, struct shard *sh, uint32_t room,
+        unsigned long user, struct message *text, struct message *frame)
+{
+    struct shard_msg *m;
+
+    m = pool_alloc(shard_msgs);
+    if (m == NULL) {
+        perror("[chat:post:pool_alloc]");
+        return;
+    }
 
-void chat_global_init(void)
+    m->room = room;
+    m->user = user;
+    m->text = text ? message_ref(text) : NULL;
+    m->frame = frame ? message_ref(frame) : NULL;
+
+    if (mpsc_push(sh->inbox, m) == -1) {
+        stats_add(from, STAT_DROPS, 1);
+        message_unref(m->text);
+        message_unref(m->frame);
+        pool_free(shard_msgs, m);
+        return;
+    }
+
+    /* pairs with the exchange in chat_deliver, so either it sees m or we wake it */
+    if (!atomic_exchange(&sh->signalled, 1))
+        reactor_wake(sh->reactor);
+}
+
+/**
+ * Queues a message for every user of a room in a shard, in the form
+ * their framing expects.  Each user's queue takes a reference rather
+ * than a copy.  Must be called from the shard's reactor thread
+ */
+static void shard_fanout(struct shard *sh, uint32_t room,
+        struct message *text, struct message *frame)
 {
-    pthread_mutex_init(&mtx_user_list, NULL);
+    struct client_info **cis;
+    struct message *m;
+    size_t i, n;
+
+    /* reactor_send only defers closes, so the index holds still */
+    cis = room_members((unsigned)(sh - shards), room, &n);
+    if (cis == NULL)
+        return;
 
-    pthread_mutex_lock(&mtx_user_list);
-    /* Initialize the chat user list */
-    list_init(&users, user_deallocate, user_compare);
-    pthread_mutex_unlock(&mtx_user_list);
+    for (i = 0; i < n; i++) {
+        m = cis[i]->framing == FRAMING_BINARY ? frame : text;
+        if (m != NULL)
+            reactor_send(cis[i], m);
+    }
 }
 
-void chat_global_destroy(void)
+/**
+ * Queues a message for one user of a shard, if it is still
+ * connected.  Must be called from the shard's reactor thread
+ */
+static void shard_direct(struct shard *sh, unsigned long user,
+        struct message *text, struct message *frame)
+{
+    struct client_info **ci;
+    struct message *m;
+
+    ci = slotmap_at(sh->users, user, USER_CI);
+    if (ci == NULL)
+        return;
+
+    m = (*ci)->framing == FRAMING_BINARY ? frame : text;
+    if (m != NULL)
+        reactor_send(*ci, m);
+}
+
+void chat_deliver(unsigned shard)
 {
-    pthread_mutex_lock(&mtx_user_list);
-    list_destroy(&users);
-    pthread_mutex_unlock(&mtx_user_list);
+    struct shard *sh;
+    struct shard_msg *m;
+    size_t n;
+
+    sh = &shards[shard];
+    atomic_exchange(&sh->signalled, 0);
 
-    pthread_mutex_destroy(&mtx_user_list);
+    for (n = 0; n < SHARD_INBOX && (m = mpsc_pop(sh->inbox)) != NULL; n++) {
+        if (m->user != SLOTMAP_NONE)
+            shard_direct(sh, m->user, m->text, m->frame);
+        else
+            shard_fanout(sh, m->room, m->text, m->frame);
+        message_unref(m->text);
+        message_unref(m->frame);
+        pool_free(shard_msgs, m);
+    }
+
+    /* posters keep up with us, so come back after the other events */
+    if (n == SHARD_INBOX && !atomic_exchange(&sh->signalled, 1))
+        reactor_wake(sh->reactor);
 }
 
+/** Chat functions **/
+
 void trim_ending(char *line)
 {
     size_t len, i;
@@ -99,7 +361,23 @@ void trim_ending(char *line)
     } 
 }
 
-void handle_cmd(char *cmd)
+/**
+ * Checks that a handle or room name holds no control characters, as
+ * both are sent to text clients as they are
+ *
+ * \return          1 if it holds none, 0 otherwise
+ */
+static int chat_printable(const char *name)
+{
+    for (; *name != '\0'; name++) {
+        if ((unsigned char)*name < 0x20 || *name == 0x7f)
+            return 0;
+    }
+
+    return 1;
+}
+
+void handle_cmd(struct client_info *ci, char *cmd)
 {
     char *c, *save;
     size_t cmdlen;
@@ -114,157 +392,743 @@ void handle_cmd(char *cmd)
     cmd = c;
     cmdlen = strlen(cmd);
     if (strncmp(cmd, "who", MAX_CMD_LEN) == 0) {
-
+        chat_who(ci, strtok_r(NULL, " ", &save));
     } else if (strcmp(cmd, "server") == 0) {
-        chat_broadcast(-1, SERVER_NAME);
+        chat_info(ci, SERVER_NAME);
+    } else if (strcmp(cmd, "join") == 0) {
+        c = strtok_r(NULL, " ", &save);
+        if (c != NULL)
+            chat_join(ci, c);
+    } else if (strcmp(cmd, "part") == 0) {
+        if (ci->room == ROOM_LOBBY)
+            chat_notice(ci, FRAME_ERROR, str_room_lobby, ARR_SIZE(str_room_lobby) - 1);
+        else
+            chat_join(ci, ROOM_LOBBY_NAME);
+    } else if (strcmp(cmd, "rooms") == 0) {
+        chat_rooms(ci);
+    } else if (strcmp(cmd, "msg") == 0) {
+        c = strtok_r(NULL, " ", &save);
+        while (save != NULL && *save == ' ')
+            save++;
+        if (c != NULL && save != NULL && *save != '\0')
+            chat_direct(ci, c, save, strlen(save));
     } else {
         printf("%s", cmd);
     }
 }
 
-void parse_message(int from_sock, char buffer[], size_t sz)
+/**
+ * Returns the handle of a registered client.  Must be called from
+ * the client's reactor thread
+ */
+static const char *chat_handle(struct client_info *ci)
+{
+    return slotmap_at(shards[reactor_id(ci->reactor)].users, ci->user,
+            USER_HANDLE);
+}
+
+/**
+ * Returns the id of a registered client.  Must be called from the
+ * client's reactor thread
+ */
+static uint32_t chat_user_id(struct client_info *ci)
+{
+    return *(uint32_t*)slotmap_at(shards[reactor_id(ci->reactor)].users,
+            ci->user, USER_ID);
+}
+
+/**
+ * Formats a message for text clients, replacing control characters
+ * a sender may have slipped into it.  Sized for the message, as a
+ * binary client may say more than fits on a text line
+ */
+static struct message *chat_text(const char *tag, const char *msg, size_t len)
+{
+    struct message *m;
+    int nwritten;
+    size_t cap, i;
+
+    cap = strlen(tag) + len + TAG_PADDING;
+    m = message_alloc(cap);
+    if (m == NULL)
+        return NULL;
+
+    nwritten = snprintf(m->data, cap, FMT_MESSAGE, tag, (int)len, msg);
+    if (nwritten < 0) {
+        message_unref(m);
+        return NULL;
+    }
+
+    m->len = (size_t)nwritten < cap ? (size_t)nwritten : cap - 1;
+    for (i = 0; i + 1 < m->len; i++) {
+        if ((unsigned char)m->data[i] < 0x20 || m->data[i] == 0x7f)
+            m->data[i] = ' ';
+    }
+
+    return m;
+}
+
+/**
+ * Broadcasts what a user said, and remembers it for whoever joins
+ * the room next
+ */
+static void chat_say(struct client_info *ci, const char *msg, size_t len)
+{
+    struct message *text, *frame;
+    long long born;
+
+    born = stats_now();
+    stats_add(reactor_id(ci->reactor), STAT_MSGS_IN, 1);
+
+    /* the frame is built even with no binary client about, as the room
+     * remembers both forms for whoever joins later */
+    text = chat_text(chat_handle(ci), msg, len);
+    frame = proto_message(FRAME_MSG, chat_user_id(ci), ci->room, msg, len);
+
+    if (text != NULL)
+        text->born = born;
+    if (frame != NULL)
+        frame->born = born;
+
+    if (text != NULL) {
+        room_record(reactor_id(ci->reactor), ci->room, text, frame);
+        if (journal != NULL)
+            msglog_append(journal, slotmap_at(shards[reactor_id(ci->reactor)].users,
+                        ci->user, USER_ROOM), text);
+    }
+    chat_broadcast(ci, text, frame);
+    message_unref(text);
+    message_unref(frame);
+}
+
+/**
+ * Broadcasts a notice from the server
+ */
+static void chat_info(struct client_info *ci, const char *msg)
+{
+    struct message *text, *frame = NULL;
+
+    text = chat_text(TAG_INFO, msg, strlen(msg));
+    if (atomic_load_explicit(&nbinary, memory_order_relaxed) > 0)
+        frame = proto_message(FRAME_INFO, 0, ci->room, msg, strlen(msg));
+
+    chat_broadcast(ci, text, frame);
+    message_unref(text);
+    message_unref(frame);
+}
+
+/**
+ * Tells a user's room that the user joined or left it.  fmt
+ * takes the handle and the name of the room
+ */
+static void chat_announce(struct client_info *ci, unsigned type,
+        const char *fmt)
+{
+    struct message *text, *frame = NULL;
+    const char *handle;
+    char name[ROOM_NAME_LEN];
+    char line[MAX_HANDLE_LEN + ROOM_NAME_LEN + ARR_SIZE(FMT_ROOM_JOIN)];
+
+    handle = chat_handle(ci);
+    room_name(ci->room, name);
+    snprintf(line, ARR_SIZE(line), fmt, handle, name);
+
+    text = chat_text(TAG_INFO, line, strlen(line));
+    if (atomic_load_explicit(&nbinary, memory_order_relaxed) > 0)
+        frame = proto_message(type, chat_user_id(ci), ci->room, handle,
+                strlen(handle));
+
+    chat_broadcast(ci, text, frame);
+    message_unref(text);
+    message_unref(frame);
+}
+
+/**
+ * Moves a user into a room, telling both the room it leaves and the
+ * one it joins.  The user stays where it is if the room can't be joined
+ */
+static void chat_join(struct client_info *ci, const char *name)
+{
+    uint32_t room;
+    unsigned long member;
+    unsigned shard;
+    int created;
+
+    if (strlen(name) >= ROOM_NAME_LEN) {
+        chat_notice(ci, FRAME_ERROR, str_room_too_long, ARR_SIZE(str_room_too_long) - 1);
+        return;
+    } else if (!chat_printable(name)) {
+        chat_notice(ci, FRAME_ERROR, str_room_invalid, ARR_SIZE(str_room_invalid) - 1);
+        return;
+    }
+
+    /* checked first, as joining and leaving again would redo every page of /who */
+    shard = reactor_id(ci->reactor);
+    if (strcmp(slotmap_at(shards[shard].users, ci->user, USER_ROOM), name) == 0) {
+        chat_notice(ci, FRAME_ERROR, str_room_same, ARR_SIZE(str_room_same) - 1);
+        return;
+    }
+
+    created = room_join(shard, name, chat_handle(ci), ci, &room, &member);
+    if (created == -1) {
+        chat_notice(ci, FRAME_ERROR, str_room_full, ARR_SIZE(str_room_full) - 1);
+        return;
+    }
+
+    chat_announce(ci, FRAME_PART, FMT_ROOM_PART);
+    room_leave(shard, ci->room, ci->member);
+
+    ci->room = room;
+    ci->member = member;
+    strcpy(slotmap_at(shards[shard].users, ci->user, USER_ROOM), name);
+
+    if (created)
+        chat_page_in(shard, room, name);
+    chat_replay(ci);
+    chat_announce(ci, FRAME_JOIN, FMT_ROOM_JOIN);
+}
+
+/**
+ * Fills the history of a room that was just created with what the
+ * log remembers of it.  The log keeps only the text line, neither the
+ * sender's id nor the payload as it was sent, so binary clients are
+ * replayed each line as an INFO frame
+ */
+static void chat_page_in(unsigned shard, uint32_t room, const char *name)
+{
+    struct message *history[ROOM_HISTORY], *frame;
+    size_t i, n, len;
+
+    if (journal == NULL)
+        return;
+
+    n = msglog_recent(journal, name, history, ARR_SIZE(history));
+    for (i = 0; i < n; i++) {
+        len = history[i]->len;
+        if (len > 0 && history[i]->data[len - 1] == '\n')
+            len--;
+
+        frame = proto_message(FRAME_INFO, 0, room, history[i]->data, len);
+        room_record(shard, room, history[i], frame);
+        message_unref(frame);
+        message_unref(history[i]);
+    }
+}
+
+/**
+ * Catches a user up on what was last said in its room.  The messages
+ * are queued back to back, so they go out in the same gather write
+ */
+static void chat_replay(struct client_info *ci)
+{
+    struct message *history[ROOM_HISTORY];
+    size_t i, n;
+
+    /* replayed messages were received long ago, don't time them */
+    ci->out.since = stats_now();
+    n = room_history(reactor_id(ci->reactor), ci->room,
+            ci->framing == FRAMING_BINARY, history, ARR_SIZE(history));
+    for (i = 0; i < n; i++) {
+        reactor_send(ci, history[i]);
+        message_unref(history[i]);
+    }
+}
+
+/**
+ * Sends a message to the user registered under a handle only,
+ * whichever shard owns it
+ */
+static void chat_direct(struct client_info *ci, const char *handle,
+        const char *msg, size_t len)
+{
+    struct dir_entry entry;
+    struct message *text, *frame = NULL;
+    char tag[2 * MAX_HANDLE_LEN + ARR_SIZE(FMT_DIRECT_TAG)];
+    unsigned shard;
+    long long born;
+
+    born = stats_now();
+    shard = reactor_id(ci->reactor);
+    stats_add(shard, STAT_MSGS_IN, 1);
+    if (directory_lookup(shard, handle, &entry) == -1) {
+        chat_notice(ci, FRAME_ERROR, str_no_such_user, ARR_SIZE(str_no_such_user) - 1);
+        return;
+    }
+
+    snprintf(tag, ARR_SIZE(tag), FMT_DIRECT_TAG, chat_handle(ci), entry.handle);
+    text = chat_text(tag, msg, len);
+    if (atomic_load_explicit(&nbinary, memory_order_relaxed) > 0)
+        frame = proto_message(FRAME_DIRECT, chat_user_id(ci), 0, msg, len);
+
+    if (text == NULL && frame == NULL) {
+        perror("[chat:direct:malloc]");
+        return;
+    }
+
+    if (text != NULL)
+        text->born = born;
+    if (frame != NULL)
+        frame->born = born;
+
+    if (entry.shard == shard)
+        shard_direct(&shards[shard], entry.user, text, frame);
+    else
+        shard_post(shard, &shards[entry.shard], ROOM_LOBBY, entry.user, text, frame);
+
+    message_unref(text);
+    message_unref(frame);
+}
+
+/**
+ * Tells a user which rooms there are
+ */
+static void chat_rooms(struct client_info *ci)
+{
+    char *list;
+    size_t len;
+
+    list = room_list(&len);
+    if (list == NULL) {
+        perror("[chat:rooms:malloc]");
+        return;
+    }
+
+    chat_notice(ci, FRAME_INFO, list, len);
+    free(list);
+}
+
+/**
+ * Sends a client a page of who is in its room, 1 if none is given.
+ * The room keeps each page ready in both framings
+ */
+static void chat_who(struct client_info *ci, const char *page)
+{
+    struct message *m;
+    unsigned long n = 1;
+    char *end;
+
+    if (page != NULL) {
+        n = strtoul(page, &end, 10);
+        if (*end != '\0')
+            n = 0;
+    }
+
+    m = n > 0 ? room_who(reactor_id(ci->reactor), ci->room, n - 1,
+            ci->framing == FRAMING_BINARY) : NULL;
+    if (m == NULL) {
+        chat_notice(ci, FRAME_ERROR, str_no_such_page, ARR_SIZE(str_no_such_page) - 1);
+        return;
+    }
+
+    reactor_send(ci, m);
+    message_unref(m);
+}
+
+void parse_message(struct client_info *ci, char buffer[], size_t sz)
 {
     if (sz == 0 || strlen(buffer) == 0)
         return;
 
     trim_ending(buffer);
     if (buffer[0] == '/') {
-        handle_cmd(buffer + 1);
+        handle_cmd(ci, buffer + 1);
     } else {
-        chat_broadcast(from_sock, buffer);
-    }
-}
-
-void chat_run(struct client_info *ci)
-{
-    struct pollfd fds[1];
-    int client_stop = 0, err;
-    ssize_t nset, nrecv;
-    char buffer[MAX_BUFFER] = { 0 };
-    struct user *u;
-
-    err = chat_register_user(ci->sock);
-    if (err == -1)
-        goto chat_exit;
-
-    fds[0].fd = ci->sock;
-    fds[0].events = POLLIN | POLLHUP;
-
-    do {
-        nset = poll(fds, ARR_SIZE(fds), -1);
-        if (nset >= 1) {
-            if (fds[0].revents & POLLIN) {
-                /* Read input */
-                nrecv = recv(fds[0].fd, buffer, ARR_SIZE(buffer) - 1, 0);
-                if (nrecv > 0) {
-                    buffer[nrecv] = '\0';
-                    parse_message(fds[0].fd, buffer, nrecv);
-                } else if (nrecv == 0) {
-                    client_stop = 1;
-                }
-            }
-
-            if (fds[0].revents & POLLHUP) {
-                /* Client hung up! */
-                client_stop = 1;
-            }
-        }
-    } while (!client_stop);
+        chat_say(ci, buffer, sz);
+    }
+}
+
+/**
+ * Queues a notice for a single client.  Delivery never blocks the
+ * event loop; slow clients are handled by the reactor's policy
+ *
+ * \return          0 on success, -1 if the connection failed
+ */
+static int chat_send(struct client_info *ci, const char *msg, size_t len)
+{
+    struct message *m;
+    int err;
 
-    pthread_mutex_lock(&mtx_user_list);
-    u = list_find(users, (void*)(long)ci->sock);
-    if (u)
-        list_remove(users, u);
-    pthread_mutex_unlock(&mtx_user_list);
+    m = message_new(msg, len);
+    if (m == NULL) {
+        perror("[chat:send:malloc]");
+        return -1;
+    }
 
-chat_exit:
-    return;
+    err = reactor_send(ci, m);
+    message_unref(m);
+    return err;
 }
 
-/* Adds a new user to the chat session */
-int chat_register_user(int sock)
+/**
+ * Queues a notice for a single client in its own framing.  Binary
+ * clients get it as a frame of the given type, without the newline
+ */
+static int chat_notice(struct client_info *ci, unsigned type,
+        const char *msg, size_t len)
 {
-    size_t nwritten;
-    ssize_t nsent, nrecv;
-    struct user *u;
-    char buffer[MAX_BUFFER] = { 0 };
-    char reg_str[MAX_HANDLE_LEN + ARR_SIZE(FMT_REGISTER_DONE)] = { 0 };
+    struct message *m;
+    int err;
+
+    if (ci->framing != FRAMING_BINARY)
+        return chat_send(ci, msg, len);
+
+    if (len > 0 && msg[len - 1] == '\n')
+        len--;
 
-send_register_msg:
-    /* first we need to register a user */
-    nsent = send(sock, str_register_user, ARR_SIZE(str_register_user), 0);
-    if (nsent == -1) {
-        perror("[chat:register:send]");
+    m = proto_message(type, 0, 0, msg, len);
+    if (m == NULL) {
+        perror("[chat:notice:malloc]");
         return -1;
     }
 
-    nrecv = recv(sock, buffer, ARR_SIZE(buffer), 0);
-    if (nrecv == -1) {
-        perror("[chat:register:recv]");
+    err = reactor_send(ci, m);
+    message_unref(m);
+    return err;
+}
+
+/**
+ * Asks a text client for its handle.  Binary clients register with
+ * a frame and are never prompted
+ */
+static void chat_prompt(struct client_info *ci)
+{
+    if (ci->framing != FRAMING_BINARY)
+        chat_send(ci, str_register_user, ARR_SIZE(str_register_user) - 1);
+}
+
+/**
+ * Charges a message or command to the client's flood control budget,
+ * telling the client once when what it sends starts being dropped
+ *
+ * \return          0 if it may be handled, -1 if it is dropped
+ */
+static int chat_flood(struct client_info *ci)
+{
+    if (reactor_charge(ci) == 0)
+        return 0;
+
+    if (!ci->flooded)
+        chat_notice(ci, FRAME_ERROR, str_flooding, ARR_SIZE(str_flooding) - 1);
+    ci->flooded = 1;
+    stats_add(reactor_id(ci->reactor), STAT_FLOOD_DROPS, 1);
+    return -1;
+}
+
+void chat_connect(struct client_info *ci)
+{
+    chat_prompt(ci);
+}
+
+/**
+ * Handles one complete line from a client
+ */
+static int chat_line(void *pci, char *line, size_t len)
+{
+    struct client_info *ci;
+
+    ci = pci;
+    if (ci->closing)
         return -1;
-    } else if (nrecv == 0) {
+
+    if (ci->state == CLIENT_AWAITING_HANDLE) {
+        chat_register_user(ci, line, len);
+        return 0;
+    }
+
+    if (chat_flood(ci) == -1)
+        return 0;
+
+    /* messages keep their old length limit */
+    if (len > MAX_BUFFER - 1) {
+        len = MAX_BUFFER - 1;
+        line[len] = '\0';
+    }
+
+    parse_message(ci, line, len);
+    return 0;
+}
+
+/**
+ * Handles one complete frame from a binary client
+ */
+static int chat_frame(void *pci, char *body, size_t len)
+{
+    struct client_info *ci;
+    struct frame fr;
+    char buffer[MAX_BUFFER];
+
+    ci = pci;
+    if (ci->closing)
         return -1;
-    } else if (nrecv > MAX_HANDLE_LEN) {
-        send(sock, str_handle_too_long, ARR_SIZE(str_handle_too_long), 0);
-        goto send_register_msg;
-    } 
 
-    /* Strip newline, carriage return */
-    buffer[nrecv - 2] = '\0';    
-    nwritten = (size_t)snprintf(reg_str, ARR_SIZE(reg_str), FMT_REGISTER_DONE, buffer);
+    if (proto_decode(body, len, &fr) == -1)
+        return -1;
+
+    if (ci->state == CLIENT_AWAITING_HANDLE) {
+        if (fr.type != FRAME_HELLO)
+            return 0;
 
-    /* Add user to list */
-    u = calloc(1, sizeof(*u));
-    u->sock = sock;
-    strncpy(u->handle, buffer, MAX_HANDLE_LEN);
+        /* an overlong handle stays overlong so it gets refused */
+        len = fr.len < MAX_HANDLE_LEN ? fr.len : MAX_HANDLE_LEN;
+        memcpy(buffer, fr.payload, len);
+        buffer[len] = '\0';
+        chat_register_user(ci, buffer, strlen(buffer));
+        return 0;
+    }
 
-    pthread_mutex_lock(&mtx_user_list);
-    list_add(users, u);
-    pthread_mutex_unlock(&mtx_user_list);
+    if ((fr.type == FRAME_MSG || fr.type == FRAME_CMD) && chat_flood(ci) == -1)
+        return 0;
 
-    chat_broadcast(-1, reg_str);
+    if (fr.type == FRAME_MSG) {
+        /* a message names the room it is for, which must be the sender's */
+        if (fr.room != ci->room)
+            chat_notice(ci, FRAME_ERROR, str_room_wrong, ARR_SIZE(str_room_wrong) - 1);
+        else if (fr.len > 0)
+            chat_say(ci, fr.payload, fr.len);
+    } else if (fr.type == FRAME_CMD) {
+        /* a command is copied with the limit of a text line */
+        len = fr.len < MAX_BUFFER - 1 ? fr.len : MAX_BUFFER - 1;
+        memcpy(buffer, fr.payload, len);
+        buffer[len] = '\0';
+        trim_ending(buffer);
+        handle_cmd(ci, buffer);
+    }
 
     return 0;
 }
 
-/* Sends a message to a user */
-void chat_send_to_user(void *puser, void *pmsg)
+void chat_receive(struct client_info *ci, char *data, size_t sz)
 {
-    ssize_t nsent;
-    struct user *u;
-    const char *msg;
+    int err;
 
-    u = (struct user*)puser;
-    msg = (const char*)pmsg;
+    /* a zero byte can never start a handle, so it selects binary frames */
+    if (ci->framing == FRAMING_UNKNOWN && sz > 0) {
+        if (data[0] == PROTO_BINARY) {
+            ci->framing = FRAMING_BINARY;
+            atomic_fetch_add_explicit(&nbinary, 1, memory_order_relaxed);
+            chat_send(ci, data, 1);
+            data++;
+            sz--;
+        } else {
+            ci->framing = FRAMING_TEXT;
+        }
+    }
 
-    nsent = send(u->sock, msg, strlen(msg), 0);
-    if (nsent == -1) {
-        perror("[chat:send_to_user]");
+    if (ci->framing == FRAMING_BINARY)
+        err = framer_feed_frames(&ci->in, data, sz, PROTO_MAX_FRAME, chat_frame, ci);
+    else
+        err = framer_feed(&ci->in, data, sz, chat_line, ci);
+
+    if (err == -1 && !ci->closing) {
+        fprintf(stderr, "[chat:receive]: malformed input, closing connection\n");
+        reactor_close_client(ci);
+    }
+}
+
+void chat_ping(struct client_info *ci)
+{
+    chat_notice(ci, FRAME_PING, "", 0);
+}
+
+void chat_disconnect(struct client_info *ci)
+{
+    unsigned shard;
+
+    if (ci->framing == FRAMING_BINARY)
+        atomic_fetch_sub_explicit(&nbinary, 1, memory_order_relaxed);
+
+    if (ci->user == SLOTMAP_NONE)
         return;
+
+    shard = reactor_id(ci->reactor);
+    room_leave(shard, ci->room, ci->member);
+    directory_release(shard, chat_handle(ci));
+    slotmap_remove(shards[shard].users, ci->user);
+
+    ci->user = SLOTMAP_NONE;
+}
+
+int chat_save(struct client_info *ci, struct chat_user *u)
+{
+    if (ci->user == SLOTMAP_NONE)
+        return -1;
+
+    memset(u, 0, sizeof(*u));
+    u->id = chat_user_id(ci);
+    u->room = ci->room;
+    strncpy(u->handle, chat_handle(ci), HANDLE_BUFFER - 1);
+    memcpy(u->room_name, slotmap_at(shards[reactor_id(ci->reactor)].users,
+                ci->user, USER_ROOM), ROOM_NAME_LEN);
+    return 0;
+}
+
+int chat_restore(struct client_info *ci, const struct chat_user *u)
+{
+    unsigned long id;
+    unsigned shard;
+    int created;
+
+    if (ci->framing == FRAMING_BINARY)
+        atomic_fetch_add_explicit(&nbinary, 1, memory_order_relaxed);
+
+    if (u == NULL)
+        return 0;
+
+    if (strlen(u->handle) >= MAX_HANDLE_LEN) {
+        fprintf(stderr, "[chat:restore]: handle too long\n");
+        return -1;
     }
+
+    shard = reactor_id(ci->reactor);
+    id = slotmap_insert(shards[shard].users);
+    if (id == SLOTMAP_NONE) {
+        perror("[chat:restore:slotmap_insert]");
+        return -1;
+    }
+
+    if (directory_claim(shard, u->handle, shard, id) == -1) {
+        fprintf(stderr, "[chat:restore]: handle %s already in use\n", u->handle);
+        slotmap_remove(shards[shard].users, id);
+        return -1;
+    }
+
+    created = room_rejoin(shard, u->room_name, u->room, u->handle, ci,
+            &ci->room, &ci->member);
+    if (created == -1) {
+        directory_release(shard, u->handle);
+        slotmap_remove(shards[shard].users, id);
+        return -1;
+    }
+
+    if (created)
+        chat_page_in(shard, ci->room, u->room_name);
+
+    *(struct client_info**)slotmap_at(shards[shard].users, id, USER_CI) = ci;
+    *(uint32_t*)slotmap_at(shards[shard].users, id, USER_ID) = u->id;
+    strcpy(slotmap_at(shards[shard].users, id, USER_HANDLE), u->handle);
+    strcpy(slotmap_at(shards[shard].users, id, USER_ROOM), u->room_name);
+
+    ci->user = id;
+    reactor_client_registered(ci);
+
+    /* users registering from now on get ids the old server never handed out */
+    if (u->id >= atomic_load(&next_user_id))
+        atomic_store(&next_user_id, u->id + 1);
+
+    return 0;
 }
 
-/* Broadcasts a message to all users */
-void chat_broadcast(int from_sock, const char *msg)
+/* Adds a new user to the chat session */
+int chat_register_user(struct client_info *ci, char buffer[], size_t sz)
 {
-    struct user *user;
-    const char *handle;
-    char formatted[MAX_MSG_LEN];
+    struct dir_entry entry;
+    struct message *text, *frame = NULL;
+    unsigned long id;
+    unsigned shard;
+    uint32_t uid;
+    char reg_str[MAX_HANDLE_LEN + ARR_SIZE(FMT_REGISTER_DONE)] = { 0 };
 
+    /* Strip newline, carriage return */
+    while (sz > 0 && (buffer[sz - 1] == '\n' || buffer[sz - 1] == '\r'))
+        buffer[--sz] = '\0';
 
-    if (from_sock == -1) {
-        handle = TAG_INFO;
-    } else {
-        pthread_mutex_lock(&mtx_user_list);
-        user = list_find(users, (void*)(long)from_sock);
-        pthread_mutex_unlock(&mtx_user_list);
-        handle = user->handle;
+    if (sz == 0) {
+        chat_prompt(ci);
+        return -1;
+    } else if (sz >= MAX_HANDLE_LEN) {
+        chat_notice(ci, FRAME_ERROR, str_handle_too_long, ARR_SIZE(str_handle_too_long) - 1);
+        chat_prompt(ci);
+        return -1;
+    } else if (!chat_printable(buffer)) {
+        chat_notice(ci, FRAME_ERROR, str_handle_invalid, ARR_SIZE(str_handle_invalid) - 1);
+        chat_prompt(ci);
+        return -1;
+    }
+
+    /* Turn away taken handles without touching the writers' locks */
+    shard = reactor_id(ci->reactor);
+    if (directory_lookup(shard, buffer, &entry) == 0) {
+        chat_notice(ci, FRAME_ERROR, str_handle_taken, ARR_SIZE(str_handle_taken) - 1);
+        chat_prompt(ci);
+        return -1;
+    }
+
+    snprintf(reg_str, ARR_SIZE(reg_str), FMT_REGISTER_DONE, buffer);
+
+    /* Add user to the shard */
+    id = slotmap_insert(shards[shard].users);
+    if (id == SLOTMAP_NONE) {
+        perror("[chat:register:slotmap_insert]");
+        reactor_close_client(ci);
+        return -1;
     }
 
-    snprintf(formatted, MAX_MSG_LEN, FMT_MESSAGE, handle, msg);
+    /* Claim the handle, another shard may have raced us to it */
+    if (directory_claim(shard, buffer, shard, id) == -1) {
+        slotmap_remove(shards[shard].users, id);
+        chat_notice(ci, FRAME_ERROR, str_handle_taken, ARR_SIZE(str_handle_taken) - 1);
+        chat_prompt(ci);
+        return -1;
+    }
+
+    /* Everybody starts out in the lobby */
+    if (room_join(shard, ROOM_LOBBY_NAME, buffer, ci, &ci->room,
+                &ci->member) == -1) {
+        slotmap_remove(shards[shard].users, id);
+        directory_release(shard, buffer);
+        reactor_close_client(ci);
+        return -1;
+    }
+
+    uid = atomic_fetch_add_explicit(&next_user_id, 1, memory_order_relaxed);
+    *(struct client_info**)slotmap_at(shards[shard].users, id, USER_CI) = ci;
+    *(uint32_t*)slotmap_at(shards[shard].users, id, USER_ID) = uid;
+    strncpy(slotmap_at(shards[shard].users, id, USER_HANDLE), buffer,
+            MAX_HANDLE_LEN - 1);
+    strcpy(slotmap_at(shards[shard].users, id, USER_ROOM), ROOM_LOBBY_NAME);
+
+    ci->user = id;
+    reactor_client_registered(ci);
+
+    if (ci->framing == FRAMING_BINARY) {
+        frame = proto_message(FRAME_WELCOME, uid, 0, buffer, sz);
+        if (frame != NULL)
+            reactor_send(ci, frame);
+        message_unref(frame);
+        frame = NULL;
+    }
+
+    chat_replay(ci);
+
+    text = chat_text(TAG_INFO, reg_str, strlen(reg_str));
+    if (atomic_load_explicit(&nbinary, memory_order_relaxed) > 0)
+        frame = proto_message(FRAME_JOIN, uid, 0, buffer, sz);
+
+    chat_broadcast(ci, text, frame);
+    message_unref(text);
+    message_unref(frame);
+
+    return 0;
+}
+
+/* Broadcasts a message to every user in the sender's room */
+void chat_broadcast(struct client_info *from, struct message *text,
+        struct message *frame)
+{
+    unsigned i, origin;
+
+    if (text == NULL && frame == NULL) {
+        perror("[chat:broadcast:malloc]");
+        return;
+    }
+
+    /* other shards deliver asynchronously, ours directly, and only
+     * shards with members in the room are bothered at all */
+    origin = reactor_id(from->reactor);
+    for (i = 0; i < nshards; i++) {
+        if (i != origin && room_present(from->room, i))
+            shard_post(origin, &shards[i], from->room, SLOTMAP_NONE, text, frame);
+    }
 
-    /* format message */
-    pthread_mutex_lock(&mtx_user_list);
-    list_for_each(users, formatted, chat_send_to_user);
-    pthread_mutex_unlock(&mtx_user_list);
+    shard_fanout(&shards[origin], from->room, text, frame);
 }
@@ -7,50 +7,139 @@
 #ifndef ALLISONK_CHAT_H
 #define ALLISONK_CHAT_H
 
+#include <stdint.h>
+
+#include "room.h"
 #include "server.h"
 
 /**
- * Peforms all global need to init the chat server
+ * Peforms all global need to init the chat server.  Users are
+ * sharded by reactor; each reactor's thread owns its shard
+ *
+ * \param reactors  Reactors that own a shard each
+ * \param n         Number of reactors
+ * \param cfg       Server configuration
+ */
+void chat_global_init(struct reactor **reactors, unsigned n,
+        const struct server_config *cfg);
+
+/**
+ * Represents a registered chat user
+ */
+struct user;
+
+/**
+ * What a registered user takes along when its connection is handed
+ * over to another server
+ *
+ * id        Id identifying the user in binary frames
+ * room      Id of the room the user is in
+ * handle    Registered handle
+ * room_name Name of the room the user is in
+ */
+struct chat_user {
+    uint32_t id;
+    uint32_t room;
+    char handle[HANDLE_BUFFER];
+    char room_name[ROOM_NAME_LEN];
+};
+
+/**
+ * Called when a new connection has been accepted.
+ * Prompts the client for a handle
+ *
+ * \param ci        Newly accepted connection
+ */
+void chat_connect(struct client_info *ci);
+
+/**
+ * Called with data read from a connection.  Every complete line in
+ * the data is handled before returning; a trailing partial line is
+ * kept until the rest of it arrives
+ *
+ * \param ci        Connection the data arrived on
+ * \param data      Bytes received, modified in place
+ * \param sz        Number of bytes received
  */
-void chat_global_init(void);
+void chat_receive(struct client_info *ci, char *data, size_t sz);
 
 /**
- * Entry point for a chat client handler thread
+ * Delivers broadcasts other shards have queued for a shard.
+ * Called from the shard's reactor thread when it is woken
+ *
+ * \param shard     Index of the shard
  */
-void chat_run(struct client_info *ci);
+void chat_deliver(unsigned shard);
+
+/**
+ * Checks that a quiet binary client is still there by sending it a
+ * ping frame
+ *
+ * \param ci        Registered binary client
+ */
+void chat_ping(struct client_info *ci);
+
+/**
+ * Called before a connection is closed.  Removes the
+ * user bound to the connection, if any
+ *
+ * \param ci        Connection being closed
+ */
+void chat_disconnect(struct client_info *ci);
+
+/**
+ * Describes the user bound to a connection, to hand it over to
+ * another server.  Must be called from the connection's reactor
+ * thread, or while no reactor is running
+ *
+ * \param ci        Connection to describe
+ * \param u         Filled with the user
+ * \return          0 on success, -1 if the connection has not registered
+ */
+int chat_save(struct client_info *ci, struct chat_user *u);
+
+/**
+ * Binds a connection handed over from another server to the user it
+ * had there, putting the user back in its room without telling
+ * anyone.  Must be called before the connection's reactor runs
+ *
+ * \param ci        Connection taken over, its framing already set
+ * \param u         User to restore, NULL if it had not registered
+ * \return          0 on success, -1 if the user could not be restored
+ */
+int chat_restore(struct client_info *ci, const struct chat_user *u);
 
 /**
  * Adds a new user to the chat session 
  *
- * \param sock      Socket to communicate on
+ * \param ci        Connection the handle arrived on
+ * \param buffer    Handle entered by the client
+ * \param sz        Size of buffer
  * \return          0 on success, -1 on failure
  */
-int chat_register_user(int sock);
+int chat_register_user(struct client_info *ci, char buffer[], size_t sz);
 
 /**
  * Parses a message received from a client
  * 
- * \param from_sock Socket we received message on
+ * \param ci        Connection we received message on
  * \param buffer    Buffer recieved
  * \param sz        Size of buffer
  */
-void parse_message(int from_sock, char buffer[], size_t sz);
-
-/**
- * Sends a message to a user
- *
- * \param psock     User to send to
- * \param pmsg      Message to send
- */
-void chat_send_to_user(void *psock, void *pmsg);
+void parse_message(struct client_info *ci, char buffer[], size_t sz);
 
 /**
- * Broadcasts a message to all users
+ * Broadcasts a message to every user in the sender's room.  The
+ * message comes formatted once for each framing into shared buffers;
+ * members in the sender's shard are queued directly, other shards
+ * with members in the room are handed a reference
  *
- * \param from_sock     Which user this came from
- * \param msg           Message to send
+ * \param from      Connection this came from
+ * \param text      Message for text clients
+ * \param frame     Message for binary clients, NULL if there are none
  */
-void chat_broadcast(int from_sock, const char *msg);
+void chat_broadcast(struct client_info *from, struct message *text,
+        struct message *frame);
 
 /**
  * Global cleanup for the chat client
@@ -0,0 +1,248 @@
+/**
+ * file: directory.c
+ *
+ * Read-mostly index of every registered handle across all shards.
+ * Lookups take no lock; claiming or releasing a handle publishes a
+ * new copy-on-write version of one stripe of the index, and replaced
+ * versions are reclaimed once no reader can still see them
+ */
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "directory.h"
+#include "generic/generic_epoch.h"
+#include "generic/generic_hash.h"
+
+#define DIR_STRIPES     64
+#define DIR_STRIPE_BITS 6
+#define DIR_MIN_CAP     8
+
+/** Type definitions **/
+
+/**
+ * An immutable open-addressing table of entries.  Empty slots have
+ * an empty handle
+ */
+struct dir_version {
+    size_t count;
+    size_t cap;
+    struct dir_entry slots[];
+};
+
+/**
+ * One stripe of the directory.  Writers of a stripe serialize on
+ * mtx_write; readers only load current
+ */
+struct dir_stripe {
+    _Atomic(struct dir_version *) current;
+    pthread_mutex_t mtx_write;
+};
+
+/** Declarations **/
+
+static struct dir_version *version_build(const struct dir_version *from,
+        const struct dir_entry *add, const char *drop);
+static const struct dir_entry *version_find(const struct dir_version *v,
+        const char *handle, unsigned long hv);
+static void version_deallocate(void *p);
+
+/** Definitions **/
+
+static struct dir_stripe stripes[DIR_STRIPES];
+static struct epoch *readers;
+
+/** Version functions **/
+
+static void version_deallocate(void *p)
+{
+    free(p);
+}
+
+static const struct dir_entry *version_find(const struct dir_version *v,
+        const char *handle, unsigned long hv)
+{
+    size_t i, mask;
+
+    if (v == NULL)
+        return NULL;
+
+    mask = v->cap - 1;
+    for (i = (hv >> DIR_STRIPE_BITS) & mask; v->slots[i].handle[0] != '\0';
+            i = (i + 1) & mask) {
+        if (strcmp(v->slots[i].handle, handle) == 0)
+            return &v->slots[i];
+    }
+
+    return NULL;
+}
+
+/**
+ * Builds a new version holding the entries of from, plus add
+ * and minus the entry for drop
+ */
+static struct dir_version *version_build(const struct dir_version *from,
+        const struct dir_entry *add, const char *drop)
+{
+    struct dir_version *v;
+    const struct dir_entry *e;
+    size_t count, cap, i, j, n;
+
+    count = (from ? from->count : 0) + (add ? 1 : 0);
+    for (cap = DIR_MIN_CAP; cap < count * 2; cap *= 2)
+        ;
+
+    v = calloc(1, sizeof(*v) + cap * sizeof(struct dir_entry));
+    if (v == NULL)
+        return NULL;
+
+    v->cap = cap;
+    n = from ? from->cap : 0;
+    for (i = 0; i <= n; i++) {
+        if (i < n) {
+            e = &from->slots[i];
+            if (e->handle[0] == '\0' || (drop && strcmp(e->handle, drop) == 0))
+                continue;
+        } else if (add) {
+            e = add;
+        } else {
+            break;
+        }
+
+        for (j = (hash_string((void*)e->handle) >> DIR_STRIPE_BITS) & (cap - 1);
+                v->slots[j].handle[0] != '\0'; j = (j + 1) & (cap - 1))
+            ;
+        v->slots[j] = *e;
+        v->count++;
+    }
+
+    return v;
+}
+
+/** Directory functions **/
+
+int directory_init(unsigned nthreads)
+{
+    unsigned i;
+
+    epoch_init(&readers, nthreads);
+    if (readers == NULL)
+        return -1;
+
+    for (i = 0; i < DIR_STRIPES; i++) {
+        atomic_init(&stripes[i].current, NULL);
+        pthread_mutex_init(&stripes[i].mtx_write, NULL);
+    }
+
+    return 0;
+}
+
+int directory_claim(unsigned tid, const char *handle, unsigned shard,
+        unsigned long user)
+{
+    struct dir_stripe *st;
+    struct dir_version *old, *v;
+    struct dir_entry add;
+    unsigned long hv;
+
+    if (strlen(handle) >= HANDLE_BUFFER)
+        return -1;
+
+    hv = hash_string((void*)handle);
+    st = &stripes[hv & (DIR_STRIPES - 1)];
+
+    memset(&add, 0, sizeof(add));
+    strcpy(add.handle, handle);
+    add.shard = shard;
+    add.user = user;
+
+    pthread_mutex_lock(&st->mtx_write);
+    old = atomic_load_explicit(&st->current, memory_order_relaxed);
+    if (version_find(old, handle, hv) != NULL) {
+        pthread_mutex_unlock(&st->mtx_write);
+        return -1;
+    }
+
+    v = version_build(old, &add, NULL);
+    if (v == NULL) {
+        pthread_mutex_unlock(&st->mtx_write);
+        perror("[directory:claim:calloc]");
+        return -1;
+    }
+
+    atomic_store_explicit(&st->current, v, memory_order_release);
+    pthread_mutex_unlock(&st->mtx_write);
+
+    if (old)
+        epoch_retire(readers, tid, old, version_deallocate);
+
+    return 0;
+}
+
+void directory_release(unsigned tid, const char *handle)
+{
+    struct dir_stripe *st;
+    struct dir_version *old, *v;
+    unsigned long hv;
+
+    hv = hash_string((void*)handle);
+    st = &stripes[hv & (DIR_STRIPES - 1)];
+
+    pthread_mutex_lock(&st->mtx_write);
+    old = atomic_load_explicit(&st->current, memory_order_relaxed);
+    if (version_find(old, handle, hv) == NULL) {
+        pthread_mutex_unlock(&st->mtx_write);
+        return;
+    }
+
+    v = version_build(old, NULL, handle);
+    if (v == NULL) {
+        /* leave the handle claimed rather than lose the whole stripe */
+        pthread_mutex_unlock(&st->mtx_write);
+        perror("[directory:release:calloc]");
+        return;
+    }
+
+    atomic_store_explicit(&st->current, v, memory_order_release);
+    pthread_mutex_unlock(&st->mtx_write);
+
+    epoch_retire(readers, tid, old, version_deallocate);
+}
+
+int directory_lookup(unsigned tid, const char *handle, struct dir_entry *entry)
+{
+    struct dir_version *v;
+    const struct dir_entry *e;
+    unsigned long hv;
+    int ret = -1;
+
+    hv = hash_string((void*)handle);
+
+    epoch_enter(readers, tid);
+    v = atomic_load_explicit(&stripes[hv & (DIR_STRIPES - 1)].current,
+            memory_order_acquire);
+    e = version_find(v, handle, hv);
+    if (e != NULL) {
+        *entry = *e;
+        ret = 0;
+    }
+    epoch_exit(readers, tid);
+
+    return ret;
+}
+
+void directory_destroy(void)
+{
+    unsigned i;
+
+    for (i = 0; i < DIR_STRIPES; i++) {
+        free(atomic_load_explicit(&stripes[i].current, memory_order_relaxed));
+        atomic_init(&stripes[i].current, NULL);
+        pthread_mutex_destroy(&stripes[i].mtx_write);
+    }
+
+    epoch_destroy(&readers);
+}
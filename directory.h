@@ -0,0 +1,73 @@
+/**
+ * file: directory.h
+ *
+ * Read-mostly index of every registered handle across all shards.
+ * Lookups take no lock; claiming or releasing a handle publishes a
+ * new copy-on-write version of one stripe of the index, and replaced
+ * versions are reclaimed once no reader can still see them
+ */
+
+#ifndef ALLISONK_DIRECTORY_H
+#define ALLISONK_DIRECTORY_H
+
+#include "server.h"
+
+/**
+ * Where a handle is connected
+ *
+ * handle    Registered handle
+ * shard     Shard (reactor) that owns the connection
+ * user      Id of the user in that shard's user table
+ */
+struct dir_entry {
+    char handle[HANDLE_BUFFER];
+    unsigned shard;
+    unsigned long user;
+};
+
+/**
+ * Initializes the directory
+ *
+ * \param nthreads  Number of threads that will use the directory.  Each
+ *                  identifies itself by an index below nthreads
+ * \return          0 on success, -1 on failure
+ */
+int directory_init(unsigned nthreads);
+
+/**
+ * Registers a handle if nobody holds it yet
+ *
+ * \param tid       Index of the calling thread
+ * \param handle    Handle to claim
+ * \param shard     Shard that owns the connection
+ * \param user      Id of the user in the shard's user table
+ * \return          0 on success, -1 if the handle is taken or on failure
+ */
+int directory_claim(unsigned tid, const char *handle, unsigned shard,
+        unsigned long user);
+
+/**
+ * Releases a claimed handle
+ *
+ * \param tid       Index of the calling thread
+ * \param handle    Handle to release
+ */
+void directory_release(unsigned tid, const char *handle);
+
+/**
+ * Looks a handle up without taking any lock
+ *
+ * \param tid       Index of the calling thread
+ * \param handle    Handle to look up
+ * \param entry     Filled with a copy of the entry when found
+ * \return          0 if found, -1 otherwise
+ */
+int directory_lookup(unsigned tid, const char *handle, struct dir_entry *entry);
+
+/**
+ * Releases every handle and the directory itself.  No thread
+ * may be using the directory
+ */
+void directory_destroy(void);
+
+#endif
@@ -0,0 +1,177 @@
+/**
+ * file: framer.c
+ *
+ * Splits a connection's byte stream into lines or length-prefixed
+ * frames
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "framer.h"
+
+#define FRAMER_MIN_CAP      64
+#define FRAMER_LEN_SIZE     4
+
+/** Declarations **/
+
+static int framer_carry(struct framer *f, const char *data, size_t sz,
+        size_t limit);
+static size_t framer_len(const char *p);
+
+/** Framer functions **/
+
+/**
+ * Appends part of a line or frame to the carried bytes, dropping
+ * whatever goes past limit
+ */
+static int framer_carry(struct framer *f, const char *data, size_t sz,
+        size_t limit)
+{
+    size_t cap;
+    char *buf;
+
+    if (sz > limit - f->len) {
+        sz = limit - f->len;
+        f->overflow = 1;
+    }
+
+    /* leave room to terminate the line */
+    if (f->len + sz + 1 > f->cap) {
+        for (cap = f->cap ? f->cap : FRAMER_MIN_CAP; cap < f->len + sz + 1; cap *= 2)
+            ;
+
+        buf = realloc(f->buf, cap);
+        if (buf == NULL)
+            return -1;
+
+        f->buf = buf;
+        f->cap = cap;
+    }
+
+    memcpy(f->buf + f->len, data, sz);
+    f->len += sz;
+    return 0;
+}
+
+int framer_feed(struct framer *f, char *data, size_t sz,
+        int (*on_line)(void *param, char *line, size_t len), void *param)
+{
+    char *nl, *line;
+    size_t n, len;
+
+    while (sz > 0) {
+        nl = memchr(data, '\n', sz);
+        if (nl == NULL)
+            return framer_carry(f, data, sz, FRAMER_MAX_LINE);
+
+        n = (size_t)(nl - data);
+        if (f->len > 0 || f->overflow) {
+            /* finish the line carried over from earlier reads */
+            if (framer_carry(f, data, n, FRAMER_MAX_LINE) == -1)
+                return -1;
+
+            line = f->buf;
+            len = f->len;
+            f->len = 0;
+            f->overflow = 0;
+        } else {
+            line = data;
+            len = n;
+        }
+
+        if (len > 0 && line[len - 1] == '\r')
+            len--;
+        line[len] = '\0';
+
+        data = nl + 1;
+        sz -= n + 1;
+
+        if (on_line(param, line, len) == -1)
+            return -1;
+    }
+
+    return 0;
+}
+
+static size_t framer_len(const char *p)
+{
+    const unsigned char *u;
+
+    u = (const unsigned char*)p;
+    return ((size_t)u[0] << 24) | ((size_t)u[1] << 16)
+        | ((size_t)u[2] << 8) | (size_t)u[3];
+}
+
+int framer_feed_frames(struct framer *f, char *data, size_t sz, size_t max,
+        int (*on_frame)(void *param, char *frame, size_t len), void *param)
+{
+    size_t len, n;
+
+    while (sz > 0) {
+        if (f->len > 0) {
+            /* finish the count, then the frame carried from earlier reads */
+            if (f->len < FRAMER_LEN_SIZE) {
+                n = FRAMER_LEN_SIZE - f->len;
+                n = n < sz ? n : sz;
+                if (framer_carry(f, data, n, FRAMER_LEN_SIZE) == -1)
+                    return -1;
+                data += n;
+                sz -= n;
+                if (f->len < FRAMER_LEN_SIZE)
+                    return 0;
+            }
+
+            len = framer_len(f->buf);
+            if (len > max)
+                return -1;
+
+            n = FRAMER_LEN_SIZE + len - f->len;
+            n = n < sz ? n : sz;
+            if (framer_carry(f, data, n, FRAMER_LEN_SIZE + max) == -1)
+                return -1;
+            data += n;
+            sz -= n;
+            if (f->len < FRAMER_LEN_SIZE + len)
+                return 0;
+
+            f->len = 0;
+            if (on_frame(param, f->buf + FRAMER_LEN_SIZE, len) == -1)
+                return -1;
+            continue;
+        }
+
+        if (sz < FRAMER_LEN_SIZE)
+            return framer_carry(f, data, sz, FRAMER_LEN_SIZE);
+
+        len = framer_len(data);
+        if (len > max)
+            return -1;
+
+        if (sz < FRAMER_LEN_SIZE + len)
+            return framer_carry(f, data, sz, FRAMER_LEN_SIZE + max);
+
+        data += FRAMER_LEN_SIZE + len;
+        sz -= FRAMER_LEN_SIZE + len;
+        if (on_frame(param, data - len, len) == -1)
+            return -1;
+    }
+
+    return 0;
+}
+
+int framer_restore(struct framer *f, const char *data, size_t len,
+        int overflow)
+{
+    if (framer_carry(f, data, len, f->len + len) == -1)
+        return -1;
+
+    f->overflow = overflow;
+    return 0;
+}
+
+void framer_clear(struct framer *f)
+{
+    free(f->buf);
+    memset(f, 0, sizeof(*f));
+}
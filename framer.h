@@ -0,0 +1,85 @@
+/**
+ * file: framer.h
+ *
+ * Splits a connection's byte stream into lines or length-prefixed
+ * frames
+ */
+
+#ifndef ALLISONK_FRAMER_H
+#define ALLISONK_FRAMER_H
+
+#include <stddef.h>
+
+/* Longest partial line carried between reads; the rest is dropped */
+#define FRAMER_MAX_LINE     1024
+
+/**
+ * Represents a connection's inbound framing state.  Complete lines
+ * and frames are handed out straight from the read buffer; only one
+ * that is still incomplete is copied here to wait for the next read
+ *
+ * buf       Start of the unfinished line or frame, NULL until one is carried
+ * len       Bytes carried in buf
+ * cap       Size of buf
+ * overflow  Set while dropping the rest of an overlong line
+ */
+struct framer {
+    char *buf;
+    size_t len;
+    size_t cap;
+    int overflow;
+};
+
+/**
+ * Splits received bytes into lines, ending each at LF or CRLF.
+ * Each line is passed NUL terminated without its line ending, and
+ * may be modified by the callback
+ *
+ * \param f         Framing state of the connection
+ * \param data      Bytes received, modified in place
+ * \param sz        Number of bytes received
+ * \param on_line   Called for every complete line, returns -1 to stop
+ * \param param     Parameter passed to on_line
+ * \return          0 on success, -1 if stopped or on failure
+ */
+int framer_feed(struct framer *f, char *data, size_t sz,
+        int (*on_line)(void *param, char *line, size_t len), void *param);
+
+/**
+ * Splits received bytes into frames, each prefixed with a 32 bit
+ * big-endian count of the bytes that follow it
+ *
+ * \param f         Framing state of the connection
+ * \param data      Bytes received
+ * \param sz        Number of bytes received
+ * \param max       Largest count accepted
+ * \param on_frame  Called for every complete frame with the bytes
+ *                  following the count, returns -1 to stop
+ * \param param     Parameter passed to on_frame
+ * \return          0 on success, -1 if stopped, on an oversized
+ *                  frame or on failure
+ */
+int framer_feed_frames(struct framer *f, char *data, size_t sz, size_t max,
+        int (*on_frame)(void *param, char *frame, size_t len), void *param);
+
+/**
+ * Carries bytes another framer had carried, so a connection handed
+ * over from another process picks up mid line or mid frame
+ *
+ * \param f         Empty framing state of the connection
+ * \param data      Bytes the other framer carried
+ * \param len       Number of bytes carried
+ * \param overflow  Whether the other framer was dropping an overlong line
+ * \return          0 on success, -1 on failure
+ */
+int framer_restore(struct framer *f, const char *data, size_t len,
+        int overflow);
+
+/**
+ * Drops any unfinished line and releases its buffer
+ *
+ * \param f         Framing state to clear
+ */
+void framer_clear(struct framer *f);
+
+#endif
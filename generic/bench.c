@@ -0,0 +1,401 @@
+/**
+ * file: bench.c
+ *
+ * Microbenchmarks for the generic containers.  Times each operation
+ * at sizes from 10 to 1M items and counts the heap allocations it
+ * makes, printing one line per container, operation and size.
+ * Allocations are counted by linking with --wrap for malloc, calloc
+ * and realloc, see the Makefile
+ */
+
+#define _POSIX_C_SOURCE 199309L
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "generic_list.h"
+#include "generic_hash.h"
+#include "generic_slotmap.h"
+#include "generic_pool.h"
+#include "generic_queue.h"
+#include "generic_wheel.h"
+
+#define MIN_SIZE        10UL
+#define MAX_SIZE        1000000UL
+/* Items visited by one run of a linear operation, bounds list_find */
+#define WORK            10000000UL
+#define OBJ_SIZE        64
+
+void *__real_malloc(size_t size);
+void *__real_calloc(size_t n, size_t size);
+void *__real_realloc(void *p, size_t size);
+void *__wrap_malloc(size_t size);
+void *__wrap_calloc(size_t n, size_t size);
+void *__wrap_realloc(void *p, size_t size);
+
+static void bench_start(void);
+static void bench_stop(const char *container, const char *op,
+        unsigned long n, unsigned long ops);
+static unsigned long next_random(void);
+static unsigned long linear_ops(unsigned long n);
+static void count_item(void *data, void *param);
+static void list_bench(unsigned long n);
+static void hash_bench(unsigned long n);
+static void slotmap_bench(unsigned long n);
+static void pool_bench(unsigned long n);
+static void queue_bench(unsigned long n);
+static void expire_timer(struct timer *t, void *param);
+static void wheel_bench(unsigned long n);
+
+static unsigned long nallocs;
+static unsigned long allocs_start;
+static struct timespec time_start;
+static unsigned long seed = 1;
+
+/** Allocation counting **/
+
+void *__wrap_malloc(size_t size)
+{
+    nallocs++;
+    return __real_malloc(size);
+}
+
+void *__wrap_calloc(size_t n, size_t size)
+{
+    nallocs++;
+    return __real_calloc(n, size);
+}
+
+void *__wrap_realloc(void *p, size_t size)
+{
+    nallocs++;
+    return __real_realloc(p, size);
+}
+
+/** Helper functions **/
+
+static void bench_start(void)
+{
+    allocs_start = nallocs;
+    clock_gettime(CLOCK_MONOTONIC, &time_start);
+}
+
+/**
+ * Prints the time and allocations per operation since bench_start
+ *
+ * \param container Name of the container
+ * \param op        Name of the operation
+ * \param n         Items in the container
+ * \param ops       Operations run
+ */
+static void bench_stop(const char *container, const char *op,
+        unsigned long n, unsigned long ops)
+{
+    struct timespec now;
+    double ns;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    ns = (double)(now.tv_sec - time_start.tv_sec) * 1e9
+        + (double)(now.tv_nsec - time_start.tv_nsec);
+
+    printf("%-8s %-10s %8lu %12.1f %10.3f\n", container, op, n,
+            ns / (double)ops, (double)(nallocs - allocs_start) / (double)ops);
+}
+
+static unsigned long next_random(void)
+{
+    seed = seed * 6364136223846793005UL + 1442695040888963407UL;
+    return seed >> 17;
+}
+
+/**
+ * Returns how many operations that each walk up to n items to run,
+ * so large lists finish in reasonable time
+ */
+static unsigned long linear_ops(unsigned long n)
+{
+    unsigned long ops;
+
+    ops = WORK / n;
+    if (ops > n)
+        ops = n;
+    return ops > 0 ? ops : 1;
+}
+
+static void count_item(void *data, void *param)
+{
+    (void)data;
+    (*(unsigned long*)param)++;
+}
+
+/** Benchmarks **/
+
+static void list_bench(unsigned long n)
+{
+    struct list *lst;
+    unsigned long i, ops, count = 0;
+
+    list_init(&lst, NULL, NULL);
+
+    bench_start();
+    for (i = 1; i <= n; i++)
+        list_add(lst, (void*)i);
+    bench_stop("list", "add", n, n);
+
+    ops = linear_ops(n);
+    bench_start();
+    for (i = 0; i < ops; i++)
+        list_find(lst, (void*)(1 + next_random() % n));
+    bench_stop("list", "find", n, ops);
+
+    ops = WORK / n > 0 ? WORK / n : 1;
+    bench_start();
+    for (i = 0; i < ops; i++)
+        list_for_each(lst, &count, count_item);
+    bench_stop("list", "for_each", n, count);
+
+    ops = linear_ops(n);
+    bench_start();
+    for (i = 0; i < ops; i++)
+        list_remove(lst, (void*)(1 + i * (n / ops)));
+    bench_stop("list", "remove", n, ops);
+
+    list_destroy(&lst);
+}
+
+static void hash_bench(unsigned long n)
+{
+    struct hash *h;
+    unsigned long i, count = 0;
+
+    hash_init(&h, NULL, NULL, NULL);
+
+    bench_start();
+    for (i = 1; i <= n; i++)
+        hash_put(h, (void*)i, (void*)i);
+    bench_stop("hash", "put", n, n);
+
+    bench_start();
+    for (i = 0; i < n; i++)
+        hash_get(h, (void*)(1 + next_random() % n));
+    bench_stop("hash", "get", n, n);
+
+    bench_start();
+    hash_for_each(h, &count, count_item);
+    bench_stop("hash", "for_each", n, count);
+
+    bench_start();
+    for (i = 1; i <= n; i++)
+        hash_remove(h, (void*)i);
+    bench_stop("hash", "remove", n, n);
+
+    hash_destroy(&h);
+}
+
+static void slotmap_bench(unsigned long n)
+{
+    struct slotmap *sm;
+    unsigned long *ids, *col;
+    unsigned long i, sum = 0;
+    size_t size = sizeof(unsigned long);
+
+    ids = malloc(n * sizeof(*ids));
+    if (ids == NULL) {
+        perror("[bench:slotmap_bench:malloc]");
+        return;
+    }
+    slotmap_init(&sm, 1, &size);
+
+    bench_start();
+    for (i = 0; i < n; i++)
+        ids[i] = slotmap_insert(sm);
+    bench_stop("slotmap", "insert", n, n);
+
+    bench_start();
+    for (i = 0; i < n; i++)
+        sum += *(unsigned long*)slotmap_at(sm, ids[next_random() % n], 0);
+    bench_stop("slotmap", "at", n, n);
+
+    bench_start();
+    col = slotmap_column(sm, 0);
+    for (i = 0; i < slotmap_size(sm); i++)
+        sum += col[i];
+    bench_stop("slotmap", "column", n, n);
+
+    bench_start();
+    for (i = 0; i < n; i++)
+        slotmap_remove(sm, ids[i]);
+    bench_stop("slotmap", "remove", n, n);
+
+    /* keeps the reads from being optimized away */
+    if (sum != 0)
+        printf("slotmap rows were not zero filled\n");
+
+    slotmap_destroy(&sm);
+    free(ids);
+}
+
+static void pool_bench(unsigned long n)
+{
+    struct pool *p;
+    void **objs;
+    unsigned long i;
+
+    objs = malloc(n * sizeof(*objs));
+    if (objs == NULL) {
+        perror("[bench:pool_bench:malloc]");
+        return;
+    }
+    pool_init(&p, OBJ_SIZE);
+
+    bench_start();
+    for (i = 0; i < n; i++)
+        objs[i] = pool_alloc(p);
+    bench_stop("pool", "alloc", n, n);
+
+    bench_start();
+    for (i = 0; i < n; i++)
+        pool_free(p, objs[i]);
+    bench_stop("pool", "free", n, n);
+
+    /* the second round is served from the pool's free lists */
+    bench_start();
+    for (i = 0; i < n; i++)
+        objs[i] = pool_alloc(p);
+    bench_stop("pool", "realloc", n, n);
+
+    for (i = 0; i < n; i++)
+        pool_free(p, objs[i]);
+    pool_destroy(&p);
+
+    bench_start();
+    for (i = 0; i < n; i++)
+        objs[i] = malloc(OBJ_SIZE);
+    bench_stop("malloc", "alloc", n, n);
+
+    bench_start();
+    for (i = 0; i < n; i++)
+        free(objs[i]);
+    bench_stop("malloc", "free", n, n);
+
+    free(objs);
+}
+
+/**
+ * Pushes n items and pops them again on one thread, which times the
+ * queues without any contention
+ */
+static void queue_bench(unsigned long n)
+{
+    struct mpsc *mq;
+    struct spsc *sq;
+    unsigned long i;
+
+    mpsc_init(&mq, n);
+    spsc_init(&sq, n);
+    if (mq == NULL || sq == NULL) {
+        perror("[bench:queue_bench:init]");
+        mpsc_destroy(&mq);
+        spsc_destroy(&sq);
+        return;
+    }
+
+    bench_start();
+    for (i = 1; i <= n; i++)
+        mpsc_push(mq, (void*)i);
+    bench_stop("mpsc", "push", n, n);
+
+    bench_start();
+    for (i = 0; i < n; i++)
+        mpsc_pop(mq);
+    bench_stop("mpsc", "pop", n, n);
+
+    bench_start();
+    for (i = 1; i <= n; i++)
+        spsc_push(sq, (void*)i);
+    bench_stop("spsc", "push", n, n);
+
+    bench_start();
+    for (i = 0; i < n; i++)
+        spsc_pop(sq);
+    bench_stop("spsc", "pop", n, n);
+
+    mpsc_destroy(&mq);
+    spsc_destroy(&sq);
+}
+
+static void expire_timer(struct timer *t, void *param)
+{
+    (void)t;
+    (*(unsigned long*)param)++;
+}
+
+/**
+ * Schedules n timers up to a minute of ms out, reschedules each once
+ * as an idle timeout would be, then runs the wheel until all expire
+ */
+static void wheel_bench(unsigned long n)
+{
+    struct wheel *w;
+    struct timer *timers;
+    unsigned long i, now = 0, count = 0;
+    long timeout;
+
+    timers = calloc(n, sizeof(*timers));
+    wheel_init(&w, now);
+    if (timers == NULL || w == NULL) {
+        perror("[bench:wheel_bench:init]");
+        free(timers);
+        wheel_destroy(&w);
+        return;
+    }
+
+    bench_start();
+    for (i = 0; i < n; i++)
+        wheel_add(w, &timers[i], 1 + next_random() % 60000);
+    bench_stop("wheel", "add", n, n);
+
+    bench_start();
+    for (i = 0; i < n; i++)
+        wheel_add(w, &timers[i], 1 + next_random() % 60000);
+    bench_stop("wheel", "move", n, n);
+
+    bench_start();
+    while ((timeout = wheel_timeout(w, now)) != -1) {
+        now += (unsigned long)timeout;
+        wheel_advance(w, now, expire_timer, &count);
+    }
+    bench_stop("wheel", "expire", n, count);
+
+    wheel_destroy(&w);
+    free(timers);
+}
+
+/** Main **/
+
+int main(int argc, char *argv[])
+{
+    unsigned long n, max = MAX_SIZE;
+
+    if (argc > 1) {
+        max = strtoul(argv[1], NULL, 10);
+        if (max < MIN_SIZE) {
+            fprintf(stderr, "usage: %s [max_size]\n", argv[0]);
+            return EXIT_FAILURE;
+        }
+    }
+
+    printf("%-8s %-10s %8s %12s %10s\n", "type", "op", "size", "ns/op", "allocs/op");
+    for (n = MIN_SIZE; n <= max; n *= 10) {
+        list_bench(n);
+        hash_bench(n);
+        slotmap_bench(n);
+        pool_bench(n);
+        queue_bench(n);
+        wheel_bench(n);
+    }
+
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,209 @@
+/**
+ * file: generic_epoch.c
+ *
+ * Epoch based reclamation.  A global epoch only advances once every
+ * thread inside a critical section has observed the current one, so
+ * data retired in epoch e can no longer be reached by any reader
+ * once the global epoch reaches e + 2
+ */
+
+#include <sched.h>
+#include <stdlib.h>
+
+#include "generic_epoch.h"
+
+#define EPOCH_BAGS      3
+#define CACHE_LINE      64
+
+/** Type defintions **/
+
+struct retired {
+    struct retired *next;
+    void *p;
+    void (*deallocate)(void *p);
+};
+
+/**
+ * Data a thread retired during one epoch
+ */
+struct bag {
+    struct retired *head;
+    unsigned long epoch;
+};
+
+/**
+ * Per-thread state
+ *
+ * state    (epoch << 1) | 1 while inside a critical section, 0 outside
+ * bags     Retired data, indexed by epoch % EPOCH_BAGS
+ */
+struct record {
+    unsigned long state;
+    struct bag bags[EPOCH_BAGS];
+};
+
+/* keep every thread's record on its own cache lines */
+union padded_record {
+    struct record r;
+    char pad[2 * CACHE_LINE];
+};
+
+struct epoch {
+    unsigned long global;
+    char pad[CACHE_LINE];
+    unsigned nthreads;
+    union padded_record *records;
+};
+
+/** Declarations **/
+
+static void bag_free(struct bag *b);
+static int epoch_try_advance(struct epoch *e);
+static void epoch_synchronize(struct epoch *e);
+
+/** Epoch functions **/
+
+void epoch_init(struct epoch **e, unsigned nthreads)
+{
+    struct epoch *ep;
+
+    if (e == NULL || nthreads == 0)
+        return;
+
+    ep = calloc(1, sizeof(struct epoch));
+    if (ep == NULL)
+        return;
+
+    ep->records = calloc(nthreads, sizeof(union padded_record));
+    if (ep->records == NULL) {
+        free(ep);
+        return;
+    }
+
+    ep->nthreads = nthreads;
+    *e = ep;
+}
+
+void epoch_enter(struct epoch *e, unsigned tid)
+{
+    unsigned long g;
+
+    g = __atomic_load_n(&e->global, __ATOMIC_ACQUIRE);
+    __atomic_store_n(&e->records[tid].r.state, (g << 1) | 1UL, __ATOMIC_RELAXED);
+
+    /* publish our epoch before loading any shared pointer */
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+}
+
+void epoch_exit(struct epoch *e, unsigned tid)
+{
+    __atomic_store_n(&e->records[tid].r.state, 0UL, __ATOMIC_RELEASE);
+}
+
+static void bag_free(struct bag *b)
+{
+    struct retired *iter, *tmp;
+
+    for (iter = b->head; iter != NULL; iter = tmp) {
+        tmp = iter->next;
+        iter->deallocate(iter->p);
+        free(iter);
+    }
+
+    b->head = NULL;
+}
+
+/**
+ * Advances the global epoch if every active thread has observed it
+ *
+ * \return          1 if the epoch advanced, 0 otherwise
+ */
+static int epoch_try_advance(struct epoch *e)
+{
+    unsigned long g, s;
+    unsigned i;
+
+    g = __atomic_load_n(&e->global, __ATOMIC_SEQ_CST);
+    for (i = 0; i < e->nthreads; i++) {
+        s = __atomic_load_n(&e->records[i].r.state, __ATOMIC_SEQ_CST);
+        if ((s & 1UL) && (s >> 1) != g)
+            return 0;
+    }
+
+    return __atomic_compare_exchange_n(&e->global, &g, g + 1, 0,
+            __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST);
+}
+
+/**
+ * Waits until no reader can still see what was unlinked before the
+ * call, advancing the global epoch twice
+ */
+static void epoch_synchronize(struct epoch *e)
+{
+    unsigned long g;
+
+    g = __atomic_load_n(&e->global, __ATOMIC_ACQUIRE);
+    while (__atomic_load_n(&e->global, __ATOMIC_ACQUIRE) < g + 2) {
+        if (!epoch_try_advance(e))
+            sched_yield();
+    }
+}
+
+void epoch_retire(struct epoch *e, unsigned tid, void *p,
+        void (*deallocate)(void *p))
+{
+    struct record *rec;
+    struct retired *node;
+    struct bag *b;
+    unsigned long g;
+    unsigned i;
+
+    /* with nowhere to note it down, wait out the readers and free it now */
+    node = malloc(sizeof(*node));
+    if (node == NULL) {
+        epoch_synchronize(e);
+        deallocate(p);
+        return;
+    }
+
+    node->p = p;
+    node->deallocate = deallocate;
+
+    rec = &e->records[tid].r;
+    g = __atomic_load_n(&e->global, __ATOMIC_ACQUIRE);
+
+    b = &rec->bags[g % EPOCH_BAGS];
+    if (b->epoch != g) {
+        /* the bag last held epoch g - 3 or older, nobody can reach it */
+        bag_free(b);
+        b->epoch = g;
+    }
+
+    node->next = b->head;
+    b->head = node;
+
+    epoch_try_advance(e);
+
+    g = __atomic_load_n(&e->global, __ATOMIC_ACQUIRE);
+    for (i = 0; i < EPOCH_BAGS; i++) {
+        if (rec->bags[i].head != NULL && rec->bags[i].epoch + 2 <= g)
+            bag_free(&rec->bags[i]);
+    }
+}
+
+void epoch_destroy(struct epoch **e)
+{
+    unsigned i, j;
+
+    if (e == NULL || *e == NULL)
+        return;
+
+    for (i = 0; i < (*e)->nthreads; i++) {
+        for (j = 0; j < EPOCH_BAGS; j++)
+            bag_free(&(*e)->records[i].r.bags[j]);
+    }
+
+    free((*e)->records);
+    free(*e);
+    *e = NULL;
+}
@@ -0,0 +1,68 @@
+/**
+ * file: generic_epoch.h
+ *
+ * Epoch based reclamation.  Lets readers traverse shared data
+ * without locks while writers publish new versions of it; a retired
+ * version is only deallocated once no reader can still hold it
+ */
+
+#ifndef ALLISONK_GENERIC_EPOCH_H
+#define ALLISONK_GENERIC_EPOCH_H
+
+/**
+ * Represents an epoch domain shared by a fixed set of threads
+ */
+struct epoch;
+
+/**
+ * Initializes an epoch domain. Will allocate a domain
+ * and store it in the dereferened parameter
+ *
+ * \param e         Domain to initialize
+ * \param nthreads  Number of threads that will use the domain.  Each
+ *                  thread identifies itself by an index below nthreads
+ */
+void epoch_init(struct epoch **e, unsigned nthreads);
+
+/**
+ * Enters a read-side critical section.  Anything loaded from shared
+ * data after this call stays valid until epoch_exit
+ *
+ * \param e         Domain to enter
+ * \param tid       Index of the calling thread
+ */
+void epoch_enter(struct epoch *e, unsigned tid);
+
+/**
+ * Leaves a read-side critical section
+ *
+ * \param e         Domain to leave
+ * \param tid       Index of the calling thread
+ */
+void epoch_exit(struct epoch *e, unsigned tid);
+
+/**
+ * Defers deallocation of data that has been unlinked from shared
+ * data until every reader that might still see it has left.  If
+ * there is no memory to defer it, waits for those readers and
+ * deallocates at once, so the caller must not be inside a critical
+ * section of its own
+ *
+ * \param e         Domain the data was published in
+ * \param tid       Index of the calling thread
+ * \param p         Data to deallocate
+ * \param deallocate Deallocate function
+ */
+void epoch_retire(struct epoch *e, unsigned tid, void *p,
+        void (*deallocate)(void *p));
+
+/**
+ * Destroy a domain, deallocating everything still retired.
+ * No thread may be inside a critical section.
+ * Sets dereference parameter to NULL
+ *
+ * \param e         Domain to deallocate
+ */
+void epoch_destroy(struct epoch **e);
+
+#endif
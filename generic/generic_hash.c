@@ -0,0 +1,274 @@
+/**
+ * file: generic_hash.c
+ *
+ * Represents a hash map from keys to items.  Open addressing with
+ * linear probing keeps every entry in one contiguous table; removal
+ * shifts the following entries back instead of leaving tombstones
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "generic_hash.h"
+
+#define HASH_MIN_CAP    16
+
+/** Type defintions **/
+
+struct slot {
+    unsigned long hash;
+    void *key;
+    void *data;
+    int used;
+};
+
+struct hash {
+    struct slot *slots;
+    size_t cap;
+    size_t count;
+    void (*deallocate)(void *p);
+    unsigned long (*hash)(void *key);
+    int (*compare)(void *lhs, void *rhs);
+};
+
+/** Declarations **/
+
+static void default_deallocate(void *p);
+static unsigned long default_hash(void *key);
+static int default_compare(void *lhs, void *rhs);
+static struct slot *hash_lookup(struct hash *h, void *key, unsigned long hv);
+static int hash_grow(struct hash *h);
+
+/** Default hash functions **/
+
+static void default_deallocate(void *p)
+{
+    /* Default deallocate does nothing */
+    (void)p;
+}
+
+/**
+ * Hashes the key pointer itself.  Keys are often small integers
+ * cast to pointers, so the bits are mixed before masking
+ */
+static unsigned long default_hash(void *key)
+{
+    unsigned long k;
+
+    k = (unsigned long)key;
+    k ^= k >> 16;
+    k *= 2654435761UL;
+    k ^= k >> 16;
+    return k;
+}
+
+static int default_compare(void *lhs, void *rhs)
+{
+    return (lhs < rhs ? -1 :
+            (lhs == rhs ? 0 : 1));
+}
+
+unsigned long hash_string(void *key)
+{
+    const unsigned char *s;
+    unsigned long hv = 2166136261UL;
+
+    /* FNV-1a */
+    for (s = key; *s != '\0'; s++) {
+        hv ^= *s;
+        hv *= 16777619UL;
+    }
+
+    return hv;
+}
+
+int hash_string_compare(void *lhs, void *rhs)
+{
+    return strcmp((const char*)lhs, (const char*)rhs);
+}
+
+/** Hash functions **/
+
+void hash_init(struct hash **h, void (*deallocate)(void *p),
+        unsigned long (*hash)(void *key),
+        int (*compare)(void *lhs, void *rhs))
+{
+    struct hash *m;
+
+    if (h == NULL)
+        return;
+
+    m = calloc(1, sizeof(struct hash));
+    if (m == NULL)
+        return;
+
+    m->slots = calloc(HASH_MIN_CAP, sizeof(struct slot));
+    if (m->slots == NULL) {
+        free(m);
+        return;
+    }
+
+    m->cap = HASH_MIN_CAP;
+    m->deallocate = deallocate ? deallocate : default_deallocate;
+    m->hash = hash ? hash : default_hash;
+    m->compare = compare ? compare : default_compare;
+    *h = m;
+}
+
+/**
+ * Finds the slot holding key, or the empty slot that ends its probe
+ */
+static struct slot *hash_lookup(struct hash *h, void *key, unsigned long hv)
+{
+    size_t i, mask;
+    struct slot *s;
+
+    mask = h->cap - 1;
+    for (i = hv & mask; ; i = (i + 1) & mask) {
+        s = &h->slots[i];
+        if (!s->used)
+            return s;
+        if (s->hash == hv && h->compare(s->key, key) == 0)
+            return s;
+    }
+}
+
+/**
+ * Doubles the table, re-inserting every entry
+ */
+static int hash_grow(struct hash *h)
+{
+    struct slot *old, *s;
+    size_t i, oldcap, mask, j;
+
+    old = h->slots;
+    oldcap = h->cap;
+
+    h->slots = calloc(oldcap * 2, sizeof(struct slot));
+    if (h->slots == NULL) {
+        h->slots = old;
+        return -1;
+    }
+
+    h->cap = oldcap * 2;
+    mask = h->cap - 1;
+    for (i = 0; i < oldcap; i++) {
+        if (!old[i].used)
+            continue;
+
+        for (j = old[i].hash & mask; h->slots[j].used; j = (j + 1) & mask)
+            ;
+        s = &h->slots[j];
+        *s = old[i];
+    }
+
+    free(old);
+    return 0;
+}
+
+int hash_put(struct hash *h, void *key, void *data)
+{
+    struct slot *s;
+    unsigned long hv;
+
+    if (h == NULL)
+        return -1;
+
+    /* keep the load factor under 3/4 so probes stay short */
+    if ((h->count + 1) * 4 > h->cap * 3 && hash_grow(h) == -1)
+        return -1;
+
+    hv = h->hash(key);
+    s = hash_lookup(h, key, hv);
+    if (s->used) {
+        if (s->data != data)
+            h->deallocate(s->data);
+    } else {
+        h->count++;
+    }
+
+    s->hash = hv;
+    s->key = key;
+    s->data = data;
+    s->used = 1;
+    return 0;
+}
+
+void *hash_get(struct hash *h, void *key)
+{
+    struct slot *s;
+
+    if (h == NULL)
+        return NULL;
+
+    s = hash_lookup(h, key, h->hash(key));
+    return s->used ? s->data : NULL;
+}
+
+void hash_remove(struct hash *h, void *key)
+{
+    struct slot *s;
+    size_t i, j, home, mask;
+    void *data;
+
+    if (h == NULL)
+        return;
+
+    s = hash_lookup(h, key, h->hash(key));
+    if (!s->used)
+        return;
+
+    data = s->data;
+    mask = h->cap - 1;
+
+    /* shift back every entry whose probe passes through the hole */
+    i = (size_t)(s - h->slots);
+    for (j = (i + 1) & mask; h->slots[j].used; j = (j + 1) & mask) {
+        home = h->slots[j].hash & mask;
+        if (((j - home) & mask) >= ((j - i) & mask)) {
+            h->slots[i] = h->slots[j];
+            i = j;
+        }
+    }
+
+    h->slots[i].used = 0;
+    h->count--;
+    h->deallocate(data);
+}
+
+size_t hash_size(struct hash *h)
+{
+    return h ? h->count : 0;
+}
+
+void hash_for_each(struct hash *h,
+        void *param,
+        void (*fn)(void *data, void *param))
+{
+    size_t i;
+
+    if (h == NULL)
+        return;
+
+    for (i = 0; i < h->cap; i++) {
+        if (h->slots[i].used)
+            fn(h->slots[i].data, param);
+    }
+}
+
+void hash_destroy(struct hash **h)
+{
+    size_t i;
+
+    if (h == NULL || *h == NULL)
+        return;
+
+    for (i = 0; i < (*h)->cap; i++) {
+        if ((*h)->slots[i].used)
+            (*h)->deallocate((*h)->slots[i].data);
+    }
+
+    free((*h)->slots);
+    free(*h);
+    *h = NULL;
+}
@@ -0,0 +1,96 @@
+/**
+ * file: generic_hash.h
+ *
+ * Represents a hash map from keys to items
+ */
+
+#ifndef ALLISONK_GENERIC_HASH_H
+#define ALLISONK_GENERIC_HASH_H
+
+#include <stddef.h>
+
+/**
+ * Represents a generic hash map
+ */
+struct hash;
+
+/**
+ * Initializes a hash map. Will allocate a map
+ * and store it in the dereferened parameter
+ *
+ * \param h             Map to initialize
+ * \param deallocate    Deallocate function, run on items as they leave the map
+ * \param hash          Hash function for keys (NULL hashes the key pointer)
+ * \param compare       Key comparison function, 0 when equal
+ *                      (NULL compares the key pointers)
+ */
+void hash_init(struct hash **h, void (*deallocate)(void *p),
+        unsigned long (*hash)(void *key),
+        int (*compare)(void *lhs, void *rhs));
+
+/**
+ * Adds an item to the map, replacing (and deallocating) any
+ * item already stored under the same key
+ *
+ * \param h         Map to insert into
+ * \param key       Key to store the item under.  Must stay valid
+ *                  while the item is in the map
+ * \param data      Data to insert
+ * \return          0 on success, -1 on failure
+ */
+int hash_put(struct hash *h, void *key, void *data);
+
+/**
+ * Returns the item stored under a key
+ *
+ * \param h         Map to search
+ * \param key       Key to search for
+ * \return          Item, NULL if there is none
+ */
+void *hash_get(struct hash *h, void *key);
+
+/**
+ * Deletes the item stored under a key
+ *
+ * \param h         Map to remove from
+ * \param key       Key of the item to delete
+ */
+void hash_remove(struct hash *h, void *key);
+
+/**
+ * Returns the number of items in the map
+ *
+ * \param h         Map to query
+ */
+size_t hash_size(struct hash *h);
+
+/**
+ * Runs a function for each item in the map
+ *
+ * \param h         Map to iterate
+ * \param param     Extra parameter to pass to function
+ * \param fn        Function to run
+ */
+void hash_for_each(struct hash *h,
+        void *param,
+        void (*fn)(void *data, void *param));
+
+/**
+ * Destroy a map, deallocating all it's contents.
+ * Sets dereference parameter to NULL
+ *
+ * \param h         Map to deallocate
+ */
+void hash_destroy(struct hash **h);
+
+/**
+ * Hash function for nul-terminated string keys
+ */
+unsigned long hash_string(void *key);
+
+/**
+ * Comparison function for nul-terminated string keys
+ */
+int hash_string_compare(void *lhs, void *rhs);
+
+#endif
@@ -147,7 +147,7 @@ void list_remove(struct list *lst, void *p)
             if (iter->next)
                 iter->next->prev = iter->prev;
 
-            if (lst->head)
+            if (lst->head == iter)
                 lst->head = iter->next;
 
             lst->deallocate(iter->data);
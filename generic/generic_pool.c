@@ -0,0 +1,287 @@
+/**
+ * file: generic_pool.c
+ *
+ * Represents a pool of fixed size objects.  Free objects are linked
+ * through their own storage.  Each thread caches free objects of its
+ * own and only takes the pool's lock to move a batch of them between
+ * its cache and the shared depot, or to carve a new slab
+ */
+
+#include <pthread.h>
+#include <stdlib.h>
+
+#include "generic_pool.h"
+
+#define POOL_SLAB_OBJS  64
+#define POOL_BATCH      32
+#define POOL_ALIGN      16
+
+/** Type defintions **/
+
+struct free_obj {
+    struct free_obj *next;
+};
+
+/* objects follow the header, which is padded to keep them aligned */
+union slab {
+    union slab *next;
+    char pad[POOL_ALIGN];
+};
+
+/**
+ * A thread's free objects
+ */
+struct cache {
+    struct pool *pool;
+    struct free_obj *head;
+    size_t count;
+    struct cache *prev;
+    struct cache *next;
+};
+
+/**
+ * size     Size of every object, rounded up to keep them aligned
+ * key      Finds the calling thread's cache
+ * mtx      Protects depot, slabs and caches
+ * depot    Free objects not cached by any thread
+ * slabs    Every slab carved so far
+ * caches   Caches of threads that have used the pool
+ */
+struct pool {
+    size_t size;
+    pthread_key_t key;
+    pthread_mutex_t mtx;
+    struct free_obj *depot;
+    union slab *slabs;
+    struct cache *caches;
+};
+
+/** Declarations **/
+
+static void cache_release(void *p);
+static struct cache *pool_cache(struct pool *p);
+static int pool_refill(struct pool *p, struct cache *c);
+static void pool_spill(struct pool *p, struct cache *c);
+
+/** Pool functions **/
+
+void pool_init(struct pool **p, size_t size)
+{
+    struct pool *pl;
+
+    if (p == NULL || size == 0)
+        return;
+
+    pl = calloc(1, sizeof(struct pool));
+    if (pl == NULL)
+        return;
+
+    if (pthread_key_create(&pl->key, cache_release) != 0) {
+        free(pl);
+        return;
+    }
+
+    if (size < sizeof(struct free_obj))
+        size = sizeof(struct free_obj);
+    pl->size = (size + POOL_ALIGN - 1) & ~(size_t)(POOL_ALIGN - 1);
+
+    pthread_mutex_init(&pl->mtx, NULL);
+    *p = pl;
+}
+
+/**
+ * Hands a thread's cached objects back to the depot when it exits
+ */
+static void cache_release(void *p)
+{
+    struct cache *c;
+    struct free_obj *tail;
+    struct pool *pl;
+
+    c = p;
+    pl = c->pool;
+
+    pthread_mutex_lock(&pl->mtx);
+    if (c->head != NULL) {
+        for (tail = c->head; tail->next != NULL; tail = tail->next)
+            ;
+        tail->next = pl->depot;
+        pl->depot = c->head;
+    }
+
+    if (c->prev)
+        c->prev->next = c->next;
+    else
+        pl->caches = c->next;
+    if (c->next)
+        c->next->prev = c->prev;
+    pthread_mutex_unlock(&pl->mtx);
+
+    free(c);
+}
+
+/**
+ * Returns the calling thread's cache, creating it on first use
+ */
+static struct cache *pool_cache(struct pool *p)
+{
+    struct cache *c;
+
+    c = pthread_getspecific(p->key);
+    if (c != NULL)
+        return c;
+
+    c = calloc(1, sizeof(*c));
+    if (c == NULL)
+        return NULL;
+
+    if (pthread_setspecific(p->key, c) != 0) {
+        free(c);
+        return NULL;
+    }
+
+    c->pool = p;
+    pthread_mutex_lock(&p->mtx);
+    c->next = p->caches;
+    if (p->caches)
+        p->caches->prev = c;
+    p->caches = c;
+    pthread_mutex_unlock(&p->mtx);
+
+    return c;
+}
+
+/**
+ * Moves a batch of objects from the depot into a cache, carving a
+ * new slab if the depot is empty
+ */
+static int pool_refill(struct pool *p, struct cache *c)
+{
+    union slab *s;
+    struct free_obj *obj;
+    char *base;
+    size_t i;
+
+    pthread_mutex_lock(&p->mtx);
+    if (p->depot == NULL) {
+        s = malloc(sizeof(union slab) + POOL_SLAB_OBJS * p->size);
+        if (s == NULL) {
+            pthread_mutex_unlock(&p->mtx);
+            return -1;
+        }
+
+        s->next = p->slabs;
+        p->slabs = s;
+
+        base = (char*)(s + 1);
+        for (i = POOL_SLAB_OBJS; i > 0; i--) {
+            obj = (struct free_obj*)(base + (i - 1) * p->size);
+            obj->next = p->depot;
+            p->depot = obj;
+        }
+    }
+
+    for (i = 0; i < POOL_BATCH && p->depot != NULL; i++) {
+        obj = p->depot;
+        p->depot = obj->next;
+        obj->next = c->head;
+        c->head = obj;
+        c->count++;
+    }
+    pthread_mutex_unlock(&p->mtx);
+
+    return 0;
+}
+
+/**
+ * Moves a batch of objects from a cache back to the depot
+ */
+static void pool_spill(struct pool *p, struct cache *c)
+{
+    struct free_obj *first, *last;
+    size_t i;
+
+    first = last = c->head;
+    for (i = 1; i < POOL_BATCH; i++)
+        last = last->next;
+
+    c->head = last->next;
+    c->count -= POOL_BATCH;
+
+    pthread_mutex_lock(&p->mtx);
+    last->next = p->depot;
+    p->depot = first;
+    pthread_mutex_unlock(&p->mtx);
+}
+
+void *pool_alloc(struct pool *p)
+{
+    struct cache *c;
+    struct free_obj *obj;
+
+    if (p == NULL)
+        return NULL;
+
+    c = pool_cache(p);
+    if (c == NULL)
+        return NULL;
+
+    if (c->head == NULL && pool_refill(p, c) == -1)
+        return NULL;
+
+    obj = c->head;
+    c->head = obj->next;
+    c->count--;
+    return obj;
+}
+
+void pool_free(struct pool *p, void *obj)
+{
+    struct cache *c;
+    struct free_obj *f;
+
+    if (p == NULL || obj == NULL)
+        return;
+
+    f = obj;
+    c = pool_cache(p);
+    if (c == NULL) {
+        pthread_mutex_lock(&p->mtx);
+        f->next = p->depot;
+        p->depot = f;
+        pthread_mutex_unlock(&p->mtx);
+        return;
+    }
+
+    f->next = c->head;
+    c->head = f;
+    c->count++;
+
+    /* keep a batch around for the next allocations, return the rest */
+    if (c->count >= 2 * POOL_BATCH)
+        pool_spill(p, c);
+}
+
+void pool_destroy(struct pool **p)
+{
+    struct cache *c, *cnext;
+    union slab *s, *snext;
+
+    if (p == NULL || *p == NULL)
+        return;
+
+    for (c = (*p)->caches; c != NULL; c = cnext) {
+        cnext = c->next;
+        free(c);
+    }
+
+    for (s = (*p)->slabs; s != NULL; s = snext) {
+        snext = s->next;
+        free(s);
+    }
+
+    pthread_key_delete((*p)->key);
+    pthread_mutex_destroy(&(*p)->mtx);
+    free(*p);
+    *p = NULL;
+}
@@ -0,0 +1,54 @@
+/**
+ * file: generic_pool.h
+ *
+ * Represents a pool of fixed size objects.  Objects are carved from
+ * large slabs, and each thread keeps a small cache of free objects
+ * so most allocations and frees touch no shared state
+ */
+
+#ifndef ALLISONK_GENERIC_POOL_H
+#define ALLISONK_GENERIC_POOL_H
+
+#include <stddef.h>
+
+/**
+ * Represents a generic object pool
+ */
+struct pool;
+
+/**
+ * Initializes a pool. Will allocate a pool
+ * and store it in the dereferened parameter
+ *
+ * \param p         Pool to initialize
+ * \param size      Size of every object
+ */
+void pool_init(struct pool **p, size_t size);
+
+/**
+ * Takes an object from the pool.  Its contents are undefined
+ *
+ * \param p         Pool to allocate from
+ * \return          Object, NULL on failure
+ */
+void *pool_alloc(struct pool *p);
+
+/**
+ * Returns an object to the pool.  Any thread may free an object,
+ * not only the one that allocated it
+ *
+ * \param p         Pool the object came from
+ * \param obj       Object to free
+ */
+void pool_free(struct pool *p, void *obj);
+
+/**
+ * Destroy a pool, releasing every object whether freed or not.
+ * Only the calling thread may still be using the pool.
+ * Sets dereference parameter to NULL
+ *
+ * \param p         Pool to deallocate
+ */
+void pool_destroy(struct pool **p);
+
+#endif
@@ -0,0 +1,237 @@
+/**
+ * file: generic_queue.c
+ *
+ * Bounded lock-free queues.  The multi-producer queue gives every
+ * slot a sequence number telling whose turn it is: producers claim
+ * a slot by advancing the tail with a compare-and-swap, and publish
+ * the item by moving the slot's sequence on, which is all the
+ * consumer waits for.  The single-producer queue only needs each
+ * side to publish its own index
+ */
+
+#include <stdlib.h>
+
+#include "generic_queue.h"
+
+#define CACHE_LINE      64
+#define QUEUE_MIN_CAP   2
+
+/** Type defintions **/
+
+/**
+ * A slot of a multi-producer queue
+ *
+ * seq      Position the slot is next written at, one past it once
+ *          an item has been written there
+ * item     Item in the slot
+ */
+struct cell {
+    unsigned long seq;
+    void *item;
+};
+
+/* keep each side's index on its own cache line */
+union padded_index {
+    unsigned long i;
+    char pad[CACHE_LINE];
+};
+
+/**
+ * tail     Position of the next push, shared by producers
+ * head     Position of the next pop, only touched by the consumer
+ * mask     Number of cells less one
+ * cells    Ring of cells
+ */
+struct mpsc {
+    union padded_index tail;
+    union padded_index head;
+    unsigned long mask;
+    struct cell *cells;
+};
+
+/**
+ * tail         Position of the next push, written by the producer
+ * head         Position of the next pop, written by the consumer
+ * head_cache   Producer's last look at head
+ * tail_cache   Consumer's last look at tail
+ * mask         Number of slots less one
+ * items        Ring of items
+ */
+struct spsc {
+    union padded_index tail;
+    union padded_index head;
+    union padded_index head_cache;
+    union padded_index tail_cache;
+    unsigned long mask;
+    void **items;
+};
+
+/** Declarations **/
+
+static unsigned long round_cap(size_t cap);
+
+/** Helper functions **/
+
+static unsigned long round_cap(size_t cap)
+{
+    unsigned long n;
+
+    for (n = QUEUE_MIN_CAP; n < cap; n <<= 1)
+        ;
+
+    return n;
+}
+
+/** Multi-producer functions **/
+
+void mpsc_init(struct mpsc **q, size_t cap)
+{
+    struct mpsc *m;
+    unsigned long i, n;
+
+    if (q == NULL)
+        return;
+
+    *q = NULL;
+    m = calloc(1, sizeof(struct mpsc));
+    if (m == NULL)
+        return;
+
+    n = round_cap(cap);
+    m->cells = malloc(n * sizeof(struct cell));
+    if (m->cells == NULL) {
+        free(m);
+        return;
+    }
+
+    for (i = 0; i < n; i++)
+        m->cells[i].seq = i;
+    m->mask = n - 1;
+    *q = m;
+}
+
+int mpsc_push(struct mpsc *q, void *item)
+{
+    struct cell *c;
+    unsigned long pos, seq;
+
+    pos = __atomic_load_n(&q->tail.i, __ATOMIC_RELAXED);
+    for (;;) {
+        c = &q->cells[pos & q->mask];
+        seq = __atomic_load_n(&c->seq, __ATOMIC_ACQUIRE);
+
+        if (seq == pos) {
+            /* our turn, unless another producer claims the slot first */
+            if (__atomic_compare_exchange_n(&q->tail.i, &pos, pos + 1, 1,
+                        __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+                break;
+        } else if ((long)(seq - pos) < 0) {
+            /* still holds the item pushed a lap ago */
+            return -1;
+        } else {
+            pos = __atomic_load_n(&q->tail.i, __ATOMIC_RELAXED);
+        }
+    }
+
+    c->item = item;
+    __atomic_store_n(&c->seq, pos + 1, __ATOMIC_RELEASE);
+    return 0;
+}
+
+void *mpsc_pop(struct mpsc *q)
+{
+    struct cell *c;
+    unsigned long pos;
+    void *item;
+
+    pos = q->head.i;
+    c = &q->cells[pos & q->mask];
+    if (__atomic_load_n(&c->seq, __ATOMIC_ACQUIRE) != pos + 1)
+        return NULL;
+
+    item = c->item;
+    /* hand the slot to the producer a lap ahead */
+    __atomic_store_n(&c->seq, pos + q->mask + 1, __ATOMIC_RELEASE);
+    q->head.i = pos + 1;
+    return item;
+}
+
+void mpsc_destroy(struct mpsc **q)
+{
+    if (q == NULL || *q == NULL)
+        return;
+
+    free((*q)->cells);
+    free(*q);
+    *q = NULL;
+}
+
+/** Single-producer functions **/
+
+void spsc_init(struct spsc **q, size_t cap)
+{
+    struct spsc *s;
+    unsigned long n;
+
+    if (q == NULL)
+        return;
+
+    *q = NULL;
+    s = calloc(1, sizeof(struct spsc));
+    if (s == NULL)
+        return;
+
+    n = round_cap(cap);
+    s->items = malloc(n * sizeof(void*));
+    if (s->items == NULL) {
+        free(s);
+        return;
+    }
+
+    s->mask = n - 1;
+    *q = s;
+}
+
+int spsc_push(struct spsc *q, void *item)
+{
+    unsigned long tail;
+
+    tail = q->tail.i;
+    if (tail - q->head_cache.i > q->mask) {
+        /* only look at the consumer's line when the queue seems full */
+        q->head_cache.i = __atomic_load_n(&q->head.i, __ATOMIC_ACQUIRE);
+        if (tail - q->head_cache.i > q->mask)
+            return -1;
+    }
+
+    q->items[tail & q->mask] = item;
+    __atomic_store_n(&q->tail.i, tail + 1, __ATOMIC_RELEASE);
+    return 0;
+}
+
+void *spsc_pop(struct spsc *q)
+{
+    unsigned long head;
+    void *item;
+
+    head = q->head.i;
+    if (head == q->tail_cache.i) {
+        q->tail_cache.i = __atomic_load_n(&q->tail.i, __ATOMIC_ACQUIRE);
+        if (head == q->tail_cache.i)
+            return NULL;
+    }
+
+    item = q->items[head & q->mask];
+    __atomic_store_n(&q->head.i, head + 1, __ATOMIC_RELEASE);
+    return item;
+}
+
+void spsc_destroy(struct spsc **q)
+{
+    if (q == NULL || *q == NULL)
+        return;
+
+    free((*q)->items);
+    free(*q);
+    *q = NULL;
+}
@@ -0,0 +1,94 @@
+/**
+ * file: generic_queue.h
+ *
+ * Represents bounded lock-free queues of pointers for handing items
+ * from one thread to another.  An mpsc takes items from any number
+ * of threads and gives them to one; an spsc connects a single
+ * producer to a single consumer and needs no read-modify-write at all
+ */
+
+#ifndef ALLISONK_GENERIC_QUEUE_H
+#define ALLISONK_GENERIC_QUEUE_H
+
+#include <stddef.h>
+
+/**
+ * Represents a multi-producer, single-consumer queue
+ */
+struct mpsc;
+
+/**
+ * Represents a single-producer, single-consumer queue
+ */
+struct spsc;
+
+/**
+ * Initializes a multi-producer queue. Will allocate a queue
+ * and store it in the dereferened parameter
+ *
+ * \param q         Queue to initialize
+ * \param cap       Most items queued at once, rounded up to a power of two
+ */
+void mpsc_init(struct mpsc **q, size_t cap);
+
+/**
+ * Adds an item to the back of the queue.  Any thread may push
+ *
+ * \param q         Queue to push to
+ * \param item      Item to push, must not be NULL
+ * \return          0 on success, -1 if the queue is full
+ */
+int mpsc_push(struct mpsc *q, void *item);
+
+/**
+ * Takes the item at the front of the queue.  Only one thread may pop.
+ * An item whose push has not finished yet holds back the ones after it
+ *
+ * \param q         Queue to pop from
+ * \return          Item, NULL if the queue is empty
+ */
+void *mpsc_pop(struct mpsc *q);
+
+/**
+ * Destroy a multi-producer queue.  Items still queued are not freed.
+ * Sets dereference parameter to NULL
+ *
+ * \param q         Queue to deallocate
+ */
+void mpsc_destroy(struct mpsc **q);
+
+/**
+ * Initializes a single-producer queue. Will allocate a queue
+ * and store it in the dereferened parameter
+ *
+ * \param q         Queue to initialize
+ * \param cap       Most items queued at once, rounded up to a power of two
+ */
+void spsc_init(struct spsc **q, size_t cap);
+
+/**
+ * Adds an item to the back of the queue.  Only one thread may push
+ *
+ * \param q         Queue to push to
+ * \param item      Item to push, must not be NULL
+ * \return          0 on success, -1 if the queue is full
+ */
+int spsc_push(struct spsc *q, void *item);
+
+/**
+ * Takes the item at the front of the queue.  Only one thread may pop
+ *
+ * \param q         Queue to pop from
+ * \return          Item, NULL if the queue is empty
+ */
+void *spsc_pop(struct spsc *q);
+
+/**
+ * Destroy a single-producer queue.  Items still queued are not freed.
+ * Sets dereference parameter to NULL
+ *
+ * \param q         Queue to deallocate
+ */
+void spsc_destroy(struct spsc **q);
+
+#endif
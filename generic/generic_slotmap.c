@@ -0,0 +1,232 @@
+/**
+ * file: generic_slotmap.c
+ *
+ * Represents a dense table of rows addressed by stable ids.  Rows
+ * live packed at the front of one array per column; an id names a
+ * slot that records where its row currently is, and a generation
+ * that goes stale once the row is removed
+ */
+
+#include <limits.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "generic_slotmap.h"
+
+#define SLOTMAP_MIN_CAP     16
+#define SLOT_INDEX_BITS     24
+#define SLOT_INDEX_MASK     ((1UL << SLOT_INDEX_BITS) - 1)
+#define SLOT_GEN_MAX        (ULONG_MAX >> SLOT_INDEX_BITS)
+#define SLOT_FREE_END       ((size_t)-1)
+
+/** Type defintions **/
+
+/**
+ * dense    Row of a live slot, next free slot of a free one
+ * gen      Generation of the slot's current or next row, never 0
+ */
+struct slot {
+    size_t dense;
+    unsigned long gen;
+};
+
+struct slotmap {
+    unsigned ncolumns;
+    size_t *sizes;
+    char **columns;
+    size_t *owner;
+    size_t count;
+    size_t cap;
+    struct slot *slots;
+    size_t nslots;
+    size_t free_head;
+};
+
+/** Declarations **/
+
+static int slotmap_grow(struct slotmap *sm);
+static struct slot *slotmap_lookup(struct slotmap *sm, unsigned long id);
+
+/** Slot map functions **/
+
+void slotmap_init(struct slotmap **sm, unsigned ncolumns, const size_t sizes[])
+{
+    struct slotmap *m;
+
+    if (sm == NULL || ncolumns == 0)
+        return;
+
+    m = calloc(1, sizeof(struct slotmap));
+    if (m == NULL)
+        return;
+
+    m->sizes = malloc(ncolumns * sizeof(size_t));
+    m->columns = calloc(ncolumns, sizeof(char*));
+    if (m->sizes == NULL || m->columns == NULL) {
+        free(m->sizes);
+        free(m->columns);
+        free(m);
+        return;
+    }
+
+    memcpy(m->sizes, sizes, ncolumns * sizeof(size_t));
+    m->ncolumns = ncolumns;
+    m->free_head = SLOT_FREE_END;
+
+    if (slotmap_grow(m) == -1) {
+        slotmap_destroy(&m);
+        return;
+    }
+
+    *sm = m;
+}
+
+/**
+ * Doubles the capacity of every array
+ */
+static int slotmap_grow(struct slotmap *sm)
+{
+    size_t cap, i;
+    void *p;
+
+    cap = sm->cap ? sm->cap * 2 : SLOTMAP_MIN_CAP;
+
+    for (i = 0; i < sm->ncolumns; i++) {
+        p = realloc(sm->columns[i], cap * sm->sizes[i]);
+        if (p == NULL)
+            return -1;
+        sm->columns[i] = p;
+    }
+
+    p = realloc(sm->owner, cap * sizeof(size_t));
+    if (p == NULL)
+        return -1;
+    sm->owner = p;
+
+    p = realloc(sm->slots, cap * sizeof(struct slot));
+    if (p == NULL)
+        return -1;
+    sm->slots = p;
+
+    sm->cap = cap;
+    return 0;
+}
+
+/**
+ * Finds the slot of a live row
+ */
+static struct slot *slotmap_lookup(struct slotmap *sm, unsigned long id)
+{
+    struct slot *s;
+    size_t i;
+
+    if (sm == NULL)
+        return NULL;
+
+    i = id & SLOT_INDEX_MASK;
+    if (i >= sm->nslots)
+        return NULL;
+
+    s = &sm->slots[i];
+    return s->gen == id >> SLOT_INDEX_BITS && s->dense < sm->count
+        && sm->owner[s->dense] == i ? s : NULL;
+}
+
+unsigned long slotmap_insert(struct slotmap *sm)
+{
+    size_t i, c;
+
+    if (sm == NULL)
+        return SLOTMAP_NONE;
+
+    if (sm->count == sm->cap && slotmap_grow(sm) == -1)
+        return SLOTMAP_NONE;
+
+    if (sm->free_head != SLOT_FREE_END) {
+        i = sm->free_head;
+        sm->free_head = sm->slots[i].dense;
+    } else if (sm->nslots <= SLOT_INDEX_MASK) {
+        /* no free slots means every slot is live, so one is in range */
+        i = sm->nslots++;
+        sm->slots[i].gen = 1;
+    } else {
+        return SLOTMAP_NONE;
+    }
+
+    sm->slots[i].dense = sm->count;
+    sm->owner[sm->count] = i;
+    for (c = 0; c < sm->ncolumns; c++)
+        memset(sm->columns[c] + sm->count * sm->sizes[c], 0, sm->sizes[c]);
+    sm->count++;
+
+    return (sm->slots[i].gen << SLOT_INDEX_BITS) | i;
+}
+
+void *slotmap_at(struct slotmap *sm, unsigned long id, unsigned column)
+{
+    struct slot *s;
+
+    s = slotmap_lookup(sm, id);
+    if (s == NULL || column >= sm->ncolumns)
+        return NULL;
+
+    return sm->columns[column] + s->dense * sm->sizes[column];
+}
+
+void *slotmap_column(struct slotmap *sm, unsigned column)
+{
+    if (sm == NULL || column >= sm->ncolumns)
+        return NULL;
+
+    return sm->columns[column];
+}
+
+void slotmap_remove(struct slotmap *sm, unsigned long id)
+{
+    struct slot *s;
+    size_t d, last, c;
+
+    s = slotmap_lookup(sm, id);
+    if (s == NULL)
+        return;
+
+    /* move the last row into the hole so rows stay packed */
+    d = s->dense;
+    last = sm->count - 1;
+    if (d != last) {
+        for (c = 0; c < sm->ncolumns; c++) {
+            memcpy(sm->columns[c] + d * sm->sizes[c],
+                    sm->columns[c] + last * sm->sizes[c], sm->sizes[c]);
+        }
+        sm->owner[d] = sm->owner[last];
+        sm->slots[sm->owner[d]].dense = d;
+    }
+    sm->count--;
+
+    s->gen = s->gen == SLOT_GEN_MAX ? 1 : s->gen + 1;
+    s->dense = sm->free_head;
+    sm->free_head = (size_t)(s - sm->slots);
+}
+
+size_t slotmap_size(struct slotmap *sm)
+{
+    return sm ? sm->count : 0;
+}
+
+void slotmap_destroy(struct slotmap **sm)
+{
+    unsigned i;
+
+    if (sm == NULL || *sm == NULL)
+        return;
+
+    for (i = 0; i < (*sm)->ncolumns; i++)
+        free((*sm)->columns[i]);
+
+    free((*sm)->columns);
+    free((*sm)->sizes);
+    free((*sm)->owner);
+    free((*sm)->slots);
+    free(*sm);
+    *sm = NULL;
+}
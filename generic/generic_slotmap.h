@@ -0,0 +1,86 @@
+/**
+ * file: generic_slotmap.h
+ *
+ * Represents a dense table of rows addressed by stable ids.  Each
+ * column of the table is stored as its own contiguous array, so a
+ * scan over one column never touches the others
+ */
+
+#ifndef ALLISONK_GENERIC_SLOTMAP_H
+#define ALLISONK_GENERIC_SLOTMAP_H
+
+#include <stddef.h>
+
+/* Never returned for a live row */
+#define SLOTMAP_NONE    0UL
+
+/**
+ * Represents a generic slot map
+ */
+struct slotmap;
+
+/**
+ * Initializes a slot map. Will allocate a map
+ * and store it in the dereferened parameter
+ *
+ * \param sm        Map to initialize
+ * \param ncolumns  Number of columns in each row
+ * \param sizes     Size of one element of each column
+ */
+void slotmap_init(struct slotmap **sm, unsigned ncolumns, const size_t sizes[]);
+
+/**
+ * Adds a zero filled row to the map
+ *
+ * \param sm        Map to insert into
+ * \return          Id of the new row, SLOTMAP_NONE on failure
+ */
+unsigned long slotmap_insert(struct slotmap *sm);
+
+/**
+ * Returns a row's element in one column.  The pointer is only
+ * valid until the next insert or remove
+ *
+ * \param sm        Map to search
+ * \param id        Id of the row
+ * \param column    Column of the element
+ * \return          Element, NULL if the row has been removed
+ */
+void *slotmap_at(struct slotmap *sm, unsigned long id, unsigned column);
+
+/**
+ * Returns one column of every row, stored contiguously.  Valid
+ * until the next insert or remove
+ *
+ * \param sm        Map to read
+ * \param column    Column to return
+ * \return          Array of slotmap_size elements
+ */
+void *slotmap_column(struct slotmap *sm, unsigned column);
+
+/**
+ * Deletes a row.  The last row moves into its place; ids of
+ * other rows stay valid
+ *
+ * \param sm        Map to remove from
+ * \param id        Id of the row to delete
+ */
+void slotmap_remove(struct slotmap *sm, unsigned long id);
+
+/**
+ * Returns the number of rows in the map
+ *
+ * \param sm        Map to count
+ * \return          Number of rows
+ */
+size_t slotmap_size(struct slotmap *sm);
+
+/**
+ * Destroy a slot map.
+ * Sets dereference parameter to NULL
+ *
+ * \param sm        Map to deallocate
+ */
+void slotmap_destroy(struct slotmap **sm);
+
+#endif
@@ -0,0 +1,269 @@
+/**
+ * file: generic_wheel.c
+ *
+ * Hierarchical timer wheel.  Level 0 has a slot for each of the next
+ * WHEEL_SLOTS ticks; every level above it has slots WHEEL_SLOTS times
+ * as wide.  A timer sits in the lowest level whose span covers it, and
+ * when the wheel reaches the start of a higher slot its timers are
+ * cascaded down, each one moving at most WHEEL_LEVELS - 1 times.  A
+ * bitmap per level tells which slots hold timers, so empty stretches
+ * are skipped and the next wakeup is found without walking any slot.
+ * The bitmaps need unsigned long to hold WHEEL_SLOTS bits
+ */
+
+#include <stdlib.h>
+
+#include "generic_wheel.h"
+
+#define WHEEL_BITS      6
+#define WHEEL_SLOTS     (1 << WHEEL_BITS)
+#define WHEEL_MASK      (WHEEL_SLOTS - 1UL)
+/* Spans 2^30 ticks, later timers wait in the last slot until they fit */
+#define WHEEL_LEVELS    5
+
+#define LEVEL_SHIFT(l)  ((l) * WHEEL_BITS)
+
+/** Type defintions **/
+
+/**
+ * next      Next tick to process, every earlier one has been
+ * count     Number of pending timers
+ * occupied  Bitmap of the slots of each level holding timers
+ * slots     Head of each slot's circular list, by level then slot
+ */
+struct wheel {
+    unsigned long next;
+    unsigned long count;
+    unsigned long occupied[WHEEL_LEVELS];
+    struct timer slots[WHEEL_LEVELS * WHEEL_SLOTS];
+};
+
+/** Declarations **/
+
+static void wheel_place(struct wheel *w, struct timer *t);
+static void wheel_unlink(struct wheel *w, struct timer *t);
+static void wheel_take(struct wheel *w, unsigned slot, struct timer *list);
+static void wheel_tick(struct wheel *w,
+        void (*fn)(struct timer *t, void *param), void *param);
+static unsigned long rotate(unsigned long bits, unsigned long n);
+
+/** Helper functions **/
+
+/**
+ * Links a timer into the slot its expiry falls in
+ */
+static void wheel_place(struct wheel *w, struct timer *t)
+{
+    struct timer *head;
+    unsigned long e, delta, idx;
+    unsigned l;
+
+    e = t->expires;
+    if ((long)(e - w->next) < 0)
+        e = w->next;
+
+    delta = e - w->next;
+    for (l = 0; l < WHEEL_LEVELS - 1 && delta >> LEVEL_SHIFT(l + 1) != 0; l++)
+        ;
+
+    if (delta >> LEVEL_SHIFT(WHEEL_LEVELS) != 0)
+        e = w->next + (1UL << LEVEL_SHIFT(WHEEL_LEVELS)) - 1;
+
+    idx = (e >> LEVEL_SHIFT(l)) & WHEEL_MASK;
+    t->slot = l * WHEEL_SLOTS + (unsigned)idx;
+    head = &w->slots[t->slot];
+
+    t->next = head;
+    t->prev = head->prev;
+    head->prev->next = t;
+    head->prev = t;
+    w->occupied[l] |= 1UL << idx;
+}
+
+/**
+ * Unlinks a timer from its list, which need not be its slot's
+ */
+static void wheel_unlink(struct wheel *w, struct timer *t)
+{
+    struct timer *head;
+
+    t->prev->next = t->next;
+    t->next->prev = t->prev;
+    t->next = t->prev = NULL;
+
+    head = &w->slots[t->slot];
+    if (head->next == head)
+        w->occupied[t->slot / WHEEL_SLOTS] &= ~(1UL << (t->slot % WHEEL_SLOTS));
+}
+
+/**
+ * Moves every timer of a slot onto a list of our own, so what runs
+ * meanwhile can safely add to the slot or cancel any timer
+ */
+static void wheel_take(struct wheel *w, unsigned slot, struct timer *list)
+{
+    struct timer *head;
+
+    head = &w->slots[slot];
+    list->next = list->prev = list;
+    if (head->next == head)
+        return;
+
+    list->next = head->next;
+    list->prev = head->prev;
+    list->next->prev = list;
+    list->prev->next = list;
+    head->next = head->prev = head;
+    w->occupied[slot / WHEEL_SLOTS] &= ~(1UL << (slot % WHEEL_SLOTS));
+}
+
+/**
+ * Processes the next tick: cascades whatever higher slots start at
+ * it, then expires the timers due at it
+ */
+static void wheel_tick(struct wheel *w,
+        void (*fn)(struct timer *t, void *param), void *param)
+{
+    struct timer list, *t;
+    unsigned long tick;
+    unsigned l;
+
+    tick = w->next;
+    for (l = WHEEL_LEVELS - 1; l > 0; l--) {
+        if ((tick & ((1UL << LEVEL_SHIFT(l)) - 1)) != 0)
+            continue;
+
+        wheel_take(w, l * WHEEL_SLOTS + (unsigned)((tick >> LEVEL_SHIFT(l)) & WHEEL_MASK),
+                &list);
+        while ((t = list.next) != &list) {
+            list.next = t->next;
+            t->next->prev = &list;
+            wheel_place(w, t);
+        }
+    }
+
+    wheel_take(w, (unsigned)(tick & WHEEL_MASK), &list);
+    w->next = tick + 1;
+
+    while ((t = list.next) != &list) {
+        wheel_unlink(w, t);
+        w->count--;
+        fn(t, param);
+    }
+}
+
+static unsigned long rotate(unsigned long bits, unsigned long n)
+{
+    return n == 0 ? bits : (bits >> n) | (bits << (WHEEL_SLOTS - n));
+}
+
+/** Wheel functions **/
+
+void wheel_init(struct wheel **w, unsigned long now)
+{
+    struct wheel *wh;
+    unsigned i;
+
+    if (w == NULL)
+        return;
+
+    wh = calloc(1, sizeof(struct wheel));
+    if (wh == NULL) {
+        *w = NULL;
+        return;
+    }
+
+    for (i = 0; i < WHEEL_LEVELS * WHEEL_SLOTS; i++)
+        wh->slots[i].next = wh->slots[i].prev = &wh->slots[i];
+    wh->next = now;
+    *w = wh;
+}
+
+void wheel_add(struct wheel *w, struct timer *t, unsigned long expires)
+{
+    if (t->next != NULL)
+        wheel_unlink(w, t);
+    else
+        w->count++;
+
+    t->expires = expires;
+    wheel_place(w, t);
+}
+
+void wheel_del(struct wheel *w, struct timer *t)
+{
+    if (t->next == NULL)
+        return;
+
+    wheel_unlink(w, t);
+    w->count--;
+}
+
+void wheel_advance(struct wheel *w, unsigned long now,
+        void (*fn)(struct timer *t, void *param), void *param)
+{
+    unsigned long tick, end;
+
+    while ((long)(now - w->next) >= 0) {
+        if (w->count == 0) {
+            w->next = now + 1;
+            break;
+        }
+
+        /* up to the next cascade only level 0 can have anything due */
+        tick = w->next;
+        if ((tick & WHEEL_MASK) != 0 && w->occupied[0] >> (tick & WHEEL_MASK) == 0) {
+            end = (tick | WHEEL_MASK) + 1;
+            w->next = (long)(now - end) < 0 ? now + 1 : end;
+            continue;
+        }
+
+        wheel_tick(w, fn, param);
+    }
+}
+
+long wheel_timeout(struct wheel *w, unsigned long now)
+{
+    unsigned long base, bits, idx, dist, tick, best;
+    unsigned l;
+
+    if (w->count == 0)
+        return -1;
+
+    best = w->next + (1UL << LEVEL_SHIFT(WHEEL_LEVELS));
+    for (l = 0; l < WHEEL_LEVELS; l++) {
+        bits = w->occupied[l];
+        if (bits == 0)
+            continue;
+
+        /*
+         * Level 0 slots are due at their own tick.  A higher slot needs
+         * the wheel at its start, and if it is the current slot it holds
+         * timers that wrapped around, due a whole lap later
+         */
+        base = w->next >> LEVEL_SHIFT(l);
+        idx = base & WHEEL_MASK;
+        bits = rotate(bits, idx);
+        if (l > 0)
+            bits &= ~1UL;
+
+        dist = bits != 0 ? (unsigned long)__builtin_ctzl(bits) : WHEEL_SLOTS;
+        tick = (base + dist) << LEVEL_SHIFT(l);
+        if (l == 0)
+            tick = w->next + dist;
+
+        if ((long)(tick - best) < 0)
+            best = tick;
+    }
+
+    return (long)(best - now) > 0 ? (long)(best - now) : 0;
+}
+
+void wheel_destroy(struct wheel **w)
+{
+    if (w == NULL || *w == NULL)
+        return;
+
+    free(*w);
+    *w = NULL;
+}
@@ -0,0 +1,91 @@
+/**
+ * file: generic_wheel.h
+ *
+ * Represents a hierarchical timer wheel.  Adding, removing and
+ * expiring a timer all take constant time however many are pending,
+ * and time that passes with nothing due is skipped over in strides
+ */
+
+#ifndef ALLISONK_GENERIC_WHEEL_H
+#define ALLISONK_GENERIC_WHEEL_H
+
+/**
+ * Represents a timer, embedded in whatever it times.  A zero filled
+ * timer is not pending
+ *
+ * next/prev    Links in the wheel's slot, NULL while not pending
+ * expires      Tick the timer is due at
+ * slot         Slot of the wheel holding the timer
+ */
+struct timer {
+    struct timer *next;
+    struct timer *prev;
+    unsigned long expires;
+    unsigned slot;
+};
+
+/**
+ * Represents a generic timer wheel
+ */
+struct wheel;
+
+/**
+ * Initializes a timer wheel. Will allocate a wheel
+ * and store it in the dereferened parameter
+ *
+ * \param w         Wheel to initialize
+ * \param now       Current tick, in whatever unit the caller counts time
+ */
+void wheel_init(struct wheel **w, unsigned long now);
+
+/**
+ * Schedules a timer, moving it if it is already pending.  A timer
+ * that is already due expires at the first tick not yet advanced to
+ *
+ * \param w         Wheel to add to
+ * \param t         Timer to schedule
+ * \param expires   Tick the timer is due at
+ */
+void wheel_add(struct wheel *w, struct timer *t, unsigned long expires);
+
+/**
+ * Cancels a timer.  Does nothing if it is not pending
+ *
+ * \param w         Wheel the timer was added to
+ * \param t         Timer to cancel
+ */
+void wheel_del(struct wheel *w, struct timer *t);
+
+/**
+ * Moves the wheel on to a tick, running a function for every timer
+ * that has come due.  Each timer is no longer pending when its
+ * function runs, which may add or cancel any timer
+ *
+ * \param w         Wheel to advance
+ * \param now       Current tick
+ * \param fn        Function to run on expired timers
+ * \param param     Extra parameter to pass to function
+ */
+void wheel_advance(struct wheel *w, unsigned long now,
+        void (*fn)(struct timer *t, void *param), void *param);
+
+/**
+ * Returns how long until the wheel next needs to be advanced.  That
+ * may come before any timer is due, when far off timers need to move
+ * closer in
+ *
+ * \param w         Wheel to check
+ * \param now       Current tick
+ * \return          Ticks to wait, -1 if no timer is pending
+ */
+long wheel_timeout(struct wheel *w, unsigned long now);
+
+/**
+ * Destroy a timer wheel.  Pending timers are left as they are.
+ * Sets dereference parameter to NULL
+ *
+ * \param w         Wheel to deallocate
+ */
+void wheel_destroy(struct wheel **w);
+
+#endif
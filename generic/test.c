@@ -4,11 +4,22 @@
  * Test driver for generic_list.h
  */
 
+#define _POSIX_C_SOURCE 200112L
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 
+#include <pthread.h>
+#include <sched.h>
+
 #include "generic_list.h"
+#include "generic_hash.h"
+#include "generic_epoch.h"
+#include "generic_slotmap.h"
+#include "generic_pool.h"
+#include "generic_queue.h"
+#include "generic_wheel.h"
 
 void print_long_item(void *data, void *param);
 void long_test(void);
@@ -16,6 +27,28 @@ void deallocate_user(void *p);
 int compare_user(void *lhs, void *rhs);
 void print_user(void *data, void *param);
 void struct_test(void);
+void hash_test(void);
+void count_item(void *data, void *param);
+void epoch_test(void);
+void count_free(void *p);
+void slotmap_test(void);
+void pool_test(void);
+void *pool_free_half(void *param);
+void queue_test(void);
+void *mpsc_producer(void *param);
+void *spsc_producer(void *param);
+void wheel_test(void);
+void fire_timer(struct timer *t, void *param);
+
+static struct pool *test_pool;
+
+static struct mpsc *test_mpsc;
+
+static struct spsc *test_spsc;
+
+static unsigned long nfreed;
+
+static unsigned long wheel_now;
 
 void print_long_item(void *data, void *param)
 {
@@ -120,6 +153,413 @@ void struct_test()
     list_destroy(&lst);
 }
 
+void count_item(void *data, void *param)
+{
+    unsigned long *sum;
+
+    sum = (unsigned long*)param;
+    *sum += (unsigned long)data;
+}
+
+void hash_test()
+{
+    struct hash *h, *names;
+    unsigned long i, sum;
+    int ok;
+
+    hash_init(&h, NULL, NULL, NULL);
+
+    for (i = 1; i <= 1000; i++)
+        hash_put(h, (void*)i, (void*)(i * 2));
+
+    printf("Size after 1000 puts...");
+    printf("%s\n", hash_size(h) == 1000 ? "Pass" : "Fail");
+
+    printf("Getting every item...");
+    ok = 1;
+    for (i = 1; i <= 1000; i++)
+        ok &= (unsigned long)hash_get(h, (void*)i) == i * 2;
+    printf("%s\n", ok ? "Pass" : "Fail");
+
+    for (i = 1; i <= 1000; i += 2)
+        hash_remove(h, (void*)i);
+
+    printf("Getting after removing odd keys...");
+    ok = hash_size(h) == 500;
+    for (i = 1; i <= 1000; i++)
+        ok &= (unsigned long)hash_get(h, (void*)i) == (i % 2 ? 0 : i * 2);
+    printf("%s\n", ok ? "Pass" : "Fail");
+
+    printf("Iterating remaining items...");
+    sum = 0;
+    hash_for_each(h, &sum, count_item);
+    printf("%s\n", sum == 2 * 250500UL ? "Pass" : "Fail");
+
+    hash_destroy(&h);
+
+    hash_init(&names, NULL, hash_string, hash_string_compare);
+    hash_put(names, "Mark", (void*)1);
+    hash_put(names, "Ron", (void*)2);
+    hash_put(names, "Ron", (void*)3);
+
+    printf("Searching for Ron by string key...");
+    {
+        char key[] = "Ron";
+        printf("%s\n", (unsigned long)hash_get(names, key) == 3
+                && hash_size(names) == 2 ? "Pass" : "Fail");
+    }
+
+    printf("Searching for Trike by string key...");
+    printf("%s\n", hash_get(names, "Trike") == NULL ? "Pass" : "Fail");
+
+    hash_destroy(&names);
+}
+
+void count_free(void *p)
+{
+    (void)p;
+    nfreed++;
+}
+
+void epoch_test()
+{
+    struct epoch *e;
+    static int items[8];
+    int i;
+
+    epoch_init(&e, 2);
+    nfreed = 0;
+
+    /* thread 1 sits in a critical section while thread 0 retires */
+    epoch_enter(e, 1);
+    for (i = 0; i < 8; i++)
+        epoch_retire(e, 0, &items[i], count_free);
+
+    printf("Nothing freed while a reader is inside...");
+    printf("%s\n", nfreed == 0 ? "Pass" : "Fail");
+
+    epoch_exit(e, 1);
+    for (i = 0; i < 4; i++)
+        epoch_retire(e, 0, &items[i], count_free);
+
+    printf("Freed once the reader has left...");
+    printf("%s\n", nfreed >= 8 ? "Pass" : "Fail");
+
+    printf("Destroy frees everything still retired...");
+    epoch_destroy(&e);
+    printf("%s\n", nfreed == 12 && e == NULL ? "Pass" : "Fail");
+}
+
+void slotmap_test()
+{
+    struct slotmap *sm;
+    unsigned long ids[100], stale, sum;
+    size_t sizes[2], i, n;
+    long *keys;
+    int ok;
+
+    sizes[0] = sizeof(long);
+    sizes[1] = 8;
+    slotmap_init(&sm, 2, sizes);
+
+    for (i = 0; i < 100; i++) {
+        ids[i] = slotmap_insert(sm);
+        *(long*)slotmap_at(sm, ids[i], 0) = (long)i;
+        sprintf(slotmap_at(sm, ids[i], 1), "u%lu", (unsigned long)i);
+    }
+
+    printf("Size after 100 inserts...");
+    printf("%s\n", slotmap_size(sm) == 100 ? "Pass" : "Fail");
+
+    for (i = 0; i < 100; i += 2)
+        slotmap_remove(sm, ids[i]);
+
+    printf("Ids stay valid after removing even rows...");
+    ok = slotmap_size(sm) == 50;
+    for (i = 1; i < 100; i += 2) {
+        char name[8];
+        sprintf(name, "u%lu", (unsigned long)i);
+        ok &= *(long*)slotmap_at(sm, ids[i], 0) == (long)i;
+        ok &= strcmp(slotmap_at(sm, ids[i], 1), name) == 0;
+    }
+    printf("%s\n", ok ? "Pass" : "Fail");
+
+    printf("Removed ids are stale...");
+    ok = 1;
+    for (i = 0; i < 100; i += 2)
+        ok &= slotmap_at(sm, ids[i], 0) == NULL;
+    printf("%s\n", ok ? "Pass" : "Fail");
+
+    printf("Reused slot does not revive a stale id...");
+    stale = ids[0];
+    ids[0] = slotmap_insert(sm);
+    printf("%s\n", ids[0] != stale && slotmap_at(sm, stale, 0) == NULL
+            && slotmap_at(sm, ids[0], 0) != NULL ? "Pass" : "Fail");
+
+    printf("Scanning a column...");
+    keys = slotmap_column(sm, 0);
+    n = slotmap_size(sm);
+    sum = 0;
+    for (i = 0; i < n; i++)
+        sum += (unsigned long)keys[i];
+    printf("%s\n", n == 51 && sum == 2500 ? "Pass" : "Fail");
+
+    slotmap_destroy(&sm);
+}
+
+void *pool_free_half(void *param)
+{
+    long **objs;
+    int i;
+
+    objs = param;
+    for (i = 0; i < 500; i++)
+        pool_free(test_pool, objs[i]);
+
+    return NULL;
+}
+
+void pool_test()
+{
+    static long *objs[1000];
+    pthread_t t;
+    int i, ok;
+
+    pool_init(&test_pool, sizeof(long) * 3);
+
+    for (i = 0; i < 1000; i++) {
+        objs[i] = pool_alloc(test_pool);
+        if (objs[i] != NULL)
+            objs[i][0] = objs[i][2] = i;
+    }
+
+    printf("Objects do not overlap...");
+    ok = 1;
+    for (i = 0; i < 1000; i++)
+        ok &= objs[i] != NULL && objs[i][0] == i && objs[i][2] == i;
+    printf("%s\n", ok ? "Pass" : "Fail");
+
+    printf("Freeing from another thread...");
+    ok = pthread_create(&t, NULL, pool_free_half, objs) == 0;
+    if (ok)
+        pthread_join(t, NULL);
+    for (i = 500; i < 1000; i++)
+        pool_free(test_pool, objs[i]);
+    printf("%s\n", ok ? "Pass" : "Fail");
+
+    printf("Reusing freed objects...");
+    ok = 1;
+    for (i = 0; i < 1000; i++) {
+        objs[i] = pool_alloc(test_pool);
+        ok &= objs[i] != NULL;
+    }
+    printf("%s\n", ok ? "Pass" : "Fail");
+
+    pool_destroy(&test_pool);
+}
+
+#define QUEUE_PRODUCERS 4
+#define QUEUE_ITEMS     100000L
+
+/* pushes the producer's number in the low bits above a count */
+void *mpsc_producer(void *param)
+{
+    long i, id;
+
+    id = (long)param;
+    for (i = 1; i <= QUEUE_ITEMS; i++) {
+        while (mpsc_push(test_mpsc, (void*)(i * QUEUE_PRODUCERS + id)) == -1)
+            sched_yield();
+    }
+
+    return NULL;
+}
+
+void *spsc_producer(void *param)
+{
+    long i;
+
+    for (i = 1; i <= QUEUE_ITEMS; i++) {
+        while (spsc_push(test_spsc, (void*)i) == -1)
+            sched_yield();
+    }
+
+    return param;
+}
+
+void queue_test()
+{
+    pthread_t threads[QUEUE_PRODUCERS];
+    long last[QUEUE_PRODUCERS];
+    long i, v, n;
+    int ok;
+
+    mpsc_init(&test_mpsc, 5);
+
+    printf("Empty queue pops nothing...");
+    printf("%s\n", test_mpsc && mpsc_pop(test_mpsc) == NULL ? "Pass" : "Fail");
+
+    printf("Capacity rounds up to a power of two...");
+    ok = 1;
+    for (i = 1; i <= 8; i++)
+        ok &= mpsc_push(test_mpsc, (void*)i) == 0;
+    printf("%s\n", ok && mpsc_push(test_mpsc, (void*)9L) == -1 ? "Pass" : "Fail");
+
+    printf("Items come out in order...");
+    ok = 1;
+    for (i = 1; i <= 8; i++)
+        ok &= (long)mpsc_pop(test_mpsc) == i;
+    printf("%s\n", ok && mpsc_pop(test_mpsc) == NULL ? "Pass" : "Fail");
+
+    mpsc_destroy(&test_mpsc);
+    mpsc_init(&test_mpsc, 1024);
+
+    printf("Items from %d producers arrive once and in order...", QUEUE_PRODUCERS);
+    for (i = 0; i < QUEUE_PRODUCERS; i++) {
+        last[i] = 0;
+        pthread_create(&threads[i], NULL, mpsc_producer, (void*)i);
+    }
+
+    ok = 1;
+    for (n = 0; n < QUEUE_PRODUCERS * QUEUE_ITEMS; ) {
+        v = (long)mpsc_pop(test_mpsc);
+        if (v == 0) {
+            sched_yield();
+            continue;
+        }
+
+        ok &= v / QUEUE_PRODUCERS == last[v % QUEUE_PRODUCERS] + 1;
+        last[v % QUEUE_PRODUCERS] = v / QUEUE_PRODUCERS;
+        n++;
+    }
+
+    for (i = 0; i < QUEUE_PRODUCERS; i++)
+        pthread_join(threads[i], NULL);
+    printf("%s\n", ok && mpsc_pop(test_mpsc) == NULL ? "Pass" : "Fail");
+
+    mpsc_destroy(&test_mpsc);
+    spsc_init(&test_spsc, 64);
+
+    printf("Single producer queue fills and drains...");
+    ok = test_spsc != NULL;
+    for (i = 1; ok && i <= 64; i++)
+        ok &= spsc_push(test_spsc, (void*)i) == 0;
+    ok &= spsc_push(test_spsc, (void*)65L) == -1;
+    for (i = 1; ok && i <= 64; i++)
+        ok &= (long)spsc_pop(test_spsc) == i;
+    printf("%s\n", ok && spsc_pop(test_spsc) == NULL ? "Pass" : "Fail");
+
+    printf("Items from another thread arrive in order...");
+    pthread_create(&threads[0], NULL, spsc_producer, NULL);
+    ok = 1;
+    for (n = 1; n <= QUEUE_ITEMS; ) {
+        v = (long)spsc_pop(test_spsc);
+        if (v == 0) {
+            sched_yield();
+            continue;
+        }
+
+        ok &= v == n;
+        n++;
+    }
+    pthread_join(threads[0], NULL);
+    printf("%s\n", ok ? "Pass" : "Fail");
+
+    spsc_destroy(&test_spsc);
+}
+
+#define WHEEL_TIMERS    1000
+
+/**
+ * A timer that notes when it fired, and fires again every period
+ * while it has repeats left
+ */
+struct test_timer {
+    struct timer t;
+    unsigned long fired;
+    unsigned long period;
+    int repeats;
+};
+
+void fire_timer(struct timer *t, void *param)
+{
+    struct test_timer *tt;
+
+    tt = (struct test_timer*)t;
+    tt->fired = wheel_now;
+    if (tt->repeats-- > 0)
+        wheel_add(param, t, wheel_now + tt->period);
+}
+
+void wheel_test()
+{
+    struct wheel *w;
+    struct test_timer *timers;
+    unsigned long i, expires[WHEEL_TIMERS];
+    long timeout;
+    int ok;
+
+    timers = calloc(WHEEL_TIMERS, sizeof(struct test_timer));
+    wheel_now = 1000;
+    wheel_init(&w, wheel_now);
+
+    printf("Empty wheel has no timeout...");
+    printf("%s\n", w && timers && wheel_timeout(w, wheel_now) == -1 ? "Pass" : "Fail");
+
+    /* from the next tick out to beyond what the wheel spans */
+    for (i = 0; i < WHEEL_TIMERS; i++) {
+        expires[i] = wheel_now + 1 + (i * i * i * 2654435761UL) % (1UL << (i % 32));
+        wheel_add(w, &timers[i].t, expires[i]);
+    }
+
+    printf("Cancelled timers do not fire...");
+    for (i = 0; i < WHEEL_TIMERS; i += 10)
+        wheel_del(w, &timers[i].t);
+    wheel_del(w, &timers[0].t);
+    ok = 1;
+    for (i = 0; i < WHEEL_TIMERS; i += 10)
+        ok &= timers[i].t.next == NULL;
+    printf("%s\n", ok ? "Pass" : "Fail");
+
+    printf("Moving a pending timer reschedules it...");
+    wheel_add(w, &timers[1].t, wheel_now + 70000);
+    expires[1] = wheel_now + 70000;
+    printf("%s\n", timers[1].t.expires == expires[1] ? "Pass" : "Fail");
+
+    printf("Waiting out each timeout fires every timer on its tick...");
+    ok = 1;
+    while ((timeout = wheel_timeout(w, wheel_now)) != -1) {
+        ok &= timeout > 0;
+        wheel_now += (unsigned long)timeout;
+        wheel_advance(w, wheel_now, fire_timer, w);
+    }
+    for (i = 0; i < WHEEL_TIMERS; i++)
+        ok &= i % 10 == 0 ? timers[i].fired == 0 : timers[i].fired == expires[i];
+    printf("%s\n", ok ? "Pass" : "Fail");
+
+    printf("Timers added from a callback fire...");
+    memset(timers, 0, sizeof(struct test_timer));
+    timers[0].period = 100;
+    timers[0].repeats = 3;
+    wheel_add(w, &timers[0].t, wheel_now + 50);
+    i = wheel_now;
+    while ((timeout = wheel_timeout(w, wheel_now)) != -1) {
+        wheel_now += (unsigned long)timeout;
+        wheel_advance(w, wheel_now, fire_timer, w);
+    }
+    printf("%s\n", timers[0].repeats == -1 && timers[0].fired == i + 350 ? "Pass" : "Fail");
+
+    printf("Overdue timers fire on the next advance...");
+    wheel_add(w, &timers[2].t, wheel_now - 500);
+    wheel_now++;
+    wheel_advance(w, wheel_now, fire_timer, w);
+    printf("%s\n", timers[2].fired == wheel_now && wheel_timeout(w, wheel_now) == -1
+            ? "Pass" : "Fail");
+
+    wheel_destroy(&w);
+    free(timers);
+}
+
 int main()
 {   
     printf("=== Unsigned Long Test Start ===\n");
@@ -130,5 +570,29 @@ int main()
     struct_test();
     printf("=== Struct Test End   ===\n\n");
 
+    printf("=== Hash Test Start ===\n");
+    hash_test();
+    printf("=== Hash Test End   ===\n\n");
+
+    printf("=== Epoch Test Start ===\n");
+    epoch_test();
+    printf("=== Epoch Test End   ===\n\n");
+
+    printf("=== Slot Map Test Start ===\n");
+    slotmap_test();
+    printf("=== Slot Map Test End   ===\n\n");
+
+    printf("=== Pool Test Start ===\n");
+    pool_test();
+    printf("=== Pool Test End   ===\n\n");
+
+    printf("=== Queue Test Start ===\n");
+    queue_test();
+    printf("=== Queue Test End   ===\n\n");
+
+    printf("=== Wheel Test Start ===\n");
+    wheel_test();
+    printf("=== Wheel Test End   ===\n\n");
+
     return 0;
 }
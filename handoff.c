@@ -0,0 +1,593 @@
+/**
+ * file: handoff.c
+ *
+ * Hands a running server's sockets over to the server replacing it.
+ * Everything goes down one stream as a run of records, each sent with
+ * a single sendmsg so the descriptor it carries arrives with its first
+ * byte.  The new server acknowledges once it holds every descriptor;
+ * until then the old one can still carry on.  After that the old one
+ * tears down without writing to a client and closes the stream, and
+ * only then does the new one open the message log and start serving
+ */
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/uio.h>
+#include <sys/un.h>
+
+#include "handoff.h"
+#include "chat.h"
+
+/* Bumped whenever a record changes */
+#define HANDOFF_VERSION     1
+#define HANDOFF_BACKLOG     1
+/* How long either server waits on the other before giving up */
+#define HANDOFF_TIMEOUT_S   10
+#define HANDOFF_IOV_BATCH   64
+#define HANDOFF_MIN_CAP     64
+
+/** Type definitions **/
+
+/**
+ * Kinds of record, in the order they are sent
+ *
+ * HANDOFF_HELLO    Starts the handover
+ * HANDOFF_LISTENER A reactor's listening socket
+ * HANDOFF_CLIENT   A connection, followed by the input it has not
+ *                  finished and then its unwritten output
+ * HANDOFF_END      Nothing follows
+ */
+enum handoff_type {
+    HANDOFF_HELLO = 1,
+    HANDOFF_LISTENER,
+    HANDOFF_CLIENT,
+    HANDOFF_END
+};
+
+/**
+ * A record.  Both servers run on the same host, so it goes as it is
+ * laid out in memory, and HELLO turns away a server built with another
+ * layout
+ *
+ * type       Kind of record
+ * shard      Reactor the socket belonged to, HANDOFF_VERSION in HELLO
+ * caddr      Address of the peer
+ * framing    Protocol the client speaks
+ * registered Non-zero if user holds the user bound to the connection
+ * overflow   Set while an overlong line was being dropped
+ * inlen      Bytes of the unfinished line or frame that follow
+ * outlen     Bytes of unwritten output that follow those
+ * user       User bound to the connection
+ */
+struct handoff_record {
+    uint32_t type;
+    uint32_t shard;
+    struct sockaddr_in caddr;
+    uint32_t framing;
+    uint32_t registered;
+    uint32_t overflow;
+    uint32_t inlen;
+    uint64_t outlen;
+    struct chat_user user;
+};
+
+/**
+ * A connection taken over, waiting to be given to a reactor
+ *
+ * rec       Record it came in
+ * sock      Its socket, -1 once given away
+ * in        Unfinished input, rec.inlen bytes
+ * out       Unwritten output, rec.outlen bytes
+ */
+struct handoff_client {
+    struct handoff_record rec;
+    int sock;
+    char *in;
+    char *out;
+};
+
+/**
+ * listeners  Listening sockets by reactor, -1 once given away
+ * nlisteners Number of listening sockets
+ * clients    Connections in the order they came
+ * nclients   Number of connections
+ * cap        Entries allocated in clients
+ */
+struct handoff {
+    int *listeners;
+    unsigned nlisteners;
+    struct handoff_client *clients;
+    size_t nclients;
+    size_t cap;
+};
+
+/** Declarations **/
+
+static int handoff_timeouts(int sock);
+static int handoff_write(int sock, struct iovec *iov, size_t n, int fd);
+static int handoff_read(int sock, void *buf, size_t len, int *fd);
+static int handoff_put(int sock, struct handoff_record *rec, int fd);
+static int handoff_put_client(int sock, unsigned shard, struct client_info *ci);
+static int handoff_get_client(struct handoff *h, int sock,
+        const struct handoff_record *rec, int fd);
+
+/** Helper functions **/
+
+/**
+ * Keeps either server from waiting forever on one that has hung
+ */
+static int handoff_timeouts(int sock)
+{
+    struct timeval tv;
+
+    tv.tv_sec = HANDOFF_TIMEOUT_S;
+    tv.tv_usec = 0;
+    if (setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv)) == -1
+            || setsockopt(sock, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv)) == -1) {
+        perror("[handoff:setsockopt]");
+        return -1;
+    }
+
+    return 0;
+}
+
+/**
+ * Writes every byte described by iov, passing fd along with the first
+ * of them unless it is -1.  iov is modified
+ */
+static int handoff_write(int sock, struct iovec *iov, size_t n, int fd)
+{
+    union {
+        struct cmsghdr hdr;
+        char buf[CMSG_SPACE(sizeof(int))];
+    } ctl;
+    struct cmsghdr *cmsg;
+    struct msghdr msg;
+    ssize_t nsent;
+    size_t len;
+
+    while (n > 0) {
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_iov = iov;
+        msg.msg_iovlen = n;
+        if (fd != -1) {
+            msg.msg_control = ctl.buf;
+            msg.msg_controllen = sizeof(ctl.buf);
+            cmsg = CMSG_FIRSTHDR(&msg);
+            cmsg->cmsg_level = SOL_SOCKET;
+            cmsg->cmsg_type = SCM_RIGHTS;
+            cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+            memcpy(CMSG_DATA(cmsg), &fd, sizeof(int));
+        }
+
+        nsent = sendmsg(sock, &msg, MSG_NOSIGNAL);
+        if (nsent == -1) {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+
+        /* the descriptor went with the first byte */
+        fd = -1;
+        len = (size_t)nsent;
+        while (n > 0 && len >= iov->iov_len) {
+            len -= iov->iov_len;
+            iov++;
+            n--;
+        }
+        if (n > 0) {
+            iov->iov_base = (char*)iov->iov_base + len;
+            iov->iov_len -= len;
+        }
+    }
+
+    return 0;
+}
+
+/**
+ * Reads exactly len bytes.  A descriptor passed along with them is
+ * stored in fd, or closed if fd is NULL
+ */
+static int handoff_read(int sock, void *buf, size_t len, int *fd)
+{
+    union {
+        struct cmsghdr hdr;
+        char buf[CMSG_SPACE(sizeof(int))];
+    } ctl;
+    struct cmsghdr *cmsg;
+    struct msghdr msg;
+    struct iovec iov;
+    ssize_t nrecv;
+    int got;
+
+    if (fd != NULL)
+        *fd = -1;
+
+    while (len > 0) {
+        memset(&msg, 0, sizeof(msg));
+        iov.iov_base = buf;
+        iov.iov_len = len;
+        msg.msg_iov = &iov;
+        msg.msg_iovlen = 1;
+        msg.msg_control = ctl.buf;
+        msg.msg_controllen = sizeof(ctl.buf);
+
+        nrecv = recvmsg(sock, &msg, MSG_CMSG_CLOEXEC);
+        if (nrecv == -1 && errno == EINTR)
+            continue;
+        if (nrecv <= 0)
+            return -1;
+
+        for (cmsg = CMSG_FIRSTHDR(&msg); cmsg != NULL; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+            if (cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS)
+                continue;
+
+            memcpy(&got, CMSG_DATA(cmsg), sizeof(int));
+            if (fd != NULL && *fd == -1)
+                *fd = got;
+            else
+                close(got);
+        }
+
+        buf = (char*)buf + nrecv;
+        len -= (size_t)nrecv;
+    }
+
+    return 0;
+}
+
+/**
+ * Sends a record with nothing following it
+ */
+static int handoff_put(int sock, struct handoff_record *rec, int fd)
+{
+    struct iovec iov;
+
+    iov.iov_base = rec;
+    iov.iov_len = sizeof(*rec);
+    return handoff_write(sock, &iov, 1, fd);
+}
+
+/**
+ * Sends a connection, then its unfinished input and its unwritten
+ * output straight out of the framer and the queue
+ */
+static int handoff_put_client(int sock, unsigned shard, struct client_info *ci)
+{
+    struct handoff_record rec;
+    struct iovec iov[HANDOFF_IOV_BATCH];
+    size_t first, n;
+
+    memset(&rec, 0, sizeof(rec));
+    rec.type = HANDOFF_CLIENT;
+    rec.shard = shard;
+    rec.caddr = ci->caddr;
+    rec.framing = (uint32_t)ci->framing;
+    rec.registered = chat_save(ci, &rec.user) == 0;
+    rec.overflow = (uint32_t)ci->in.overflow;
+    rec.inlen = (uint32_t)ci->in.len;
+    rec.outlen = ci->out.bytes;
+
+    iov[0].iov_base = &rec;
+    iov[0].iov_len = sizeof(rec);
+    iov[1].iov_base = ci->in.buf;
+    iov[1].iov_len = ci->in.len;
+    if (handoff_write(sock, iov, 2, ci->sock) == -1)
+        return -1;
+
+    for (first = 0; (n = outq_iov(&ci->out, first, iov, ARR_SIZE(iov))) > 0; first += n) {
+        if (handoff_write(sock, iov, n, -1) == -1)
+            return -1;
+    }
+
+    return 0;
+}
+
+/**
+ * Reads the rest of a connection's record and keeps the connection
+ * for handoff_restore.  Takes ownership of fd
+ */
+static int handoff_get_client(struct handoff *h, int sock,
+        const struct handoff_record *rec, int fd)
+{
+    struct handoff_client *c, *clients;
+    size_t cap;
+
+    if (h->nclients == h->cap) {
+        cap = h->cap ? h->cap * 2 : HANDOFF_MIN_CAP;
+        clients = realloc(h->clients, cap * sizeof(*clients));
+        if (clients == NULL) {
+            perror("[handoff:receive:realloc]");
+            close(fd);
+            return -1;
+        }
+        h->clients = clients;
+        h->cap = cap;
+    }
+
+    c = &h->clients[h->nclients];
+    c->rec = *rec;
+    c->sock = fd;
+    c->in = malloc(rec->inlen + 1);
+    c->out = malloc((size_t)rec->outlen + 1);
+    h->nclients++;
+
+    if (c->in == NULL || c->out == NULL) {
+        perror("[handoff:receive:malloc]");
+        return -1;
+    }
+
+    if (fd == -1 || handoff_read(sock, c->in, rec->inlen, NULL) == -1
+            || handoff_read(sock, c->out, (size_t)rec->outlen, NULL) == -1)
+        return -1;
+
+    /* never trust a string to be terminated */
+    c->rec.user.handle[HANDLE_BUFFER - 1] = '\0';
+    c->rec.user.room_name[ROOM_NAME_LEN - 1] = '\0';
+    return 0;
+}
+
+/** Handoff functions **/
+
+int handoff_serve(const char *path)
+{
+    struct sockaddr_un addr;
+    int sock;
+
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        fprintf(stderr, "[handoff:serve]: socket path too long\n");
+        return -1;
+    }
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, path);
+
+    sock = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (sock == -1) {
+        perror("[handoff:serve:socket]");
+        return -1;
+    }
+
+    /* left behind by a crash, or by the server this one took over from */
+    unlink(path);
+    if (bind(sock, (struct sockaddr*)&addr, sizeof(addr)) == -1
+            || listen(sock, HANDOFF_BACKLOG) == -1) {
+        perror("[handoff:serve:bind]");
+        close(sock);
+        return -1;
+    }
+
+    return sock;
+}
+
+int handoff_send(int listen_sock, struct reactor **reactors, unsigned n)
+{
+    struct handoff_record rec;
+    struct client_info *ci;
+    size_t nclients = 0;
+    unsigned i;
+    int sock;
+    char ack;
+
+    sock = accept4(listen_sock, NULL, NULL, SOCK_CLOEXEC);
+    if (sock == -1) {
+        perror("[handoff:accept]");
+        return -1;
+    }
+
+    if (handoff_timeouts(sock) == -1)
+        goto close_sock;
+
+    /* broadcasts other shards queued meanwhile leave with the output */
+    for (i = 0; i < n; i++)
+        chat_deliver(i);
+
+    memset(&rec, 0, sizeof(rec));
+    rec.type = HANDOFF_HELLO;
+    rec.shard = HANDOFF_VERSION;
+    if (handoff_put(sock, &rec, -1) == -1)
+        goto failed;
+
+    rec.type = HANDOFF_LISTENER;
+    for (i = 0; i < n; i++) {
+        rec.shard = i;
+        if (handoff_put(sock, &rec, reactor_listener(reactors[i])) == -1)
+            goto failed;
+    }
+
+    for (i = 0; i < n; i++) {
+        for (ci = reactor_clients(reactors[i]); ci != NULL; ci = ci->next) {
+            if (handoff_put_client(sock, i, ci) == -1)
+                goto failed;
+            nclients++;
+        }
+    }
+
+    memset(&rec, 0, sizeof(rec));
+    rec.type = HANDOFF_END;
+    if (handoff_put(sock, &rec, -1) == -1)
+        goto failed;
+
+    /* once it holds every descriptor there is no going back */
+    if (handoff_read(sock, &ack, 1, NULL) == -1)
+        goto failed;
+
+    printf("[server] handed %zu connection(s) over\n", nclients);
+    return sock;
+
+failed:
+    fprintf(stderr, "[handoff:send]: the new server went away\n");
+close_sock:
+    close(sock);
+    return -1;
+}
+
+int handoff_receive(struct handoff **h, const char *path)
+{
+    struct handoff *ho;
+    struct handoff_record rec;
+    struct sockaddr_un addr;
+    int sock, fd, *listeners;
+    char ack = 1;
+
+    *h = NULL;
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        fprintf(stderr, "[handoff:receive]: socket path too long\n");
+        return -1;
+    }
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, path);
+
+    sock = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (sock == -1) {
+        perror("[handoff:receive:socket]");
+        return -1;
+    }
+
+    if (connect(sock, (struct sockaddr*)&addr, sizeof(addr)) == -1) {
+        close(sock);
+        /* nobody to take over from */
+        if (errno == ENOENT || errno == ECONNREFUSED)
+            return 0;
+
+        perror("[handoff:receive:connect]");
+        return -1;
+    }
+
+    ho = calloc(1, sizeof(*ho));
+    if (ho == NULL) {
+        perror("[handoff:receive:calloc]");
+        close(sock);
+        return -1;
+    }
+
+    if (handoff_timeouts(sock) == -1)
+        goto failed;
+
+    if (handoff_read(sock, &rec, sizeof(rec), NULL) == -1
+            || rec.type != HANDOFF_HELLO || rec.shard != HANDOFF_VERSION) {
+        fprintf(stderr, "[handoff:receive]: the running server can't hand over to this one\n");
+        goto failed;
+    }
+
+    for (;;) {
+        if (handoff_read(sock, &rec, sizeof(rec), &fd) == -1) {
+            fprintf(stderr, "[handoff:receive]: the running server went away\n");
+            goto failed;
+        }
+
+        if (rec.type == HANDOFF_END) {
+            break;
+        } else if (rec.type == HANDOFF_CLIENT) {
+            if (handoff_get_client(ho, sock, &rec, fd) == -1)
+                goto failed;
+        } else if (rec.type == HANDOFF_LISTENER && fd != -1) {
+            listeners = realloc(ho->listeners, (ho->nlisteners + 1) * sizeof(*listeners));
+            if (listeners == NULL) {
+                perror("[handoff:receive:realloc]");
+                close(fd);
+                goto failed;
+            }
+            ho->listeners = listeners;
+            ho->listeners[ho->nlisteners++] = fd;
+        } else {
+            fprintf(stderr, "[handoff:receive]: unexpected record %u\n", rec.type);
+            if (fd != -1)
+                close(fd);
+            goto failed;
+        }
+    }
+
+    if (send(sock, &ack, 1, MSG_NOSIGNAL) != 1) {
+        perror("[handoff:receive:send]");
+        goto failed;
+    }
+
+    /* the old server closes the stream once it has let go of the log */
+    errno = 0;
+    if (handoff_read(sock, &ack, 1, NULL) == -1 && (errno == EAGAIN || errno == EWOULDBLOCK))
+        fprintf(stderr, "[handoff:receive]: the old server is slow to exit, carrying on\n");
+    close(sock);
+
+    printf("[server] took over %zu connection(s)\n", ho->nclients);
+    *h = ho;
+    return 0;
+
+failed:
+    close(sock);
+    handoff_destroy(&ho);
+    return -1;
+}
+
+int handoff_listener(struct handoff *h, unsigned i)
+{
+    int sock;
+
+    if (i >= h->nlisteners)
+        return -1;
+
+    sock = h->listeners[i];
+    h->listeners[i] = -1;
+    return sock;
+}
+
+void handoff_restore(struct handoff *h, struct reactor **reactors, unsigned n)
+{
+    struct handoff_client *c;
+    struct client_info *ci;
+    size_t i;
+
+    for (i = 0; i < h->nclients; i++) {
+        c = &h->clients[i];
+        ci = reactor_restore(reactors[c->rec.shard % n], c->sock, &c->rec.caddr,
+                (enum client_framing)c->rec.framing, c->out, (size_t)c->rec.outlen);
+        c->sock = -1;
+        if (ci == NULL)
+            continue;
+
+        if (chat_restore(ci, c->rec.registered ? &c->rec.user : NULL) == -1
+                || ((c->rec.inlen > 0 || c->rec.overflow)
+                    && framer_restore(&ci->in, c->in, c->rec.inlen,
+                        (int)c->rec.overflow) == -1))
+            reactor_close_client(ci);
+    }
+}
+
+void handoff_destroy(struct handoff **h)
+{
+    struct handoff *ho;
+    size_t i;
+
+    if (h == NULL || *h == NULL)
+        return;
+
+    ho = *h;
+    for (i = 0; i < ho->nlisteners; i++) {
+        if (ho->listeners[i] != -1)
+            close(ho->listeners[i]);
+    }
+
+    for (i = 0; i < ho->nclients; i++) {
+        if (ho->clients[i].sock != -1)
+            close(ho->clients[i].sock);
+        free(ho->clients[i].in);
+        free(ho->clients[i].out);
+    }
+
+    free(ho->listeners);
+    free(ho->clients);
+    free(ho);
+    *h = NULL;
+}
@@ -0,0 +1,86 @@
+/**
+ * file: handoff.h
+ *
+ * Hands a running server's sockets over to the server replacing it,
+ * so clients stay connected across an upgrade.  The running server
+ * serves a Unix socket; a new one started on the same path connects
+ * to it and is sent every listening socket and every connection with
+ * SCM_RIGHTS, along with what the reactor and the chat know of each
+ * connection: its framing, the input it has not finished, the output
+ * not yet written and the user it registered
+ */
+
+#ifndef ALLISONK_HANDOFF_H
+#define ALLISONK_HANDOFF_H
+
+#include "reactor.h"
+
+/**
+ * Represents what was taken over from another server
+ */
+struct handoff;
+
+/**
+ * Serves a Unix socket that a new server connects to in order to take
+ * over from this one
+ *
+ * \param path      Path of the socket
+ * \return          Listening socket, -1 on failure
+ */
+int handoff_serve(const char *path);
+
+/**
+ * Accepts the server taking over and sends it everything.  Must be
+ * called while no reactor is running.  On success the connections
+ * belong to the new server, which waits until the returned socket is
+ * closed before it opens the message log, so it should be closed
+ * once everything else has been torn down
+ *
+ * \param listen_sock   Socket returned by handoff_serve
+ * \param reactors      Reactors whose connections to hand over
+ * \param n             Number of reactors
+ * \return              Connection to the new server, -1 if the
+ *                      handover failed and this server should carry on
+ */
+int handoff_send(int listen_sock, struct reactor **reactors, unsigned n);
+
+/**
+ * Takes over from the server serving a Unix socket, if there is one.
+ * Returns once that server has let go of everything
+ *
+ * \param h         Set to what was taken over, NULL if no server was
+ *                  serving the socket
+ * \param path      Path of the socket
+ * \return          0 on success, -1 if the handover failed
+ */
+int handoff_receive(struct handoff **h, const char *path);
+
+/**
+ * Takes a listening socket that was taken over
+ *
+ * \param h         What was taken over
+ * \param i         Index of the reactor that had it
+ * \return          Listening socket, -1 if there was no such reactor
+ */
+int handoff_listener(struct handoff *h, unsigned i);
+
+/**
+ * Gives every connection that was taken over to a reactor, the one of
+ * the same index if there are enough, with its user back in its room.
+ * Must be called before the reactors run
+ *
+ * \param h         What was taken over
+ * \param reactors  Reactors to give connections to
+ * \param n         Number of reactors
+ */
+void handoff_restore(struct handoff *h, struct reactor **reactors, unsigned n);
+
+/**
+ * Closes whatever was taken over and not handed out, and deallocates
+ * the handoff.  Sets dereference parameter to NULL
+ *
+ * \param h         Handoff to destroy
+ */
+void handoff_destroy(struct handoff **h);
+
+#endif
@@ -0,0 +1,76 @@
+/**
+ * file: message.c
+ *
+ * Immutable, reference counted message buffers shared by every
+ * queue a message is delivered through
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "message.h"
+#include "generic/generic_pool.h"
+
+/* Small messages, which is nearly all of them */
+static struct pool *messages;
+
+int message_global_init(void)
+{
+    pool_init(&messages, MESSAGE_POOL_SIZE);
+    return messages ? 0 : -1;
+}
+
+void message_global_destroy(void)
+{
+    pool_destroy(&messages);
+}
+
+struct message *message_alloc(size_t cap)
+{
+    struct message *m;
+    int pooled;
+
+    pooled = messages != NULL && sizeof(*m) + cap <= MESSAGE_POOL_SIZE;
+    m = pooled ? pool_alloc(messages) : malloc(sizeof(*m) + cap);
+    if (m == NULL)
+        return NULL;
+
+    atomic_init(&m->refs, 1);
+    m->pooled = pooled;
+    m->born = 0;
+    m->len = 0;
+    return m;
+}
+
+struct message *message_new(const char *data, size_t len)
+{
+    struct message *m;
+
+    m = message_alloc(len);
+    if (m == NULL)
+        return NULL;
+
+    memcpy(m->data, data, len);
+    m->len = len;
+    return m;
+}
+
+struct message *message_ref(struct message *m)
+{
+    atomic_fetch_add_explicit(&m->refs, 1, memory_order_relaxed);
+    return m;
+}
+
+void message_unref(struct message *m)
+{
+    if (m == NULL)
+        return;
+
+    /* release our writes, acquire everyone else's before freeing */
+    if (atomic_fetch_sub_explicit(&m->refs, 1, memory_order_acq_rel) == 1) {
+        if (m->pooled)
+            pool_free(messages, m);
+        else
+            free(m);
+    }
+}
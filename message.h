@@ -0,0 +1,82 @@
+/**
+ * file: message.h
+ *
+ * Immutable, reference counted message buffers shared by every
+ * queue a message is delivered through
+ */
+
+#ifndef ALLISONK_MESSAGE_H
+#define ALLISONK_MESSAGE_H
+
+#include <stdatomic.h>
+#include <stddef.h>
+
+/* Messages up to this size, header included, come from a pool */
+#define MESSAGE_POOL_SIZE   512
+
+/**
+ * Represents a formatted message.  A message is written once by
+ * its creator and never modified after it has been shared
+ *
+ * refs      Number of holders; the last to release it frees it
+ * pooled    Set when the message came from the message pool
+ * born      Monotonic time (ns) what the message carries was received
+ *           from a user, 0 for anything the server says itself
+ * len       Number of bytes in data
+ * data      Message bytes
+ */
+struct message {
+    atomic_uint refs;
+    int pooled;
+    long long born;
+    size_t len;
+    char data[];
+};
+
+/**
+ * Global setup for messages
+ *
+ * \return          0 on success, -1 on failure
+ */
+int message_global_init(void);
+
+/**
+ * Allocates an empty message with room for cap bytes.  The
+ * caller holds the only reference
+ *
+ * \param cap       Number of bytes to reserve
+ * \return          New message, NULL on failure
+ */
+struct message *message_alloc(size_t cap);
+
+/**
+ * Allocates a message holding a copy of data.  The caller
+ * holds the only reference
+ *
+ * \param data      Bytes to copy
+ * \param len       Number of bytes
+ * \return          New message, NULL on failure
+ */
+struct message *message_new(const char *data, size_t len);
+
+/**
+ * Takes another reference to a message
+ *
+ * \param m         Message to reference
+ * \return          m
+ */
+struct message *message_ref(struct message *m);
+
+/**
+ * Releases a reference to a message, freeing it with the last one
+ *
+ * \param m         Message to release
+ */
+void message_unref(struct message *m);
+
+/**
+ * Global cleanup for messages.  Every message must have been released
+ */
+void message_global_destroy(void);
+
+#endif
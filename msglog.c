@@ -0,0 +1,756 @@
+/**
+ * file: msglog.c
+ *
+ * Append-only log of everything said in a room.  Segments are named
+ * after the sequence number of their first record and preallocated,
+ * so records are written with a plain copy into a shared mapping and
+ * a crash leaves zeroes, never a short file, past the last record.
+ * Each record carries its sequence number and a CRC-32, which is how
+ * a restart finds where a torn segment really ends
+ */
+
+#define _GNU_SOURCE
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "msglog.h"
+#include "room.h"
+#include "generic/generic_hash.h"
+#include "generic/generic_pool.h"
+
+#define MSGLOG_SEGMENT      (16 * 1024 * 1024)
+#define MSGLOG_ALIGN        8
+#define MSGLOG_PAGE         4096
+/* Longest message logged, with room for a whole binary frame's payload */
+#define MSGLOG_MAX_TEXT     8192
+/* Records queued for the writer before new ones are dropped */
+#define MSGLOG_BACKLOG      65536
+/* Index entries a read searches at most */
+#define MSGLOG_SCAN         65536
+#define MSGLOG_NAME_LEN     32
+#define MSGLOG_INDEX_CAP    (MSGLOG_SEGMENT / sizeof(struct record_header))
+
+/** Type definitions **/
+
+/**
+ * Header of a record, followed by its text and padded to MSGLOG_ALIGN
+ *
+ * len       Bytes of text
+ * crc       CRC-32 of the rest of the header and the text
+ * seq       Sequence number, one more than the record before
+ * time      Wall clock time (ms) it was logged
+ * room      Name of the room it was said in
+ */
+struct record_header {
+    uint32_t len;
+    uint32_t crc;
+    uint64_t seq;
+    int64_t time;
+    char room[ROOM_NAME_LEN];
+};
+
+/**
+ * Entry of a segment's index, one per record in order
+ *
+ * seq       Sequence number of the record, 0 past the last entry
+ * offset    Where the record starts in the segment
+ * room      Hash of the room name, so reads skip other rooms unseen
+ */
+struct index_entry {
+    uint64_t seq;
+    uint32_t offset;
+    uint32_t room;
+};
+
+/**
+ * A mapped segment and its index
+ *
+ * first     Sequence number of the first record
+ * fd/ifd    Segment and index files
+ * log       Mapped segment
+ * index     Mapped index
+ * count     Records readers may see, protected by mtx_segments
+ * written   Records written, only touched by the writer
+ * end       Bytes of the segment written
+ * synced    Bytes of the segment synced to disk
+ * isynced   Index entries synced to disk
+ */
+struct segment {
+    uint64_t first;
+    int fd;
+    int ifd;
+    char *log;
+    struct index_entry *index;
+    size_t count;
+    size_t written;
+    size_t end;
+    size_t synced;
+    size_t isynced;
+};
+
+/**
+ * A record waiting for the writer
+ */
+struct pending {
+    struct pending *next;
+    struct message *m;
+    char room[ROOM_NAME_LEN];
+};
+
+/**
+ * dirfd     Directory of the segments
+ * fsync_ms  fsync policy
+ * cur       Segment being written
+ * prev      Segment before it, log is NULL if there is none
+ * next_seq  Sequence number of the next record
+ * last_sync Monotonic time (ms) of the last sync
+ * mtx_segments Protects what readers see of cur and prev
+ * mtx_queue Protects the queue and stop
+ * cond      Signalled when the queue stops being empty, or on stop
+ * head/tail Records waiting for the writer, oldest first
+ * queued    Number of records waiting
+ * dropped   Records dropped because the writer fell behind
+ * stop      Set when the writer should drain the queue and exit
+ * writer    Writer thread
+ * pendings  Pool of queued records
+ */
+struct msglog {
+    int dirfd;
+    long fsync_ms;
+    struct segment cur;
+    struct segment prev;
+    uint64_t next_seq;
+    long long last_sync;
+    pthread_mutex_t mtx_segments;
+    pthread_mutex_t mtx_queue;
+    pthread_cond_t cond;
+    struct pending *head;
+    struct pending *tail;
+    size_t queued;
+    unsigned long dropped;
+    int stop;
+    pthread_t writer;
+    struct pool *pendings;
+};
+
+/** Declarations **/
+
+static void crc_init(void);
+static uint32_t crc32(uint32_t crc, const void *data, size_t len);
+static uint32_t record_crc(const struct record_header *h);
+static size_t record_size(size_t len);
+static long long now_ms(clockid_t clock);
+static int segment_map(struct msglog *lg, struct segment *s, uint64_t first);
+static void segment_unmap(struct segment *s);
+static int segment_valid(struct segment *s, size_t offset, uint64_t seq);
+static void segment_recover(struct segment *s);
+static int segment_append(struct segment *s, uint64_t seq, struct pending *p);
+static void segment_sync(struct segment *s);
+static int msglog_roll(struct msglog *lg);
+static void msglog_write(struct msglog *lg, struct pending *batch);
+static void *msglog_writer(void *arg);
+
+/** Definitions **/
+
+static uint32_t crc_table[256];
+static pthread_once_t crc_once = PTHREAD_ONCE_INIT;
+
+/** Record functions **/
+
+static void crc_init(void)
+{
+    uint32_t c;
+    unsigned i, k;
+
+    for (i = 0; i < 256; i++) {
+        for (c = i, k = 0; k < 8; k++)
+            c = c & 1 ? 0xedb88320U ^ (c >> 1) : c >> 1;
+        crc_table[i] = c;
+    }
+}
+
+static uint32_t crc32(uint32_t crc, const void *data, size_t len)
+{
+    const unsigned char *p;
+
+    crc = ~crc;
+    for (p = data; len > 0; p++, len--)
+        crc = crc_table[(crc ^ *p) & 0xff] ^ (crc >> 8);
+
+    return ~crc;
+}
+
+static uint32_t record_crc(const struct record_header *h)
+{
+    uint32_t crc;
+
+    crc = crc32(0, &h->seq, sizeof(*h) - offsetof(struct record_header, seq));
+    return crc32(crc, h + 1, h->len);
+}
+
+static size_t record_size(size_t len)
+{
+    return (sizeof(struct record_header) + len + MSGLOG_ALIGN - 1)
+        & ~(size_t)(MSGLOG_ALIGN - 1);
+}
+
+static long long now_ms(clockid_t clock)
+{
+    struct timespec ts;
+
+    clock_gettime(clock, &ts);
+    return (long long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/** Segment functions **/
+
+/**
+ * Opens and maps a segment and its index, creating them if needed
+ *
+ * \return          0 on success, -1 on failure
+ */
+static int segment_map(struct msglog *lg, struct segment *s, uint64_t first)
+{
+    char name[MSGLOG_NAME_LEN];
+    struct stat st;
+    int err;
+
+    memset(s, 0, sizeof(*s));
+    s->first = first;
+    s->fd = s->ifd = -1;
+
+    snprintf(name, sizeof(name), "%016llx.log", (unsigned long long)first);
+    s->fd = openat(lg->dirfd, name, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+    snprintf(name, sizeof(name), "%016llx.idx", (unsigned long long)first);
+    s->ifd = openat(lg->dirfd, name, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+    if (s->fd == -1 || s->ifd == -1) {
+        perror("[msglog:openat]");
+        goto close_files;
+    }
+
+    /* reserve the blocks now, a full disk must not fault a store later */
+    if (fstat(s->fd, &st) == -1 || st.st_size < MSGLOG_SEGMENT) {
+        err = posix_fallocate(s->fd, 0, MSGLOG_SEGMENT);
+        if (err != 0) {
+            errno = err;
+            perror("[msglog:posix_fallocate]");
+            goto close_files;
+        }
+    }
+    if (fstat(s->ifd, &st) == -1
+            || (size_t)st.st_size < MSGLOG_INDEX_CAP * sizeof(struct index_entry)) {
+        err = posix_fallocate(s->ifd, 0,
+                (off_t)(MSGLOG_INDEX_CAP * sizeof(struct index_entry)));
+        if (err != 0) {
+            errno = err;
+            perror("[msglog:posix_fallocate]");
+            goto close_files;
+        }
+    }
+
+    s->log = mmap(NULL, MSGLOG_SEGMENT, PROT_READ | PROT_WRITE, MAP_SHARED,
+            s->fd, 0);
+    if (s->log == MAP_FAILED) {
+        perror("[msglog:mmap]");
+        s->log = NULL;
+        goto close_files;
+    }
+
+    s->index = mmap(NULL, MSGLOG_INDEX_CAP * sizeof(struct index_entry),
+            PROT_READ | PROT_WRITE, MAP_SHARED, s->ifd, 0);
+    if (s->index == MAP_FAILED) {
+        perror("[msglog:mmap]");
+        s->index = NULL;
+        goto unmap_log;
+    }
+
+    return 0;
+
+unmap_log:
+    munmap(s->log, MSGLOG_SEGMENT);
+    s->log = NULL;
+close_files:
+    if (s->fd != -1)
+        close(s->fd);
+    if (s->ifd != -1)
+        close(s->ifd);
+    return -1;
+}
+
+static void segment_unmap(struct segment *s)
+{
+    if (s->log == NULL)
+        return;
+
+    munmap(s->index, MSGLOG_INDEX_CAP * sizeof(struct index_entry));
+    munmap(s->log, MSGLOG_SEGMENT);
+    close(s->ifd);
+    close(s->fd);
+    s->log = NULL;
+    s->index = NULL;
+}
+
+/**
+ * Tells whether a whole record with the given sequence number
+ * starts at offset
+ */
+static int segment_valid(struct segment *s, size_t offset, uint64_t seq)
+{
+    struct record_header *h;
+
+    if (offset % MSGLOG_ALIGN != 0
+            || offset + sizeof(*h) > MSGLOG_SEGMENT)
+        return 0;
+
+    h = (struct record_header*)(s->log + offset);
+    return h->seq == seq && h->len > 0 && h->len <= MSGLOG_MAX_TEXT
+        && offset + record_size(h->len) <= MSGLOG_SEGMENT
+        && h->crc == record_crc(h);
+}
+
+/**
+ * Finds where the segment really ends after a crash.  Only its tail
+ * is checked: the index is walked back to the last entry naming a
+ * whole record, then records the index never got are picked up, and
+ * whatever a torn write left past them is zeroed
+ */
+static void segment_recover(struct segment *s)
+{
+    struct record_header *h;
+    size_t n, i, j, page_end;
+
+    for (n = MSGLOG_INDEX_CAP; n > 0 && s->index[n - 1].seq == 0; n--)
+        ;
+
+    while (n > 0 && (s->index[n - 1].seq != s->first + n - 1
+                || !segment_valid(s, s->index[n - 1].offset, s->first + n - 1)))
+        n--;
+
+    s->end = 0;
+    if (n > 0) {
+        h = (struct record_header*)(s->log + s->index[n - 1].offset);
+        s->end = s->index[n - 1].offset + record_size(h->len);
+    }
+
+    while (n < MSGLOG_INDEX_CAP && segment_valid(s, s->end, s->first + n)) {
+        h = (struct record_header*)(s->log + s->end);
+        s->index[n].seq = h->seq;
+        s->index[n].offset = (uint32_t)s->end;
+        s->index[n].room = (uint32_t)hash_string(h->room);
+        s->end += record_size(h->len);
+        n++;
+    }
+
+    /* writes are sequential, so the first untouched page ends the damage */
+    for (i = s->end; i < MSGLOG_SEGMENT; i = page_end) {
+        page_end = (i / MSGLOG_PAGE + 1) * MSGLOG_PAGE;
+        for (j = i; j < page_end && s->log[j] == '\0'; j++)
+            ;
+        if (j == page_end && i % MSGLOG_PAGE == 0)
+            break;
+        memset(s->log + i, 0, page_end - i);
+    }
+    for (i = n; i < MSGLOG_INDEX_CAP && s->index[i].seq != 0; i++)
+        memset(&s->index[i], 0, sizeof(s->index[i]));
+
+    s->count = s->written = n;
+    s->synced = s->end;
+    s->isynced = n;
+}
+
+/**
+ * Writes a record into a segment
+ *
+ * \return          0 on success, -1 if the segment is full
+ */
+static int segment_append(struct segment *s, uint64_t seq, struct pending *p)
+{
+    struct record_header *h;
+    size_t size;
+
+    size = record_size(p->m->len);
+    if (s->end + size > MSGLOG_SEGMENT || s->written == MSGLOG_INDEX_CAP)
+        return -1;
+
+    h = (struct record_header*)(s->log + s->end);
+    memcpy(h + 1, p->m->data, p->m->len);
+    h->len = (uint32_t)p->m->len;
+    h->seq = seq;
+    h->time = now_ms(CLOCK_REALTIME);
+    memcpy(h->room, p->room, ROOM_NAME_LEN);
+    h->crc = record_crc(h);
+
+    s->index[s->written].seq = seq;
+    s->index[s->written].offset = (uint32_t)s->end;
+    s->index[s->written].room = (uint32_t)hash_string(p->room);
+
+    s->end += size;
+    s->written++;
+    return 0;
+}
+
+/**
+ * Syncs what was written to a segment since it was last synced
+ */
+static void segment_sync(struct segment *s)
+{
+    size_t from;
+
+    if (s->end > s->synced) {
+        from = s->synced & ~(size_t)(MSGLOG_PAGE - 1);
+        if (msync(s->log + from, s->end - from, MS_SYNC) == -1)
+            perror("[msglog:msync]");
+        s->synced = s->end;
+    }
+
+    if (s->written > s->isynced) {
+        from = (s->isynced * sizeof(struct index_entry)) & ~(size_t)(MSGLOG_PAGE - 1);
+        if (msync((char*)s->index + from,
+                    s->written * sizeof(struct index_entry) - from, MS_SYNC) == -1)
+            perror("[msglog:msync]");
+        s->isynced = s->written;
+    }
+}
+
+/** Log functions **/
+
+int msglog_open(struct msglog **lg, const char *dir, long fsync_ms)
+{
+    struct msglog *l;
+    struct dirent *de;
+    DIR *d;
+    unsigned long long first, newest = 0, older = 0;
+    char name[MSGLOG_NAME_LEN];
+    int fd;
+
+    pthread_once(&crc_once, crc_init);
+
+    l = calloc(1, sizeof(*l));
+    if (l == NULL) {
+        perror("[msglog:calloc]");
+        return -1;
+    }
+
+    l->fsync_ms = fsync_ms;
+    if (mkdir(dir, 0755) == -1 && errno != EEXIST) {
+        perror("[msglog:mkdir]");
+        goto free_log;
+    }
+
+    l->dirfd = open(dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (l->dirfd == -1) {
+        perror("[msglog:open]");
+        goto free_log;
+    }
+
+    /* only the two newest segments are ever read */
+    fd = dup(l->dirfd);
+    d = fd == -1 ? NULL : fdopendir(fd);
+    if (d == NULL) {
+        perror("[msglog:opendir]");
+        if (fd != -1)
+            close(fd);
+        goto close_dir;
+    }
+    while ((de = readdir(d)) != NULL) {
+        if (sscanf(de->d_name, "%16llx.log", &first) != 1 || first == 0)
+            continue;
+        snprintf(name, sizeof(name), "%016llx.log", first);
+        if (strcmp(name, de->d_name) != 0)
+            continue;
+
+        if (first > newest) {
+            older = newest;
+            newest = first;
+        } else if (first > older) {
+            older = first;
+        }
+    }
+    closedir(d);
+
+    if (segment_map(l, &l->cur, newest ? newest : 1) == -1)
+        goto close_dir;
+    segment_recover(&l->cur);
+
+    if (older != 0) {
+        if (segment_map(l, &l->prev, older) == -1)
+            goto unmap_cur;
+        segment_recover(&l->prev);
+    }
+
+    l->next_seq = l->cur.first + l->cur.count;
+    l->last_sync = now_ms(CLOCK_MONOTONIC);
+
+    pool_init(&l->pendings, sizeof(struct pending));
+    if (l->pendings == NULL) {
+        perror("[msglog:pool_init]");
+        goto unmap_prev;
+    }
+
+    pthread_mutex_init(&l->mtx_segments, NULL);
+    pthread_mutex_init(&l->mtx_queue, NULL);
+    pthread_cond_init(&l->cond, NULL);
+
+    if (pthread_create(&l->writer, NULL, msglog_writer, l) != 0) {
+        fprintf(stderr, "[msglog:pthread_create]: failed to create thread\n");
+        pthread_cond_destroy(&l->cond);
+        pthread_mutex_destroy(&l->mtx_queue);
+        pthread_mutex_destroy(&l->mtx_segments);
+        pool_destroy(&l->pendings);
+        goto unmap_prev;
+    }
+
+    *lg = l;
+    return 0;
+
+unmap_prev:
+    segment_unmap(&l->prev);
+unmap_cur:
+    segment_unmap(&l->cur);
+close_dir:
+    close(l->dirfd);
+free_log:
+    free(l);
+    return -1;
+}
+
+int msglog_append(struct msglog *lg, const char *room, struct message *m)
+{
+    struct pending *p;
+    int was_empty;
+
+    if (m->len == 0 || m->len > MSGLOG_MAX_TEXT)
+        return -1;
+
+    p = pool_alloc(lg->pendings);
+    if (p == NULL)
+        return -1;
+
+    p->next = NULL;
+    p->m = message_ref(m);
+    strncpy(p->room, room, ROOM_NAME_LEN - 1);
+    p->room[ROOM_NAME_LEN - 1] = '\0';
+
+    pthread_mutex_lock(&lg->mtx_queue);
+    if (lg->queued >= MSGLOG_BACKLOG) {
+        lg->dropped++;
+        pthread_mutex_unlock(&lg->mtx_queue);
+        message_unref(p->m);
+        pool_free(lg->pendings, p);
+        return -1;
+    }
+
+    was_empty = lg->head == NULL;
+    if (was_empty)
+        lg->head = p;
+    else
+        lg->tail->next = p;
+    lg->tail = p;
+    lg->queued++;
+    pthread_mutex_unlock(&lg->mtx_queue);
+
+    if (was_empty)
+        pthread_cond_signal(&lg->cond);
+
+    return 0;
+}
+
+size_t msglog_recent(struct msglog *lg, const char *room,
+        struct message **out, size_t max)
+{
+    struct segment *s;
+    struct record_header *h;
+    struct message *m;
+    uint32_t hv;
+    size_t i, n = 0, scanned = 0;
+
+    hv = (uint32_t)hash_string((void*)room);
+
+    pthread_mutex_lock(&lg->mtx_segments);
+    for (s = &lg->cur; s != NULL && s->log != NULL;
+            s = s == &lg->cur ? &lg->prev : NULL) {
+        for (i = s->count; i > 0 && n < max && scanned < MSGLOG_SCAN; i--, scanned++) {
+            if (s->index[i - 1].room != hv)
+                continue;
+
+            h = (struct record_header*)(s->log + s->index[i - 1].offset);
+            if (strncmp(h->room, room, ROOM_NAME_LEN) != 0)
+                continue;
+
+            m = message_new((const char*)(h + 1), h->len);
+            if (m == NULL)
+                break;
+            out[n++] = m;
+        }
+    }
+    pthread_mutex_unlock(&lg->mtx_segments);
+
+    /* found newest first */
+    for (i = 0; i < n / 2; i++) {
+        m = out[i];
+        out[i] = out[n - 1 - i];
+        out[n - 1 - i] = m;
+    }
+
+    return n;
+}
+
+/**
+ * Starts a new segment once the current one is full.  The full one
+ * is synced first unless the policy says never
+ *
+ * \return          0 on success, -1 on failure
+ */
+static int msglog_roll(struct msglog *lg)
+{
+    struct segment next, old;
+
+    if (segment_map(lg, &next, lg->next_seq) == -1)
+        return -1;
+
+    if (lg->fsync_ms != MSGLOG_FSYNC_NEVER)
+        segment_sync(&lg->cur);
+
+    pthread_mutex_lock(&lg->mtx_segments);
+    lg->cur.count = lg->cur.written;
+    old = lg->prev;
+    lg->prev = lg->cur;
+    lg->cur = next;
+    pthread_mutex_unlock(&lg->mtx_segments);
+
+    segment_unmap(&old);
+    return 0;
+}
+
+/**
+ * Writes out a group of records, makes them visible to readers and
+ * syncs them as the policy asks
+ */
+static void msglog_write(struct msglog *lg, struct pending *batch)
+{
+    struct pending *p, *next;
+    long long now;
+
+    for (p = batch; p != NULL; p = next) {
+        next = p->next;
+
+        if (segment_append(&lg->cur, lg->next_seq, p) == -1
+                && (msglog_roll(lg) == -1
+                    || segment_append(&lg->cur, lg->next_seq, p) == -1))
+            fprintf(stderr, "[msglog:write]: failed to log a message\n");
+        else
+            lg->next_seq++;
+
+        message_unref(p->m);
+        pool_free(lg->pendings, p);
+    }
+
+    pthread_mutex_lock(&lg->mtx_segments);
+    lg->cur.count = lg->cur.written;
+    pthread_mutex_unlock(&lg->mtx_segments);
+
+    now = now_ms(CLOCK_MONOTONIC);
+    if (lg->fsync_ms == MSGLOG_FSYNC_ALWAYS
+            || (lg->fsync_ms > 0 && now - lg->last_sync >= lg->fsync_ms)) {
+        segment_sync(&lg->cur);
+        lg->last_sync = now;
+    }
+}
+
+/**
+ * Entry point of the writer thread.  Takes the whole queue at a
+ * time, so records that arrive while a group is being synced are
+ * committed together in the next one
+ */
+static void *msglog_writer(void *arg)
+{
+    struct msglog *lg;
+    struct pending *batch;
+    struct timespec ts;
+    long long wait;
+    int stopping;
+
+    lg = arg;
+
+    pthread_mutex_lock(&lg->mtx_queue);
+    for (;;) {
+        while (lg->head == NULL && !lg->stop) {
+            /* records written but not synced yet are synced on time */
+            if (lg->fsync_ms > 0 && lg->cur.synced < lg->cur.end) {
+                wait = lg->last_sync + lg->fsync_ms - now_ms(CLOCK_MONOTONIC);
+                if (wait <= 0)
+                    break;
+                clock_gettime(CLOCK_REALTIME, &ts);
+                ts.tv_sec += wait / 1000;
+                ts.tv_nsec += (wait % 1000) * 1000000;
+                if (ts.tv_nsec >= 1000000000) {
+                    ts.tv_sec++;
+                    ts.tv_nsec -= 1000000000;
+                }
+                pthread_cond_timedwait(&lg->cond, &lg->mtx_queue, &ts);
+            } else {
+                pthread_cond_wait(&lg->cond, &lg->mtx_queue);
+            }
+        }
+
+        batch = lg->head;
+        lg->head = lg->tail = NULL;
+        lg->queued = 0;
+        stopping = lg->stop;
+        pthread_mutex_unlock(&lg->mtx_queue);
+
+        msglog_write(lg, batch);
+
+        pthread_mutex_lock(&lg->mtx_queue);
+        if (stopping && lg->head == NULL)
+            break;
+    }
+    pthread_mutex_unlock(&lg->mtx_queue);
+
+    if (lg->fsync_ms != MSGLOG_FSYNC_NEVER)
+        segment_sync(&lg->cur);
+
+    return NULL;
+}
+
+void msglog_close(struct msglog **lg)
+{
+    struct msglog *l;
+
+    if (lg == NULL || *lg == NULL)
+        return;
+
+    l = *lg;
+
+    pthread_mutex_lock(&l->mtx_queue);
+    l->stop = 1;
+    pthread_mutex_unlock(&l->mtx_queue);
+    pthread_cond_signal(&l->cond);
+    pthread_join(l->writer, NULL);
+
+    if (l->dropped > 0)
+        fprintf(stderr, "[msglog] %lu messages were not logged, the disk fell behind\n",
+                l->dropped);
+
+    segment_unmap(&l->prev);
+    segment_unmap(&l->cur);
+    pool_destroy(&l->pendings);
+    pthread_cond_destroy(&l->cond);
+    pthread_mutex_destroy(&l->mtx_queue);
+    pthread_mutex_destroy(&l->mtx_segments);
+    close(l->dirfd);
+    free(l);
+    *lg = NULL;
+}
@@ -0,0 +1,77 @@
+/**
+ * file: msglog.h
+ *
+ * Append-only log of everything said in a room, kept on disk so
+ * history survives a restart.  The log is a directory of segments,
+ * each a preallocated file of records read and written through mmap
+ * with an index of fixed size entries beside it, so recent records
+ * are found without parsing a whole segment.  Reactors only queue
+ * records; a thread of the log's own writes them out in groups,
+ * syncing them to disk as the fsync policy asks
+ */
+
+#ifndef ALLISONK_MSGLOG_H
+#define ALLISONK_MSGLOG_H
+
+#include <stddef.h>
+
+#include "message.h"
+
+/* fsync policies, anything above them is an interval in ms */
+#define MSGLOG_FSYNC_NEVER  -1L
+#define MSGLOG_FSYNC_ALWAYS 0L
+
+/**
+ * Represents an open log
+ */
+struct msglog;
+
+/**
+ * Opens the log in a directory, creating it if needed.  A segment
+ * torn by a crash is cut back to its last whole record
+ *
+ * \param lg        Set to the open log
+ * \param dir       Directory holding the segments
+ * \param fsync_ms  MSGLOG_FSYNC_NEVER to leave syncing to the kernel,
+ *                  MSGLOG_FSYNC_ALWAYS to sync every group of records,
+ *                  otherwise the longest a written record may go unsynced
+ * \return          0 on success, -1 on failure
+ */
+int msglog_open(struct msglog **lg, const char *dir, long fsync_ms);
+
+/**
+ * Queues a message said in a room to be logged.  Never blocks on
+ * the disk; the message is dropped if the writer has fallen too far
+ * behind
+ *
+ * \param lg        Log to append to
+ * \param room      Name of the room
+ * \param m         Message, the log takes a reference to it
+ * \return          0 on success, -1 if the message was dropped
+ */
+int msglog_append(struct msglog *lg, const char *room, struct message *m);
+
+/**
+ * Reads back the last messages logged for a room, oldest first.
+ * Only the most recent segments are searched
+ *
+ * \param lg        Log to read
+ * \param room      Name of the room
+ * \param out       Filled with new messages, the caller holds the
+ *                  only reference to each
+ * \param max       Number of entries in out
+ * \return          Number of messages read
+ */
+size_t msglog_recent(struct msglog *lg, const char *room,
+        struct message **out, size_t max);
+
+/**
+ * Writes out everything queued, syncs it unless the policy is
+ * MSGLOG_FSYNC_NEVER, and closes the log.
+ * Sets dereference parameter to NULL
+ *
+ * \param lg        Log to close
+ */
+void msglog_close(struct msglog **lg);
+
+#endif
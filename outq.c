@@ -0,0 +1,195 @@
+/**
+ * file: outq.c
+ *
+ * Bounded queue of messages waiting to be written to a client
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "outq.h"
+#include "stats.h"
+
+#define OUTQ_MIN_CAP    8
+
+/** Declarations **/
+
+static int outq_grow(struct outq *q);
+static void outq_pop(struct outq *q);
+
+/** Queue functions **/
+
+/**
+ * Doubles the ring, unwrapping it so the oldest message is in slot 0
+ */
+static int outq_grow(struct outq *q)
+{
+    struct message **ring;
+    size_t cap, first;
+
+    cap = q->cap ? q->cap * 2 : OUTQ_MIN_CAP;
+    ring = malloc(cap * sizeof(*ring));
+    if (ring == NULL)
+        return -1;
+
+    if (q->count > 0) {
+        first = q->cap - q->head;
+        if (first > q->count)
+            first = q->count;
+        memcpy(ring, q->ring + q->head, first * sizeof(*ring));
+        memcpy(ring + first, q->ring, (q->count - first) * sizeof(*ring));
+    }
+
+    free(q->ring);
+    q->ring = ring;
+    q->cap = cap;
+    q->head = 0;
+    return 0;
+}
+
+int outq_push(struct outq *q, struct message *m)
+{
+    if (q->count == q->cap && outq_grow(q) == -1)
+        return -1;
+
+    q->ring[(q->head + q->count) & (q->cap - 1)] = message_ref(m);
+    q->count++;
+    q->bytes += m->len;
+
+    return 0;
+}
+
+const char *outq_peek(struct outq *q, size_t *len)
+{
+    struct message *m;
+
+    if (q->count == 0) {
+        *len = 0;
+        return NULL;
+    }
+
+    m = q->ring[q->head];
+    *len = m->len - q->offset;
+    return m->data + q->offset;
+}
+
+size_t outq_iov(struct outq *q, size_t first, struct iovec *iov, size_t max)
+{
+    struct message *m;
+    size_t i, n;
+
+    if (first >= q->count)
+        return 0;
+
+    n = q->count - first < max ? q->count - first : max;
+    for (i = 0; i < n; i++) {
+        m = q->ring[(q->head + first + i) & (q->cap - 1)];
+        iov[i].iov_base = m->data;
+        iov[i].iov_len = m->len;
+    }
+
+    if (n > 0 && first == 0) {
+        iov[0].iov_base = (char*)iov[0].iov_base + q->offset;
+        iov[0].iov_len -= q->offset;
+    }
+
+    return n;
+}
+
+/**
+ * Releases the oldest message along with whatever of it remains unwritten
+ */
+static void outq_pop(struct outq *q)
+{
+    struct message *m;
+
+    m = q->ring[q->head];
+    q->head = (q->head + 1) & (q->cap - 1);
+    q->count--;
+    if (q->pinned > 0)
+        q->pinned--;
+
+    q->bytes -= m->len - q->offset;
+    q->offset = 0;
+    message_unref(m);
+}
+
+void outq_consume(struct outq *q, size_t len, unsigned shard)
+{
+    struct message *m;
+    size_t left;
+    long long now = 0;
+
+    q->pinned_bytes -= len < q->pinned_bytes ? len : q->pinned_bytes;
+    stats_add(shard, STAT_BYTES_OUT, (long)len);
+
+    while (len > 0 && q->count > 0) {
+        m = q->ring[q->head];
+        left = m->len - q->offset;
+        if (len < left) {
+            q->offset += len;
+            q->bytes -= len;
+            return;
+        }
+
+        /* one clock read serves every message this write finished */
+        if (m->born != 0 && m->born >= q->since) {
+            if (now == 0)
+                now = stats_now();
+            stats_time(shard, STAT_FANOUT, now - m->born);
+        }
+        stats_add(shard, STAT_MSGS_OUT, 1);
+
+        len -= left;
+        outq_pop(q);
+    }
+}
+
+size_t outq_trim(struct outq *q, size_t low)
+{
+    struct message *m;
+    size_t keep, kept, i, ndropped = 0;
+
+    /**
+     * Set aside whatever an outstanding write still refers to, or
+     * else a partially written head so the peer never sees a torn line */
+    keep = q->pinned;
+    kept = q->pinned_bytes;
+    if (keep == 0 && q->offset > 0) {
+        keep = 1;
+        kept = q->ring[q->head]->len - q->offset;
+    }
+    low = low > kept ? low - kept : 0;
+
+    /* drop the oldest messages behind the kept ones */
+    while (q->bytes - kept > low && q->count - ndropped > keep) {
+        m = q->ring[(q->head + keep + ndropped) & (q->cap - 1)];
+        q->bytes -= m->len;
+        message_unref(m);
+        ndropped++;
+    }
+
+    /* then close the gap by moving the kept ones up behind the survivors */
+    for (i = keep; i > 0; i--)
+        q->ring[(q->head + i - 1 + ndropped) & (q->cap - 1)] =
+            q->ring[(q->head + i - 1) & (q->cap - 1)];
+    q->head = (q->head + ndropped) & (q->cap - 1);
+    q->count -= ndropped;
+
+    return ndropped;
+}
+
+void outq_clear(struct outq *q)
+{
+    while (q->count > 0)
+        outq_pop(q);
+
+    free(q->ring);
+    q->ring = NULL;
+    q->cap = 0;
+    q->head = 0;
+    q->bytes = 0;
+    q->pinned = 0;
+    q->pinned_bytes = 0;
+    q->since = 0;
+}
@@ -0,0 +1,104 @@
+/**
+ * file: outq.h
+ *
+ * Bounded queue of messages waiting to be written to a client
+ */
+
+#ifndef ALLISONK_OUTQ_H
+#define ALLISONK_OUTQ_H
+
+#include <stddef.h>
+
+#include <sys/uio.h>
+
+#include "message.h"
+
+/**
+ * Represents a connection's outbound queue.  The queue holds a
+ * reference to each shared message rather than a copy of it
+ *
+ * ring      Queued messages, oldest at head
+ * cap       Slots in ring, zero or a power of two
+ * head      Slot of the oldest message
+ * count     Number of queued messages
+ * bytes     Unwritten bytes across every queued message
+ * offset    Bytes of the oldest message already written
+ * pinned    Oldest messages handed to an asynchronous write, which
+ *           outq_trim must not drop until the write completes
+ * pinned_bytes Unwritten bytes of the pinned messages.  Both shrink
+ *           as outq_consume releases what was written
+ * since     Monotonic time (ns) before which messages were received that
+ *           are only queued as history, so their delivery is not timed
+ */
+struct outq {
+    struct message **ring;
+    size_t cap;
+    size_t head;
+    size_t count;
+    size_t bytes;
+    size_t offset;
+    size_t pinned;
+    size_t pinned_bytes;
+    long long since;
+};
+
+/**
+ * Appends a message to the queue, taking a reference to it
+ *
+ * \param q         Queue to append to
+ * \param m         Message to queue
+ * \return          0 on success, -1 on failure
+ */
+int outq_push(struct outq *q, struct message *m);
+
+/**
+ * Returns the unwritten part of the oldest message
+ *
+ * \param q         Queue to peek
+ * \param len       Set to the number of unwritten bytes
+ * \return          Unwritten bytes, NULL if the queue is empty
+ */
+const char *outq_peek(struct outq *q, size_t *len);
+
+/**
+ * Describes the unwritten part of queued messages as an iovec
+ * array, so they can be written with a single gather write
+ *
+ * \param q         Queue to describe
+ * \param first     Number of oldest messages to skip
+ * \param iov       Array to fill
+ * \param max       Number of entries in iov
+ * \return          Number of entries filled
+ */
+size_t outq_iov(struct outq *q, size_t first, struct iovec *iov, size_t max);
+
+/**
+ * Marks bytes at the front of the queue as written, releasing
+ * every message that has been written in full and counting it in
+ * the stats
+ *
+ * \param q         Queue to consume from
+ * \param len       Number of bytes written
+ * \param shard     Shard of the calling thread
+ */
+void outq_consume(struct outq *q, size_t len, unsigned shard);
+
+/**
+ * Drops the oldest messages until at most low bytes are queued.
+ * A partially written message is never dropped, the peer would
+ * otherwise receive a torn line, and neither is a pinned one
+ *
+ * \param q         Queue to trim
+ * \param low       Number of bytes to trim down to
+ * \return          Number of messages dropped
+ */
+size_t outq_trim(struct outq *q, size_t low);
+
+/**
+ * Releases every queued message and the queue's storage
+ *
+ * \param q         Queue to clear
+ */
+void outq_clear(struct outq *q);
+
+#endif
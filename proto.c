@@ -0,0 +1,54 @@
+/**
+ * file: proto.c
+ *
+ * Length-prefixed binary framing for bots and bridges
+ */
+
+#include <string.h>
+
+#include <arpa/inet.h>
+
+#include "proto.h"
+
+int proto_decode(const char *body, size_t len, struct frame *fr)
+{
+    uint32_t v;
+
+    if (len < PROTO_HEADER_LEN - PROTO_LEN_SIZE)
+        return -1;
+
+    fr->type = (unsigned char)body[0];
+    memcpy(&v, body + 4, sizeof(v));
+    fr->sender = ntohl(v);
+    memcpy(&v, body + 8, sizeof(v));
+    fr->room = ntohl(v);
+    fr->payload = body + PROTO_HEADER_LEN - PROTO_LEN_SIZE;
+    fr->len = len - (PROTO_HEADER_LEN - PROTO_LEN_SIZE);
+    return 0;
+}
+
+struct message *proto_message(unsigned type, uint32_t sender, uint32_t room,
+        const char *payload, size_t len)
+{
+    struct message *m;
+    uint32_t v;
+
+    m = message_alloc(PROTO_HEADER_LEN + len);
+    if (m == NULL)
+        return NULL;
+
+    v = htonl((uint32_t)(PROTO_HEADER_LEN - PROTO_LEN_SIZE + len));
+    memcpy(m->data, &v, sizeof(v));
+    m->data[4] = (char)type;
+    m->data[5] = 0;
+    m->data[6] = 0;
+    m->data[7] = 0;
+    v = htonl(sender);
+    memcpy(m->data + 8, &v, sizeof(v));
+    v = htonl(room);
+    memcpy(m->data + 12, &v, sizeof(v));
+    memcpy(m->data + PROTO_HEADER_LEN, payload, len);
+
+    m->len = PROTO_HEADER_LEN + len;
+    return m;
+}
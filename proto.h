@@ -0,0 +1,108 @@
+/**
+ * file: proto.h
+ *
+ * Length-prefixed binary framing for bots and bridges.  A client
+ * selects it by sending a single zero byte before anything else; the
+ * server answers with a zero byte of its own, after which both sides
+ * only exchange frames.  Anything the client receives before that
+ * zero byte is the text prompt and can be skipped
+ *
+ * Every frame starts with a 16 byte header, in network byte order:
+ *
+ *   uint32  length    Bytes following this field (12 + payload)
+ *   uint8   type      One of enum frame_type
+ *   uint8   flags     Reserved, 0
+ *   uint16  reserved  0
+ *   uint32  sender    User id of the sender, 0 for the server
+ *   uint32  room      Room the frame belongs to, 0 for the lobby.  A
+ *                     client's messages must name the room it is in
+ *
+ * followed by the payload
+ */
+
+#ifndef ALLISONK_PROTO_H
+#define ALLISONK_PROTO_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "message.h"
+
+/* First byte from a client that wants binary frames */
+#define PROTO_BINARY        '\0'
+
+#define PROTO_LEN_SIZE      4
+#define PROTO_HEADER_LEN    16
+/* Longest frame accepted from a client, not counting the length field */
+#define PROTO_MAX_FRAME     4096
+
+/**
+ * Frame types
+ *
+ * FRAME_HELLO      client: register, payload is the handle
+ * FRAME_WELCOME    server: registered, sender is the client's own id
+ *                  and payload its handle
+ * FRAME_MSG        client: payload to broadcast
+ *                  server: broadcast from sender
+ * FRAME_CMD        client: command without its leading '/'
+ * FRAME_INFO       server: notice, payload is text.  Also replays
+ *                  history from the message log as its text line
+ * FRAME_JOIN       server: sender joined the room, payload is their handle
+ * FRAME_ERROR      server: request refused, payload is the reason
+ * FRAME_PART       server: sender left the room, payload is their handle
+ * FRAME_DIRECT     server: message sent to this client only by sender
+ * FRAME_PING       server: the client has been quiet, anything it sends
+ *                  back in time keeps the connection open
+ * FRAME_PONG       client: answer to a ping, otherwise ignored
+ */
+enum frame_type {
+    FRAME_HELLO = 1,
+    FRAME_WELCOME,
+    FRAME_MSG,
+    FRAME_CMD,
+    FRAME_INFO,
+    FRAME_JOIN,
+    FRAME_ERROR,
+    FRAME_PART,
+    FRAME_DIRECT,
+    FRAME_PING,
+    FRAME_PONG
+};
+
+/**
+ * Represents a decoded frame.  The payload points into the buffer
+ * the frame was decoded from
+ */
+struct frame {
+    unsigned type;
+    uint32_t sender;
+    uint32_t room;
+    const char *payload;
+    size_t len;
+};
+
+/**
+ * Decodes a frame received from a client
+ *
+ * \param body      Frame bytes following the length field
+ * \param len       Value of the length field
+ * \param fr        Filled with the decoded frame
+ * \return          0 on success, -1 if the frame is malformed
+ */
+int proto_decode(const char *body, size_t len, struct frame *fr);
+
+/**
+ * Encodes a frame into a new message.  The caller holds the only
+ * reference
+ *
+ * \param type      Frame type
+ * \param sender    User id of the sender, 0 for the server
+ * \param room      Room of the frame
+ * \param payload   Payload bytes
+ * \param len       Number of payload bytes
+ * \return          New message, NULL on failure
+ */
+struct message *proto_message(unsigned type, uint32_t sender, uint32_t room,
+        const char *payload, size_t len);
+
+#endif
@@ -0,0 +1,1474 @@
+/**
+ * file: reactor.c
+ *
+ * Edge-triggered epoll event loop, or optionally an io_uring
+ * completion loop, that owns the listening socket and every
+ * client connection
+ */
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <netinet/tcp.h>
+
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+
+#include "reactor.h"
+#include "chat.h"
+#include "stats.h"
+#include "uring.h"
+#include "generic/generic_pool.h"
+
+#define MAX_EVENTS          256
+#define READ_CHUNK          65536
+#define REGISTER_TIMEOUT    30000
+#define PING_TIMEOUT        15000
+#define KEEPALIVE_INTVL     5
+#define KEEPALIVE_CNT       3
+/* Seconds of flood control budget a client may save up */
+#define FLOOD_BURST         2
+/* Message copies a reactor queues, over all its clients, before it stops reading */
+#define FANOUT_BUDGET       65536
+#define IOV_BATCH           64
+#define URING_ENTRIES       256
+#define URING_BUFS          (READ_CHUNK / URING_BUF_SIZE)
+#define URING_BUF_SIZE      4096
+#define URING_DRAIN_MS      100
+#define URING_DRAIN_TRIES   10
+#define URING_OP_MASK       7
+#define URING_SEND_CHAIN    32
+#define URING_IOV_BATCH     1024
+
+static char str_register_timeout[] = "registration timed out\n";
+
+/* Connection state for every reactor */
+static struct pool *clients;
+
+/* Sends in flight on io_uring reactors */
+static struct pool *sends;
+
+/** Type definitions **/
+
+/**
+ * What an io_uring completion is for.  Stored in the low bits of
+ * the completion data, above them is the reactor or client_info
+ */
+enum uring_op {
+    URING_ACCEPT = 1,
+    URING_WAKE,
+    URING_RECV,
+    URING_SEND,
+    URING_CANCEL
+};
+
+/**
+ * A gather send handed to io_uring, which reads the header and the
+ * iovecs it points to until the send completes
+ */
+struct uring_send {
+    struct client_info *ci;
+    struct msghdr msg;
+    struct iovec iov[URING_IOV_BATCH];
+};
+
+/**
+ * cfg          Server configuration
+ * id           Index of this reactor and of the user shard it owns
+ * epfd         epoll instance
+ * listen_sock  Listening socket (non-blocking)
+ * wakefd       eventfd other threads signal to wake this reactor
+ * clients      Every live connection, linked through client_info
+ * closing      Connections to tear down once the current batch is handled
+ * timers       Every connection's registration deadline or idle check
+ * resumes      When each throttled connection may be read from again
+ * now          When the current batch of events started (ms)
+ * dirty        Connections with output queued but not yet flushed
+ * dirty_since  When the flush list last went from empty to non-empty (ms)
+ * read_head    Connections with input waiting to be read, served one
+ *              chunk each in turn
+ * read_tail    Last connection on the read list
+ * nreadable    Number of connections on the read list
+ * fanout       Message copies queued since the last wait
+ * ring         io_uring instance, NULL while running on epoll
+ * zombies      Torn down connections waiting on io_uring requests
+ * starved      Connections whose receive ended, to re-arm after the flush
+ * batch        Number of io_uring waits so far
+ * draining     Set while the io_uring loop is winding down
+ * wakeval      Counter read from wakefd by io_uring
+ * rbuf         Receive buffer shared by every connection of the reactor
+ */
+struct reactor {
+    const struct server_config *cfg;
+    unsigned id;
+    int epfd;
+    int listen_sock;
+    int wakefd;
+    struct client_info *clients;
+    struct client_info *closing;
+    struct wheel *timers;
+    struct wheel *resumes;
+    long long now;
+    struct client_info *dirty;
+    long long dirty_since;
+    struct client_info *read_head;
+    struct client_info *read_tail;
+    unsigned long nreadable;
+    unsigned long fanout;
+    struct uring *ring;
+    struct client_info *zombies;
+    struct client_info *starved;
+    unsigned long batch;
+    int draining;
+    uint64_t wakeval;
+    char rbuf[READ_CHUNK];
+};
+
+/** Declarations **/
+
+static struct client_info *reactor_attach(struct reactor *r, int sock,
+        const struct sockaddr_in *addr);
+static void reactor_adopt(struct reactor *r, int sock, struct sockaddr_in *addr);
+static void reactor_accept(struct reactor *r);
+static void reactor_read(struct client_info *ci);
+static void reactor_read_round(struct reactor *r);
+static int reactor_throttle(struct client_info *ci);
+static void reactor_on_resume(struct timer *t, void *param);
+static void reactor_flush(struct client_info *ci);
+static void reactor_flush_dirty(struct reactor *r, long long now);
+static void dirty_unlink(struct reactor *r, struct client_info *ci);
+static void dirty_push(struct reactor *r, struct client_info *ci);
+static void read_unlink(struct reactor *r, struct client_info *ci);
+static void read_append(struct reactor *r, struct client_info *ci);
+static void reactor_reap(struct reactor *r);
+static void client_unlink(struct client_info **head, struct client_info *ci);
+static void client_push(struct client_info **head, struct client_info *ci);
+static void reactor_keepalive(int sock, long idle_ms);
+static void reactor_on_timer(struct timer *t, void *param);
+static void reactor_expire(struct reactor *r, long long now);
+static int reactor_timeout(struct reactor *r, long long now);
+static long long now_ms(void);
+static void reactor_log(struct client_info *ci, const char *msg);
+static uint64_t uring_tag(void *p, enum uring_op op);
+static void uring_arm_recv(struct client_info *ci);
+static void uring_rearm(struct reactor *r);
+static void uring_flush(struct client_info *ci);
+static void uring_bury(struct client_info *ci);
+static void uring_on_accept(struct reactor *r, struct uring_event *ev);
+static void uring_on_wake(struct reactor *r, struct uring_event *ev);
+static void uring_on_recv(struct client_info *ci, struct uring_event *ev);
+static void uring_on_send(struct uring_send *s, struct uring_event *ev);
+static void uring_complete(struct reactor *r, struct uring_event *ev);
+static int uring_busy(struct reactor *r);
+static void uring_quiesce(struct reactor *r);
+static void reactor_run_uring(struct reactor *r, volatile sig_atomic_t *stop);
+
+/** Client list functions **/
+
+static void client_unlink(struct client_info **head, struct client_info *ci)
+{
+    if (ci->prev)
+        ci->prev->next = ci->next;
+    else
+        *head = ci->next;
+
+    if (ci->next)
+        ci->next->prev = ci->prev;
+
+    ci->prev = ci->next = NULL;
+}
+
+static void client_push(struct client_info **head, struct client_info *ci)
+{
+    ci->prev = NULL;
+    ci->next = *head;
+    if (*head)
+        (*head)->prev = ci;
+    *head = ci;
+}
+
+/** Flush list functions **/
+
+static void dirty_unlink(struct reactor *r, struct client_info *ci)
+{
+    if (!ci->dirty)
+        return;
+
+    if (ci->dirty_prev)
+        ci->dirty_prev->dirty_next = ci->dirty_next;
+    else
+        r->dirty = ci->dirty_next;
+
+    if (ci->dirty_next)
+        ci->dirty_next->dirty_prev = ci->dirty_prev;
+
+    ci->dirty_prev = ci->dirty_next = NULL;
+    ci->dirty = 0;
+}
+
+static void dirty_push(struct reactor *r, struct client_info *ci)
+{
+    if (ci->dirty)
+        return;
+
+    if (r->dirty == NULL)
+        r->dirty_since = now_ms();
+
+    ci->dirty_prev = NULL;
+    ci->dirty_next = r->dirty;
+    if (r->dirty)
+        r->dirty->dirty_prev = ci;
+    r->dirty = ci;
+    ci->dirty = 1;
+}
+
+/** Read list functions **/
+
+static void read_unlink(struct reactor *r, struct client_info *ci)
+{
+    if (!ci->readable)
+        return;
+
+    if (ci->read_prev)
+        ci->read_prev->read_next = ci->read_next;
+    else
+        r->read_head = ci->read_next;
+
+    if (ci->read_next)
+        ci->read_next->read_prev = ci->read_prev;
+    else
+        r->read_tail = ci->read_prev;
+
+    ci->read_prev = ci->read_next = NULL;
+    ci->readable = 0;
+    r->nreadable--;
+}
+
+static void read_append(struct reactor *r, struct client_info *ci)
+{
+    if (ci->readable || ci->closing)
+        return;
+
+    ci->read_next = NULL;
+    ci->read_prev = r->read_tail;
+    if (r->read_tail)
+        r->read_tail->read_next = ci;
+    else
+        r->read_head = ci;
+    r->read_tail = ci;
+    ci->readable = 1;
+    r->nreadable++;
+}
+
+/**
+ * Returns the monotonic clock in milliseconds
+ */
+static long long now_ms(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/**
+ * Prints a connection coming or going, only when asked to with -v as
+ * it holds the lock of stdout on the reactor's thread
+ */
+static void reactor_log(struct client_info *ci, const char *msg)
+{
+    if (ci->reactor->cfg->verbose)
+        print_connection(msg, &(ci->caddr));
+}
+
+/**
+ * Has the kernel probe an idle text client, whose user may well be
+ * reading along without typing
+ */
+static void reactor_keepalive(int sock, long idle_ms)
+{
+    int opt;
+
+    opt = 1;
+    setsockopt(sock, SOL_SOCKET, SO_KEEPALIVE, &opt, sizeof(opt));
+    opt = idle_ms >= 1000 ? (int)(idle_ms / 1000) : 1;
+    setsockopt(sock, IPPROTO_TCP, TCP_KEEPIDLE, &opt, sizeof(opt));
+    opt = KEEPALIVE_INTVL;
+    setsockopt(sock, IPPROTO_TCP, TCP_KEEPINTVL, &opt, sizeof(opt));
+    opt = KEEPALIVE_CNT;
+    setsockopt(sock, IPPROTO_TCP, TCP_KEEPCNT, &opt, sizeof(opt));
+}
+
+/**
+ * Handles a connection whose timer fired.  A connection still without
+ * a handle is closed.  Reads never touch the timer, they only note the
+ * time, so a binary client that has been heard from since is simply
+ * checked again later; one that has gone quiet is pinged, and closed
+ * if the ping goes unanswered
+ */
+static void reactor_on_timer(struct timer *t, void *param)
+{
+    struct reactor *r;
+    struct client_info *ci;
+    long long idle;
+
+    r = param;
+    ci = (struct client_info*)((char*)t - offsetof(struct client_info, timer));
+
+    if (ci->state == CLIENT_AWAITING_HANDLE) {
+        send(ci->sock, str_register_timeout, ARR_SIZE(str_register_timeout) - 1,
+                MSG_NOSIGNAL);
+        stats_add(r->id, STAT_TIMEOUTS, 1);
+        reactor_close_client(ci);
+        return;
+    }
+
+    if (ci->pinged != 0 && ci->last_rx < ci->pinged) {
+        reactor_log(ci, "timed out");
+        stats_add(r->id, STAT_TIMEOUTS, 1);
+        reactor_close_client(ci);
+        return;
+    }
+
+    ci->pinged = 0;
+    idle = r->cfg->idle_ms;
+    if (ci->last_rx + idle > r->now) {
+        wheel_add(r->timers, t, (unsigned long)(ci->last_rx + idle));
+        return;
+    }
+
+    ci->pinged = r->now;
+    chat_ping(ci);
+    if (!ci->closing)
+        wheel_add(r->timers, t, (unsigned long)(r->now + PING_TIMEOUT));
+}
+
+/**
+ * Lets a throttled connection be read from again.  Under epoll its
+ * edge has long passed, so it goes straight on the read list; under
+ * io_uring its receive is re-armed once the cancelled one has ended
+ */
+static void reactor_on_resume(struct timer *t, void *param)
+{
+    struct reactor *r;
+    struct client_info *ci;
+
+    r = param;
+    ci = (struct client_info*)((char*)t - offsetof(struct client_info, resume));
+    ci->throttled = 0;
+
+    if (r->ring == NULL) {
+        read_append(r, ci);
+    } else if (!ci->receiving) {
+        ci->receiving = 1;
+        ci->starved_next = r->starved;
+        r->starved = ci;
+    }
+}
+
+/**
+ * Runs every connection timer that has come due
+ */
+static void reactor_expire(struct reactor *r, long long now)
+{
+    r->now = now;
+    wheel_advance(r->timers, (unsigned long)now, reactor_on_timer, r);
+    wheel_advance(r->resumes, (unsigned long)now, reactor_on_resume, r);
+}
+
+/**
+ * Returns how long epoll_wait may sleep before the next timer
+ * or the next flush of coalesced output
+ */
+static int reactor_timeout(struct reactor *r, long long now)
+{
+    long long wait, resume, flush;
+
+    /* connections left on the read list get their turn straight away */
+    if (r->read_head != NULL)
+        return 0;
+
+    wait = wheel_timeout(r->timers, (unsigned long)now);
+    resume = wheel_timeout(r->resumes, (unsigned long)now);
+    if (resume != -1 && (wait == -1 || resume < wait))
+        wait = resume;
+
+    if (r->dirty != NULL) {
+        flush = r->dirty_since + r->cfg->flush_ms - now;
+        if (wait == -1 || flush < wait)
+            wait = flush;
+    }
+
+    if (wait == -1)
+        return -1;
+
+    return wait > 0 ? (int)wait : 0;
+}
+
+/** Reactor functions **/
+
+int reactor_global_init(void)
+{
+    pool_init(&clients, sizeof(struct client_info));
+    pool_init(&sends, sizeof(struct uring_send));
+    return clients && sends ? 0 : -1;
+}
+
+int reactor_init(struct reactor **r, unsigned id, int listen_sock,
+        const struct server_config *cfg)
+{
+    struct reactor *rc;
+    struct epoll_event ev;
+    int err;
+
+    if (r == NULL)
+        return -1;
+
+    rc = calloc(1, sizeof(*rc));
+    if (rc == NULL)
+        return -1;
+
+    rc->cfg = cfg;
+    rc->id = id;
+    rc->listen_sock = listen_sock;
+    rc->now = now_ms();
+    wheel_init(&rc->timers, (unsigned long)rc->now);
+    wheel_init(&rc->resumes, (unsigned long)rc->now);
+    if (rc->timers == NULL || rc->resumes == NULL) {
+        perror("[reactor:wheel_init]");
+        goto free_timers;
+    }
+
+    rc->epfd = epoll_create1(EPOLL_CLOEXEC);
+    if (rc->epfd == -1) {
+        perror("[reactor:epoll_create]");
+        goto free_timers;
+    }
+
+    rc->wakefd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (rc->wakefd == -1) {
+        perror("[reactor:eventfd]");
+        goto close_epoll;
+    }
+
+    /**
+     * The listener is tagged with the reactor itself, the wakeup
+     * eventfd with its descriptor, clients with their client_info */
+    ev.events = EPOLLIN | EPOLLET;
+    ev.data.ptr = rc;
+    err = epoll_ctl(rc->epfd, EPOLL_CTL_ADD, listen_sock, &ev);
+    if (err == -1) {
+        perror("[reactor:epoll_ctl]");
+        goto close_wakefd;
+    }
+
+    ev.events = EPOLLIN | EPOLLET;
+    ev.data.ptr = &rc->wakefd;
+    err = epoll_ctl(rc->epfd, EPOLL_CTL_ADD, rc->wakefd, &ev);
+    if (err == -1) {
+        perror("[reactor:epoll_ctl]");
+        goto close_wakefd;
+    }
+
+    *r = rc;
+    return 0;
+
+close_wakefd:
+    close(rc->wakefd);
+close_epoll:
+    close(rc->epfd);
+free_timers:
+    wheel_destroy(&rc->timers);
+    wheel_destroy(&rc->resumes);
+    free(rc);
+    return -1;
+}
+
+unsigned reactor_id(struct reactor *r)
+{
+    return r->id;
+}
+
+void reactor_wake(struct reactor *r)
+{
+    eventfd_write(r->wakefd, 1);
+}
+
+/**
+ * Writes queued messages until the queue is empty or the socket
+ * would block, gathering up to IOV_BATCH messages per syscall.
+ * Sockets run with TCP_NODELAY so a coalesced write leaves at once;
+ * when a flush takes more than one write the socket is corked so
+ * the kernel packs full segments instead of one per write.
+ * Edge-triggered EPOLLOUT calls back in once a full socket drains
+ */
+static void reactor_flush(struct client_info *ci)
+{
+    struct iovec iov[IOV_BATCH];
+    struct msghdr msg;
+    ssize_t nsent;
+    int corked = 0, opt;
+
+    if (ci->reactor->ring != NULL) {
+        uring_flush(ci);
+        return;
+    }
+
+    dirty_unlink(ci->reactor, ci);
+
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = iov;
+
+    while (!ci->closing && ci->out.count > 0) {
+        msg.msg_iovlen = outq_iov(&ci->out, 0, iov, ARR_SIZE(iov));
+        if (!corked && ci->out.count > msg.msg_iovlen) {
+            opt = 1;
+            setsockopt(ci->sock, IPPROTO_TCP, TCP_CORK, &opt, sizeof(opt));
+            corked = 1;
+        }
+
+        /* sendmsg is writev that can be told not to raise SIGPIPE */
+        nsent = sendmsg(ci->sock, &msg, MSG_NOSIGNAL);
+        if (nsent > 0) {
+            outq_consume(&ci->out, (size_t)nsent, ci->reactor->id);
+        } else if (nsent == -1 && errno == EINTR) {
+            continue;
+        } else {
+            if (nsent == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+                ci->blocked = 1;
+            } else {
+                perror("[reactor:send]");
+                reactor_close_client(ci);
+            }
+            break;
+        }
+    }
+
+    if (corked && !ci->closing) {
+        opt = 0;
+        setsockopt(ci->sock, IPPROTO_TCP, TCP_CORK, &opt, sizeof(opt));
+    }
+}
+
+/**
+ * Flushes every connection on the flush list once the flush
+ * interval has passed
+ */
+static void reactor_flush_dirty(struct reactor *r, long long now)
+{
+    if (r->dirty == NULL || now - r->dirty_since < r->cfg->flush_ms)
+        return;
+
+    while (r->dirty != NULL)
+        reactor_flush(r->dirty);
+}
+
+int reactor_send(struct client_info *ci, struct message *m)
+{
+    const struct server_config *cfg;
+    size_t pinned;
+
+    if (ci->closing)
+        return -1;
+
+    cfg = ci->reactor->cfg;
+
+    if (outq_push(&ci->out, m) == -1) {
+        perror("[reactor:send:malloc]");
+        reactor_close_client(ci);
+        return -1;
+    }
+    ci->reactor->fanout++;
+
+    /**
+     * Bytes an io_uring send has taken are as good as written.  Nothing
+     * else is written until the batch ends, so there only a client
+     * whose sends have made no progress during this batch can be slow */
+    pinned = ci->out.pinned_bytes;
+    if (ci->out.bytes - pinned > cfg->out_high
+            && (ci->reactor->ring == NULL
+                || (ci->blocked && ci->progress != ci->reactor->batch))) {
+        if (cfg->slow == SLOW_DROP_CONNECTION) {
+            reactor_log(ci, "evicted (slow consumer)");
+            stats_add(ci->reactor->id, STAT_EVICTIONS, 1);
+            reactor_close_client(ci);
+            return -1;
+        }
+
+        stats_add(ci->reactor->id, STAT_DROPS,
+                (long)outq_trim(&ci->out, cfg->out_low + pinned));
+    }
+
+    /* a blocked socket is flushed by EPOLLOUT or when its send completes */
+    if (!ci->blocked) {
+        if (ci->out.bytes < cfg->flush_bytes) {
+            dirty_push(ci->reactor, ci);
+        } else if (ci->reactor->ring == NULL) {
+            reactor_flush(ci);
+        } else {
+            /* io_uring submits nothing before the batch ends anyway */
+            dirty_push(ci->reactor, ci);
+            ci->reactor->dirty_since = now_ms() - cfg->flush_ms;
+        }
+    }
+
+    return ci->closing ? -1 : 0;
+}
+
+int reactor_charge(struct client_info *ci)
+{
+    const struct server_config *cfg;
+    long tokens;
+
+    cfg = ci->reactor->cfg;
+    if (cfg->msg_rate == 0)
+        return 0;
+
+    /* a client that has saved up a second's worth has stopped flooding */
+    tokens = bucket_fill(&ci->msgs, cfg->msg_rate, cfg->msg_rate * FLOOD_BURST,
+            ci->reactor->now);
+    if (tokens >= cfg->msg_rate)
+        ci->flooded = 0;
+
+    if (tokens < 1)
+        return -1;
+
+    bucket_take(&ci->msgs, 1);
+    return 0;
+}
+
+void reactor_client_registered(struct client_info *ci)
+{
+    struct reactor *r;
+
+    r = ci->reactor;
+    ci->state = CLIENT_ACTIVE;
+    if (r->cfg->idle_ms == 0) {
+        wheel_del(r->timers, &ci->timer);
+        return;
+    }
+
+    /* only binary clients can answer a ping, text ones get TCP keepalive */
+    if (ci->framing == FRAMING_BINARY) {
+        wheel_add(r->timers, &ci->timer, (unsigned long)(r->now + r->cfg->idle_ms));
+    } else {
+        wheel_del(r->timers, &ci->timer);
+        reactor_keepalive(ci->sock, r->cfg->idle_ms);
+    }
+}
+
+void reactor_close_client(struct client_info *ci)
+{
+    if (ci == NULL || ci->closing)
+        return;
+
+    ci->closing = 1;
+    wheel_del(ci->reactor->timers, &ci->timer);
+    wheel_del(ci->reactor->resumes, &ci->resume);
+    read_unlink(ci->reactor, ci);
+    dirty_unlink(ci->reactor, ci);
+    client_unlink(&ci->reactor->clients, ci);
+    client_push(&ci->reactor->closing, ci);
+}
+
+/**
+ * Sets up a connection, awaiting its handle, and starts reading from
+ * it.  The socket is closed on failure
+ *
+ * \return          The connection, NULL on failure
+ */
+static struct client_info *reactor_attach(struct reactor *r, int sock,
+        const struct sockaddr_in *addr)
+{
+    struct client_info *ci;
+    struct epoll_event ev;
+    int err, opt;
+
+    ci = pool_alloc(clients);
+    if (ci == NULL) {
+        perror("[reactor:accept:pool_alloc]");
+        close(sock);
+        return NULL;
+    }
+    memset(ci, 0, sizeof(*ci));
+
+    /* output is coalesced in userspace, so never let Nagle hold it back */
+    opt = 1;
+    setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, &opt, sizeof(opt));
+
+    ci->sock = sock;
+    ci->caddr = *addr;
+    ci->reactor = r;
+    ci->state = CLIENT_AWAITING_HANDLE;
+    ci->last_rx = r->now;
+    bucket_init(&ci->msgs, r->cfg->msg_rate * FLOOD_BURST, r->now);
+    bucket_init(&ci->bytes, r->cfg->byte_rate * FLOOD_BURST, r->now);
+
+    if (r->ring != NULL) {
+        uring_arm_recv(ci);
+    } else {
+        ev.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+        ev.data.ptr = ci;
+        err = epoll_ctl(r->epfd, EPOLL_CTL_ADD, sock, &ev);
+        if (err == -1) {
+            perror("[reactor:epoll_ctl]");
+            close(sock);
+            pool_free(clients, ci);
+            return NULL;
+        }
+    }
+
+    client_push(&r->clients, ci);
+    wheel_add(r->timers, &ci->timer, (unsigned long)(r->now + REGISTER_TIMEOUT));
+    stats_add(r->id, STAT_ACTIVE, 1);
+    return ci;
+}
+
+/**
+ * Sets up a freshly accepted connection and prompts it for a handle
+ */
+static void reactor_adopt(struct reactor *r, int sock, struct sockaddr_in *addr)
+{
+    struct client_info *ci;
+
+    ci = reactor_attach(r, sock, addr);
+    if (ci == NULL)
+        return;
+
+    stats_add(r->id, STAT_ACCEPTS, 1);
+    reactor_log(ci, "connected");
+    chat_connect(ci);
+}
+
+struct client_info *reactor_restore(struct reactor *r, int sock,
+        const struct sockaddr_in *addr, enum client_framing framing,
+        const char *out, size_t outlen)
+{
+    struct client_info *ci;
+    struct message *m;
+
+    ci = reactor_attach(r, sock, addr);
+    if (ci == NULL)
+        return NULL;
+
+    ci->framing = framing;
+    if (outlen == 0)
+        return ci;
+
+    /* written once the reactor runs, whatever the backend */
+    m = message_new(out, outlen);
+    if (m == NULL || outq_push(&ci->out, m) == -1) {
+        perror("[reactor:restore:malloc]");
+        reactor_close_client(ci);
+    } else {
+        dirty_push(r, ci);
+    }
+    message_unref(m);
+
+    return ci;
+}
+
+int reactor_listener(struct reactor *r)
+{
+    return r->listen_sock;
+}
+
+struct client_info *reactor_clients(struct reactor *r)
+{
+    return r->clients;
+}
+
+void reactor_release(struct reactor *r)
+{
+    struct client_info *ci;
+
+    while ((ci = r->clients) != NULL || (ci = r->closing) != NULL) {
+        client_unlink(ci->closing ? &r->closing : &r->clients, ci);
+        wheel_del(r->timers, &ci->timer);
+        wheel_del(r->resumes, &ci->resume);
+        read_unlink(r, ci);
+        dirty_unlink(r, ci);
+        stats_add(r->id, STAT_ACTIVE, -1);
+
+        outq_clear(&ci->out);
+        framer_clear(&ci->in);
+        close(ci->sock);
+        pool_free(clients, ci);
+    }
+}
+
+/**
+ * Accepts every pending connection on the listening socket.
+ * With edge-triggered notifications we must drain until EAGAIN
+ */
+static void reactor_accept(struct reactor *r)
+{
+    struct sockaddr_in addr;
+    socklen_t sz;
+    int sock;
+
+    for (;;) {
+        sz = sizeof(addr);
+        sock = accept4(r->listen_sock, (struct sockaddr*)&addr, &sz,
+                SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (sock == -1) {
+            if (errno == EINTR || errno == ECONNABORTED)
+                continue;
+
+            if (errno != EAGAIN && errno != EWOULDBLOCK)
+                perror("[reactor:accept]");
+            return;
+        }
+
+        reactor_adopt(r, sock, &addr);
+    }
+}
+
+/**
+ * Checks a connection against its flood control budget.  One that has
+ * spent it is not read from until it has earned some back, so its
+ * input waits in the socket and TCP slows the sender down
+ *
+ * \return          1 if the connection is throttled, 0 if it may be read
+ */
+static int reactor_throttle(struct client_info *ci)
+{
+    const struct server_config *cfg;
+    struct reactor *r;
+    long wait = 0, w;
+
+    if (ci->throttled)
+        return 1;
+
+    r = ci->reactor;
+    cfg = r->cfg;
+    if (cfg->msg_rate > 0
+            && bucket_fill(&ci->msgs, cfg->msg_rate, cfg->msg_rate * FLOOD_BURST, r->now) < 1)
+        wait = bucket_wait(&ci->msgs, cfg->msg_rate);
+
+    if (cfg->byte_rate > 0
+            && bucket_fill(&ci->bytes, cfg->byte_rate, cfg->byte_rate * FLOOD_BURST, r->now) < 1) {
+        w = bucket_wait(&ci->bytes, cfg->byte_rate);
+        wait = w > wait ? w : wait;
+    }
+
+    if (wait == 0)
+        return 0;
+
+    ci->throttled = 1;
+    stats_add(r->id, STAT_THROTTLES, 1);
+    wheel_add(r->resumes, &ci->resume, (unsigned long)(r->now + wait));
+
+    /* buffers the receive fills before the cancel lands are still handled */
+    if (r->ring != NULL && ci->receiving
+            && uring_prep_cancel(r->ring, uring_tag(ci, URING_RECV),
+                uring_tag(r, URING_CANCEL)) == -1)
+        fprintf(stderr, "[reactor:uring_prep_cancel]: submission queue full\n");
+
+    return 1;
+}
+
+/**
+ * Reads one chunk, no larger than the connection's byte budget, and
+ * hands it to the chat.  A connection that may have more waiting goes
+ * back on the end of the read list
+ */
+static void reactor_read(struct client_info *ci)
+{
+    const struct server_config *cfg;
+    struct reactor *r;
+    size_t len = READ_CHUNK;
+    ssize_t nrecv;
+    long avail;
+
+    if (reactor_throttle(ci))
+        return;
+
+    r = ci->reactor;
+    cfg = r->cfg;
+    if (cfg->byte_rate > 0) {
+        avail = bucket_fill(&ci->bytes, cfg->byte_rate, cfg->byte_rate * FLOOD_BURST, r->now);
+        if ((size_t)avail < len)
+            len = (size_t)avail;
+    }
+
+    nrecv = recv(ci->sock, r->rbuf, len, 0);
+    if (nrecv > 0) {
+        stats_add(r->id, STAT_BYTES_IN, nrecv);
+        ci->last_rx = r->now;
+        if (cfg->byte_rate > 0)
+            bucket_take(&ci->bytes, (long)nrecv);
+        chat_receive(ci, r->rbuf, (size_t)nrecv);
+
+        /**
+         * A short read drained the socket and new data raises a new
+         * edge.  After a hangup keep reading until recv sees it */
+        if ((size_t)nrecv == len || ci->hangup)
+            read_append(r, ci);
+    } else if (nrecv == 0) {
+        reactor_close_client(ci);
+    } else if (errno == EINTR) {
+        read_append(r, ci);
+    } else if (errno != EAGAIN && errno != EWOULDBLOCK) {
+        perror("[reactor:recv]");
+        reactor_close_client(ci);
+    }
+}
+
+/**
+ * Gives every connection on the read list at most one read, in turn,
+ * so a client that keeps its socket full cannot starve the rest.  The
+ * round covers those on the list when it starts; connections that go
+ * back on it wait for the next.  Once the reactor has queued its
+ * budget of message copies, across all its clients, the others wait
+ * for the next round, after what is queued has been flushed
+ */
+static void reactor_read_round(struct reactor *r)
+{
+    struct client_info *ci;
+    unsigned long n;
+
+    n = r->nreadable;
+    while (n-- > 0 && (ci = r->read_head) != NULL && r->fanout < FANOUT_BUDGET) {
+        read_unlink(r, ci);
+        reactor_read(ci);
+    }
+}
+
+/**
+ * Tears down every connection closed during the last batch of events
+ */
+static void reactor_reap(struct reactor *r)
+{
+    struct client_info *ci;
+
+    while ((ci = r->closing) != NULL) {
+        client_unlink(&r->closing, ci);
+
+        chat_disconnect(ci);
+        stats_add(r->id, STAT_ACTIVE, -1);
+        reactor_log(ci, "disconnected");
+
+        if (r->ring != NULL) {
+            uring_bury(ci);
+            continue;
+        }
+
+        outq_clear(&ci->out);
+        framer_clear(&ci->in);
+        close(ci->sock);
+        pool_free(clients, ci);
+    }
+}
+
+void reactor_run(struct reactor *r, volatile sig_atomic_t *stop)
+{
+    struct epoll_event events[MAX_EVENTS];
+    struct client_info *ci;
+    int nset, i;
+
+    /* the ring belongs to the thread that submits to it */
+    if (r->cfg->io == IO_URING) {
+        if (uring_init(&r->ring, URING_ENTRIES, URING_BUFS, URING_BUF_SIZE) == 0) {
+            reactor_run_uring(r, stop);
+            return;
+        }
+
+        fprintf(stderr, "[reactor:uring_init]: io_uring unavailable, using epoll\n");
+    }
+
+    while (!*stop) {
+        nset = epoll_wait(r->epfd, events, ARR_SIZE(events),
+                reactor_timeout(r, now_ms()));
+        if (nset == -1) {
+            if (errno != EINTR)
+                perror("[reactor:epoll_wait]");
+            continue;
+        }
+
+        r->now = now_ms();
+        r->fanout = 0;
+        for (i = 0; i < nset; i++) {
+            if (events[i].data.ptr == r) {
+                reactor_accept(r);
+                continue;
+            }
+
+            if (events[i].data.ptr == &r->wakefd) {
+                eventfd_t count;
+
+                eventfd_read(r->wakefd, &count);
+                chat_deliver(r->id);
+                continue;
+            }
+
+            ci = events[i].data.ptr;
+            if (ci->closing)
+                continue;
+
+            if (events[i].events & EPOLLOUT) {
+                ci->blocked = 0;
+                reactor_flush(ci);
+            }
+
+            /* whatever is left is read first, then recv reports the end */
+            if (events[i].events & (EPOLLRDHUP | EPOLLHUP | EPOLLERR))
+                ci->hangup = 1;
+
+            if (events[i].events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR))
+                read_append(r, ci);
+        }
+
+        reactor_read_round(r);
+        reactor_expire(r, now_ms());
+        reactor_flush_dirty(r, now_ms());
+        reactor_reap(r);
+    }
+}
+
+/** io_uring functions **/
+
+static uint64_t uring_tag(void *p, enum uring_op op)
+{
+    return (uint64_t)(uintptr_t)p | (uint64_t)op;
+}
+
+/**
+ * Arms a multishot receive, which keeps completing into the
+ * reactor's provided buffers until the connection ends
+ */
+static void uring_arm_recv(struct client_info *ci)
+{
+    if (uring_prep_recv(ci->reactor->ring, ci->sock, uring_tag(ci, URING_RECV)) == -1) {
+        fprintf(stderr, "[reactor:uring_prep_recv]: submission queue full\n");
+        reactor_close_client(ci);
+        return;
+    }
+
+    ci->inflight++;
+    ci->receiving = 1;
+}
+
+/**
+ * Re-arms the receives that ended during the batch.  They are queued
+ * behind the batch's sends, so a full receive ring cannot push those
+ * sends' completions to the back of the next batch
+ */
+static void uring_rearm(struct reactor *r)
+{
+    struct client_info *ci;
+
+    while ((ci = r->starved) != NULL) {
+        r->starved = ci->starved_next;
+        ci->starved_next = NULL;
+        if (ci->closing)
+            continue;
+
+        if (ci->throttled)
+            ci->receiving = 0;
+        else
+            uring_arm_recv(ci);
+    }
+}
+
+/**
+ * Queues a chain of up to URING_SEND_CHAIN gather sends, each of up
+ * to URING_IOV_BATCH messages.  The sends of one connection are
+ * linked so the kernel runs them in order, and the messages stay
+ * pinned in the queue until the chain completes; whatever was queued
+ * meanwhile goes out as the next chain.  Chains of different
+ * connections are not linked to each other, which would serialize
+ * unrelated sockets, but all of them are submitted by the next wait
+ * in one system call
+ */
+static void uring_flush(struct client_info *ci)
+{
+    struct uring_send *s;
+    size_t pinned, nchain, i, n;
+
+    dirty_unlink(ci->reactor, ci);
+    if (ci->closing || ci->blocked || ci->out.count == 0)
+        return;
+
+    nchain = (ci->out.count + URING_IOV_BATCH - 1) / URING_IOV_BATCH;
+    if (nchain > URING_SEND_CHAIN)
+        nchain = URING_SEND_CHAIN;
+
+    /* a chain split across two submissions would no longer be ordered */
+    if (uring_reserve(ci->reactor->ring, (unsigned)nchain) == -1) {
+        perror("[reactor:uring_reserve]");
+        reactor_close_client(ci);
+        return;
+    }
+
+    for (i = 0, pinned = 0; i < nchain; i++) {
+        s = pool_alloc(sends);
+        if (s == NULL) {
+            perror("[reactor:send:pool_alloc]");
+            break;
+        }
+
+        memset(&s->msg, 0, sizeof(s->msg));
+        s->ci = ci;
+        s->msg.msg_iov = s->iov;
+        s->msg.msg_iovlen = outq_iov(&ci->out, pinned, s->iov, ARR_SIZE(s->iov));
+
+        if (uring_prep_sendmsg(ci->reactor->ring, ci->sock, &s->msg,
+                    i + 1 < nchain, uring_tag(s, URING_SEND)) == -1) {
+            fprintf(stderr, "[reactor:uring_prep_sendmsg]: submission queue full\n");
+            pool_free(sends, s);
+            break;
+        }
+
+        for (n = 0; n < s->msg.msg_iovlen; n++)
+            ci->out.pinned_bytes += s->iov[n].iov_len;
+        pinned += s->msg.msg_iovlen;
+        ci->out.pinned = pinned;
+        ci->sending++;
+        ci->inflight++;
+    }
+
+    /* a chain cut short leaves its last send linked to whatever follows */
+    if (i < nchain)
+        reactor_close_client(ci);
+
+    ci->blocked = ci->sending > 0;
+    ci->progress = ci->reactor->batch;
+}
+
+/**
+ * Finishes tearing down a reaped connection once io_uring no longer
+ * refers to it.  Shutting the socket down completes its outstanding
+ * receive and send
+ */
+static void uring_bury(struct client_info *ci)
+{
+    struct reactor *r;
+
+    r = ci->reactor;
+    if (ci->state != CLIENT_CLOSED) {
+        ci->state = CLIENT_CLOSED;
+        if (ci->inflight > 0) {
+            shutdown(ci->sock, SHUT_RDWR);
+            client_push(&r->zombies, ci);
+            return;
+        }
+    } else {
+        if (ci->inflight > 0)
+            return;
+        client_unlink(&r->zombies, ci);
+    }
+
+    outq_clear(&ci->out);
+    framer_clear(&ci->in);
+    close(ci->sock);
+    pool_free(clients, ci);
+}
+
+static void uring_on_accept(struct reactor *r, struct uring_event *ev)
+{
+    struct sockaddr_in addr;
+    socklen_t sz;
+
+    if (ev->res >= 0) {
+        sz = sizeof(addr);
+        if (getpeername(ev->res, (struct sockaddr*)&addr, &sz) == -1) {
+            perror("[reactor:getpeername]");
+            close(ev->res);
+        } else {
+            reactor_adopt(r, ev->res, &addr);
+        }
+    } else if (ev->res != -ECONNABORTED && ev->res != -ECANCELED) {
+        errno = -ev->res;
+        perror("[reactor:accept]");
+    }
+
+    if (!ev->more && !r->draining
+            && uring_prep_accept(r->ring, r->listen_sock, uring_tag(r, URING_ACCEPT)) == -1)
+        fprintf(stderr, "[reactor:uring_prep_accept]: submission queue full\n");
+}
+
+static void uring_on_wake(struct reactor *r, struct uring_event *ev)
+{
+    if (ev->res == -ECANCELED || r->draining)
+        return;
+
+    chat_deliver(r->id);
+
+    if (uring_prep_read(r->ring, r->wakefd, &r->wakeval, sizeof(r->wakeval),
+                uring_tag(r, URING_WAKE)) == -1)
+        fprintf(stderr, "[reactor:uring_prep_read]: submission queue full\n");
+}
+
+/**
+ * Hands received bytes to the chat straight from the provided
+ * buffer, then gives the buffer back to the kernel
+ */
+static void uring_on_recv(struct client_info *ci, struct uring_event *ev)
+{
+    struct reactor *r;
+
+    r = ci->reactor;
+    if (!ev->more)
+        ci->inflight--;
+
+    if (ev->buffered) {
+        if (ev->res > 0 && !ci->closing) {
+            stats_add(r->id, STAT_BYTES_IN, ev->res);
+            ci->last_rx = r->now;
+            if (r->cfg->byte_rate > 0)
+                bucket_take(&ci->bytes, ev->res);
+            chat_receive(ci, uring_buffer(r->ring, ev->bid), (size_t)ev->res);
+            if (!ci->closing)
+                reactor_throttle(ci);
+        }
+        uring_recycle(r->ring, ev->bid);
+    }
+
+    if (ci->state == CLIENT_CLOSED) {
+        uring_bury(ci);
+        return;
+    }
+
+    if (ci->closing)
+        return;
+
+    if (ev->res == 0) {
+        reactor_close_client(ci);
+    } else if (ev->res < 0 && ev->res != -ENOBUFS && ev->res != -ECANCELED) {
+        errno = -ev->res;
+        perror("[reactor:recv]");
+        reactor_close_client(ci);
+    } else if (!ev->more && ci->throttled) {
+        /* cancelled for flood control, resuming re-arms it */
+        ci->receiving = 0;
+    } else if (!ev->more) {
+        /* out of buffers, or the kernel ended the multishot receive */
+        ci->starved_next = r->starved;
+        r->starved = ci;
+    }
+}
+
+/**
+ * Releases what a completed send wrote.  Once the whole chain has
+ * completed the connection can be flushed again
+ */
+static void uring_on_send(struct uring_send *s, struct uring_event *ev)
+{
+    struct client_info *ci;
+
+    ci = s->ci;
+    pool_free(sends, s);
+    ci->sending--;
+    ci->inflight--;
+    ci->progress = ci->reactor->batch;
+
+    if (ci->state == CLIENT_CLOSED) {
+        uring_bury(ci);
+        return;
+    }
+
+    if (ci->closing)
+        return;
+
+    if (ev->res > 0) {
+        outq_consume(&ci->out, (size_t)ev->res, ci->reactor->id);
+    } else if (ev->res < 0 && ev->res != -ECANCELED) {
+        errno = -ev->res;
+        perror("[reactor:send]");
+        reactor_close_client(ci);
+        return;
+    }
+
+    /* what was queued meanwhile goes out with the rest of the batch */
+    if (ci->sending == 0) {
+        ci->out.pinned = 0;
+        ci->out.pinned_bytes = 0;
+        ci->blocked = 0;
+        if (ci->out.count > 0)
+            dirty_push(ci->reactor, ci);
+    }
+}
+
+static void uring_complete(struct reactor *r, struct uring_event *ev)
+{
+    void *p;
+
+    p = (void*)(uintptr_t)(ev->data & ~(uint64_t)URING_OP_MASK);
+    switch ((enum uring_op)(ev->data & URING_OP_MASK)) {
+        case URING_ACCEPT:
+            uring_on_accept(r, ev);
+            break;
+        case URING_WAKE:
+            uring_on_wake(r, ev);
+            break;
+        case URING_RECV:
+            uring_on_recv(p, ev);
+            break;
+        case URING_SEND:
+            uring_on_send(p, ev);
+            break;
+        case URING_CANCEL:
+        default:
+            break;
+    }
+}
+
+/**
+ * Tells whether io_uring still refers to any connection
+ */
+static int uring_busy(struct reactor *r)
+{
+    struct client_info *ci;
+
+    if (r->zombies != NULL)
+        return 1;
+
+    for (ci = r->clients; ci != NULL; ci = ci->next) {
+        if (ci->inflight > 0)
+            return 1;
+    }
+
+    return 0;
+}
+
+/**
+ * Cancels every request and waits a bounded time for io_uring to let
+ * go of the connections before destroying the ring.  Unlike a close,
+ * a cancel leaves the sockets working, so the connections stay open
+ * for the reactor to run again, to be closed by reactor_destroy, or
+ * to be handed to another server.  What the receives took in before
+ * they ended has been handed to the chat, and what the sends had not
+ * written is still queued
+ */
+static void uring_quiesce(struct reactor *r)
+{
+    struct uring_event ev;
+    struct client_info *ci;
+    int i;
+
+    r->draining = 1;
+    uring_prep_cancel_all(r->ring, uring_tag(r, URING_CANCEL));
+    for (i = 0; i < URING_DRAIN_TRIES && uring_busy(r); i++) {
+        if (uring_wait(r->ring, URING_DRAIN_MS) == -1)
+            break;
+        r->now = now_ms();
+
+        while (uring_next(r->ring, &ev))
+            uring_complete(r, &ev);
+        reactor_reap(r);
+    }
+
+    /* closing the ring abandons whatever is still outstanding */
+    uring_destroy(&r->ring);
+    while ((ci = r->starved) != NULL) {
+        r->starved = ci->starved_next;
+        ci->starved_next = NULL;
+    }
+    for (ci = r->clients; ci != NULL; ci = ci->next) {
+        ci->inflight = 0;
+        ci->sending = 0;
+        ci->receiving = 0;
+        ci->blocked = 0;
+        ci->out.pinned = 0;
+        ci->out.pinned_bytes = 0;
+    }
+    while ((ci = r->zombies) != NULL) {
+        ci->inflight = 0;
+        ci->sending = 0;
+        uring_bury(ci);
+    }
+    r->draining = 0;
+}
+
+/**
+ * The io_uring counterpart of the epoll loop.  Accepts and receives
+ * stay armed as multishot requests, so the only system call per
+ * iteration is the wait, which also submits every send queued
+ * during the previous batch.  Sends complete as they are submitted
+ * while receives complete later, so a batch starts with the sends
+ * and a connection still blocked after them really is backed up.
+ * The provided buffers hold READ_CHUNK bytes, so like one read on
+ * epoll a batch takes in at most that much before it is flushed
+ */
+static void reactor_run_uring(struct reactor *r, volatile sig_atomic_t *stop)
+{
+    struct uring_event ev;
+    struct client_info *ci, *next;
+
+    if (uring_prep_accept(r->ring, r->listen_sock, uring_tag(r, URING_ACCEPT)) == -1
+            || uring_prep_read(r->ring, r->wakefd, &r->wakeval, sizeof(r->wakeval),
+                uring_tag(r, URING_WAKE)) == -1) {
+        fprintf(stderr, "[reactor:uring_prep]: submission queue full\n");
+        uring_destroy(&r->ring);
+        return;
+    }
+
+    /**
+     * Connections taken over from another server, or kept from an
+     * earlier run, start receiving like freshly accepted ones.  A
+     * throttled one is armed when it resumes */
+    for (ci = r->clients; ci != NULL; ci = next) {
+        next = ci->next;
+        if (ci->out.count > 0)
+            dirty_push(r, ci);
+        if (!ci->throttled)
+            uring_arm_recv(ci);
+    }
+
+    while (!*stop) {
+        if (uring_wait(r->ring, reactor_timeout(r, now_ms())) == -1) {
+            perror("[reactor:io_uring_enter]");
+            break;
+        }
+        r->batch++;
+        r->now = now_ms();
+        r->fanout = 0;
+
+        while (uring_next(r->ring, &ev))
+            uring_complete(r, &ev);
+
+        reactor_expire(r, now_ms());
+        reactor_flush_dirty(r, now_ms());
+        uring_rearm(r);
+        reactor_reap(r);
+    }
+
+    uring_quiesce(r);
+}
+
+void reactor_destroy(struct reactor **r)
+{
+    struct reactor *rc;
+
+    if (r == NULL || *r == NULL)
+        return;
+
+    rc = *r;
+    while (rc->clients)
+        reactor_close_client(rc->clients);
+    reactor_reap(rc);
+
+    close(rc->wakefd);
+    close(rc->listen_sock);
+    close(rc->epfd);
+    wheel_destroy(&rc->timers);
+    wheel_destroy(&rc->resumes);
+    free(rc);
+    *r = NULL;
+}
+
+void reactor_global_destroy(void)
+{
+    pool_destroy(&sends);
+    pool_destroy(&clients);
+}
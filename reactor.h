@@ -0,0 +1,166 @@
+/**
+ * file: reactor.h
+ *
+ * Edge-triggered epoll event loop, or optionally an io_uring
+ * completion loop, that owns the listening socket and every
+ * client connection
+ */
+
+#ifndef ALLISONK_REACTOR_H
+#define ALLISONK_REACTOR_H
+
+#include <signal.h>
+
+#include "message.h"
+#include "server.h"
+
+/**
+ * Represents an event loop
+ */
+struct reactor;
+
+/**
+ * Global setup shared by every reactor
+ *
+ * \return              0 on success, -1 on failure
+ */
+int reactor_global_init(void);
+
+/**
+ * Initializes a reactor. Will allocate a reactor
+ * and store it in the dereferenced parameter
+ *
+ * \param r             Reactor to initialize
+ * \param id            Index of the reactor (and of the user shard it owns)
+ * \param listen_sock   Listening socket to accept clients on.  The
+ *                      reactor takes ownership of the socket
+ * \param cfg           Server configuration, must outlive the reactor
+ * \return              0 on success, -1 on failure
+ */
+int reactor_init(struct reactor **r, unsigned id, int listen_sock,
+        const struct server_config *cfg);
+
+/**
+ * Returns the index of a reactor
+ *
+ * \param r         Reactor to query
+ */
+unsigned reactor_id(struct reactor *r);
+
+/**
+ * Runs the event loop until stop is set.  With the io_uring backend
+ * configured the ring is created here, on the thread that uses it,
+ * and the epoll loop runs instead if that fails.  Connections stay
+ * open when it returns, and it may be run again
+ *
+ * \param r         Reactor to run
+ * \param stop      Flag checked after every wakeup
+ */
+void reactor_run(struct reactor *r, volatile sig_atomic_t *stop);
+
+/**
+ * Wakes a reactor from another thread.  The reactor re-checks
+ * its stop flag and delivers messages queued for its shard
+ *
+ * \param r         Reactor to wake
+ */
+void reactor_wake(struct reactor *r);
+
+/**
+ * Queues a message to be written to a client.  Queued messages are
+ * coalesced and written with one gather write per flush, at the end
+ * of the current batch of events (or after the configured flush
+ * interval) unless flush_bytes are queued first.  A client whose
+ * queue passes the high watermark is handled according to the
+ * configured slow consumer policy
+ *
+ * \param ci        Connection to write to
+ * \param m         Message to write.  The queue takes its own reference
+ * \return          0 on success, -1 if the connection is being closed
+ */
+int reactor_send(struct client_info *ci, struct message *m);
+
+/**
+ * Charges a message or command to a client's flood control budget.
+ * Reading stops while the budget is spent, but whatever was already
+ * read can still go over it.  Clears the client's flooded flag once
+ * it has a second of budget saved up
+ *
+ * \param ci        Connection the message arrived on
+ * \return          0 if it may be handled, -1 if it should be dropped
+ */
+int reactor_charge(struct client_info *ci);
+
+/**
+ * Moves a connection from CLIENT_AWAITING_HANDLE to CLIENT_ACTIVE,
+ * replacing its registration deadline with an idle check
+ *
+ * \param ci        Connection that registered
+ */
+void reactor_client_registered(struct client_info *ci);
+
+/**
+ * Takes over a connection another server handed over, without
+ * prompting it.  Must be called before the reactor runs
+ *
+ * \param r         Reactor to own the connection
+ * \param sock      Connected socket, owned by the reactor from now on
+ * \param addr      Address of the peer
+ * \param framing   Protocol the client was speaking
+ * \param out       Output the other server had not written yet
+ * \param outlen    Number of bytes in out
+ * \return          The connection, awaiting its handle until the chat
+ *                  restores its user, NULL on failure
+ */
+struct client_info *reactor_restore(struct reactor *r, int sock,
+        const struct sockaddr_in *addr, enum client_framing framing,
+        const char *out, size_t outlen);
+
+/**
+ * Returns the socket a reactor accepts clients on
+ *
+ * \param r         Reactor to query
+ */
+int reactor_listener(struct reactor *r);
+
+/**
+ * Returns the first of a reactor's open connections, the rest are
+ * linked through next.  Only while the reactor is not running
+ *
+ * \param r         Reactor to query
+ * \return          First connection, NULL if there are none
+ */
+struct client_info *reactor_clients(struct reactor *r);
+
+/**
+ * Frees every connection without telling the chat or writing to the
+ * socket, once another server has taken them over.  Only while the
+ * reactor is not running
+ *
+ * \param r         Reactor to empty
+ */
+void reactor_release(struct reactor *r);
+
+/**
+ * Marks a client connection for teardown.  The connection is
+ * closed and freed once the current event has been handled
+ *
+ * \param ci        Connection to close
+ */
+void reactor_close_client(struct client_info *ci);
+
+/**
+ * Closes every client connection and deallocates the reactor.
+ * Sets dereference parameter to NULL
+ *
+ * \param r         Reactor to destroy
+ */
+void reactor_destroy(struct reactor **r);
+
+/**
+ * Global cleanup shared by every reactor.  Every reactor must
+ * have been destroyed
+ */
+void reactor_global_destroy(void);
+
+#endif
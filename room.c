@@ -0,0 +1,735 @@
+/**
+ * file: room.c
+ *
+ * Rooms users chat in.  Room names are registered once for every
+ * shard, but each shard keeps its own index of the members it owns,
+ * so a message to a room is only fanned out by the shards that have
+ * members in it, and by each of them only to those members.
+ *
+ * A room's history is a ring written under a lock by whichever shard
+ * a message is said in.  Readers take no lock: each entry carries the
+ * sequence number of the message it holds, checked before and after
+ * the message is loaded, and replaced messages are only released once
+ * no reader can still be loading them.
+ *
+ * Every room also keeps a roster of the handles in it, added to and
+ * removed from as members come and go, so /who never walks the users.
+ * Pages of the roster are serialized the first time they are asked
+ * for and kept until a member joins or leaves
+ */
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "proto.h"
+#include "room.h"
+#include "stats.h"
+#include "generic/generic_epoch.h"
+#include "generic/generic_hash.h"
+#include "generic/generic_slotmap.h"
+
+#define ROOM_SLOT_BITS  10
+#define MAX_ROOMS       (1U << ROOM_SLOT_BITS)
+#define ROOM_SLOT_MASK  (MAX_ROOMS - 1)
+/* Lets room_alloc pick the slot */
+#define ROOM_ANY        UINT32_MAX
+/* "name (members)\n" */
+#define ROOM_LINE_LEN   (ROOM_NAME_LEN + 16)
+/* "name (members), page n of m\n" */
+#define ROOM_WHO_LEN    (ROOM_NAME_LEN + 64)
+
+/** Type definitions **/
+
+/**
+ * Columns of a shard's index of a room
+ *
+ * MEMBER_CI     Connection of the member (struct client_info *)
+ * MEMBER_ROSTER Id of the member in the room's roster (unsigned long)
+ */
+enum member_column {
+    MEMBER_CI,
+    MEMBER_ROSTER,
+    MEMBER_COLUMNS
+};
+
+/**
+ * Columns of a room's roster
+ *
+ * ROSTER_HANDLE Handle of the member (char[ROOM_HANDLE_LEN])
+ */
+enum roster_column {
+    ROSTER_HANDLE,
+    ROSTER_COLUMNS
+};
+
+/**
+ * A serialized page of a roster
+ *
+ * version   Version of the roster the page was built from, 0 if never
+ * text      Page for text clients
+ * frame     Page for binary clients
+ */
+struct roster_page {
+    unsigned long version;
+    struct message *text;
+    struct message *frame;
+};
+
+/**
+ * A remembered message
+ *
+ * seq       Sequence number of the message plus one, 0 while the
+ *           entry is being written
+ * text      Message for text clients
+ * frame     Message for binary clients, NULL if there was none
+ */
+struct room_entry {
+    atomic_ulong seq;
+    _Atomic(struct message *) text;
+    _Atomic(struct message *) frame;
+};
+
+/**
+ * A slot of the room table.  Everything but id, local, the history
+ * and the roster is protected by mtx_rooms
+ *
+ * name      Name of the room, empty while the slot is free
+ * id        Slot in the low ROOM_SLOT_BITS, generation above them.  The
+ *           generation moves on whenever the room goes away, so
+ *           messages still queued for it are not delivered to a new
+ *           room in the same slot
+ * gen       Generation of the slot
+ * members   Members across every shard
+ * local     Members owned by each shard
+ * mtx_history Serializes writers of the history, and the room going away
+ * head      Sequence number of the next message recorded
+ * history   Last ROOM_HISTORY messages, by sequence number
+ * mtx_roster Protects the roster and its pages, and the room going away
+ * roster    Handles of the members across every shard, NULL until the
+ *           slot is first joined
+ * version   Moves on whenever a member joins or leaves
+ * pages     Pages of the roster built so far, by page number
+ * npages    Number of entries in pages
+ */
+struct room {
+    char name[ROOM_NAME_LEN];
+    atomic_uint id;
+    unsigned gen;
+    unsigned members;
+    atomic_uint *local;
+    pthread_mutex_t mtx_history;
+    atomic_ulong head;
+    struct room_entry history[ROOM_HISTORY];
+    pthread_mutex_t mtx_roster;
+    struct slotmap *roster;
+    unsigned long version;
+    struct roster_page *pages;
+    size_t npages;
+};
+
+/** Declarations **/
+
+static struct room *room_alloc(const char *name, uint32_t want);
+static int room_enter(unsigned shard, const char *name, uint32_t want,
+        const char *handle, struct client_info *ci, uint32_t *room,
+        unsigned long *member);
+static void room_release(unsigned shard, uint32_t room);
+static void room_forget(struct room *r, unsigned shard);
+static void history_unref(void *p);
+static unsigned long roster_add(unsigned shard, struct room *r,
+        const char *handle);
+static void roster_remove(unsigned shard, struct room *r, unsigned long id);
+static void roster_drop_pages(struct room *r);
+static struct roster_page *roster_page(struct room *r, uint32_t room,
+        size_t page);
+
+/** Definitions **/
+
+static struct room rooms[MAX_ROOMS];
+/* Rooms by name */
+static struct hash *names;
+static pthread_mutex_t mtx_rooms = PTHREAD_MUTEX_INITIALIZER;
+
+/* Per shard index of every room's members, MAX_ROOMS per shard */
+static struct slotmap **members;
+static atomic_uint *locals;
+static unsigned nshards;
+
+/* Readers of every room's history */
+static struct epoch *readers;
+
+/** Room functions **/
+
+int room_global_init(unsigned n)
+{
+    unsigned i, j;
+
+    members = calloc((size_t)n * MAX_ROOMS, sizeof(*members));
+    locals = calloc((size_t)n * MAX_ROOMS, sizeof(*locals));
+    hash_init(&names, NULL, hash_string, hash_string_compare);
+    epoch_init(&readers, n);
+    if (members == NULL || locals == NULL || names == NULL || readers == NULL)
+        goto free_tables;
+
+    nshards = n;
+    for (i = 0; i < MAX_ROOMS; i++) {
+        rooms[i].name[0] = '\0';
+        atomic_init(&rooms[i].id, i);
+        rooms[i].gen = 0;
+        rooms[i].members = 0;
+        rooms[i].local = &locals[(size_t)i * n];
+        pthread_mutex_init(&rooms[i].mtx_history, NULL);
+        atomic_init(&rooms[i].head, 0);
+        pthread_mutex_init(&rooms[i].mtx_roster, NULL);
+        rooms[i].roster = NULL;
+        rooms[i].version = 1;
+        rooms[i].pages = NULL;
+        rooms[i].npages = 0;
+        for (j = 0; j < ROOM_HISTORY; j++) {
+            atomic_init(&rooms[i].history[j].seq, 0);
+            atomic_init(&rooms[i].history[j].text, NULL);
+            atomic_init(&rooms[i].history[j].frame, NULL);
+        }
+    }
+
+    /* the lobby is always there, so it takes the first slot */
+    if (room_alloc(ROOM_LOBBY_NAME, ROOM_LOBBY) == NULL)
+        goto free_tables;
+
+    return 0;
+
+free_tables:
+    epoch_destroy(&readers);
+    hash_destroy(&names);
+    free(locals);
+    free(members);
+    locals = NULL;
+    members = NULL;
+    return -1;
+}
+
+void room_global_destroy(void)
+{
+    size_t i, j;
+
+    if (members != NULL) {
+        for (i = 0; i < (size_t)nshards * MAX_ROOMS; i++)
+            slotmap_destroy(&members[i]);
+
+        for (i = 0; i < MAX_ROOMS; i++) {
+            for (j = 0; j < ROOM_HISTORY; j++) {
+                message_unref(atomic_load(&rooms[i].history[j].text));
+                message_unref(atomic_load(&rooms[i].history[j].frame));
+            }
+            pthread_mutex_destroy(&rooms[i].mtx_history);
+            roster_drop_pages(&rooms[i]);
+            slotmap_destroy(&rooms[i].roster);
+            pthread_mutex_destroy(&rooms[i].mtx_roster);
+        }
+    }
+
+    epoch_destroy(&readers);
+    hash_destroy(&names);
+    free(locals);
+    free(members);
+    locals = NULL;
+    members = NULL;
+    nshards = 0;
+}
+
+/**
+ * Takes a free slot for a new room, the one of want if it is free
+ * and want is not ROOM_ANY, in which case the room also gets want's
+ * generation.  Must be called with mtx_rooms held
+ */
+static struct room *room_alloc(const char *name, uint32_t want)
+{
+    struct room *r;
+    unsigned i;
+
+    if (want != ROOM_ANY && rooms[want & ROOM_SLOT_MASK].name[0] == '\0') {
+        i = want & ROOM_SLOT_MASK;
+        rooms[i].gen = want >> ROOM_SLOT_BITS;
+    } else {
+        for (i = 0; i < MAX_ROOMS; i++) {
+            if (rooms[i].name[0] == '\0')
+                break;
+        }
+        if (i == MAX_ROOMS)
+            return NULL;
+    }
+
+    r = &rooms[i];
+    strncpy(r->name, name, ROOM_NAME_LEN - 1);
+    r->name[ROOM_NAME_LEN - 1] = '\0';
+    if (hash_put(names, r->name, r) == -1) {
+        r->name[0] = '\0';
+        return NULL;
+    }
+
+    atomic_store(&r->id, i | r->gen << ROOM_SLOT_BITS);
+    return r;
+}
+
+/**
+ * Drops a member from a room's counts, letting the room go once
+ * the last one is gone
+ */
+static void room_release(unsigned shard, uint32_t room)
+{
+    struct room *r;
+    long long locked;
+
+    r = &rooms[room & ROOM_SLOT_MASK];
+
+    pthread_mutex_lock(&mtx_rooms);
+    locked = stats_now();
+    atomic_fetch_sub_explicit(&r->local[shard], 1, memory_order_relaxed);
+    r->members--;
+    if (r->members == 0 && room != ROOM_LOBBY) {
+        /* /who reads the name under the roster's lock alone */
+        pthread_mutex_lock(&r->mtx_roster);
+        roster_drop_pages(r);
+        hash_remove(names, r->name);
+        r->name[0] = '\0';
+        r->gen = (r->gen + 1) & (UINT32_MAX >> ROOM_SLOT_BITS);
+
+        /* nothing can be recorded for the old id once it has moved on */
+        pthread_mutex_lock(&r->mtx_history);
+        atomic_store(&r->id, (room & ROOM_SLOT_MASK) | r->gen << ROOM_SLOT_BITS);
+        room_forget(r, shard);
+        pthread_mutex_unlock(&r->mtx_history);
+        pthread_mutex_unlock(&r->mtx_roster);
+    }
+    pthread_mutex_unlock(&mtx_rooms);
+    stats_time(shard, STAT_LOCK_HOLD, stats_now() - locked);
+}
+
+static void history_unref(void *p)
+{
+    message_unref(p);
+}
+
+/**
+ * Empties a room's history.  Must be called with mtx_history held
+ */
+static void room_forget(struct room *r, unsigned shard)
+{
+    struct message *m;
+    unsigned i;
+
+    for (i = 0; i < ROOM_HISTORY; i++) {
+        atomic_store(&r->history[i].seq, 0);
+        if ((m = atomic_exchange(&r->history[i].text, NULL)) != NULL)
+            epoch_retire(readers, shard, m, history_unref);
+        if ((m = atomic_exchange(&r->history[i].frame, NULL)) != NULL)
+            epoch_retire(readers, shard, m, history_unref);
+    }
+
+    atomic_store(&r->head, 0);
+}
+
+void room_record(unsigned shard, uint32_t room, struct message *text,
+        struct message *frame)
+{
+    struct room *r;
+    struct room_entry *e;
+    struct message *old_text, *old_frame;
+    unsigned long seq;
+    long long locked;
+
+    r = &rooms[room & ROOM_SLOT_MASK];
+
+    pthread_mutex_lock(&r->mtx_history);
+    locked = stats_now();
+    if (atomic_load(&r->id) != room) {
+        pthread_mutex_unlock(&r->mtx_history);
+        return;
+    }
+
+    /**
+     * Readers check seq on either side of loading a message, so it
+     * is cleared before the entry changes and set again after */
+    seq = atomic_load(&r->head);
+    e = &r->history[seq & (ROOM_HISTORY - 1)];
+    atomic_store(&e->seq, 0);
+    old_text = atomic_exchange(&e->text, text ? message_ref(text) : NULL);
+    old_frame = atomic_exchange(&e->frame, frame ? message_ref(frame) : NULL);
+    atomic_store(&e->seq, seq + 1);
+    atomic_store(&r->head, seq + 1);
+    pthread_mutex_unlock(&r->mtx_history);
+    stats_time(shard, STAT_LOCK_HOLD, stats_now() - locked);
+
+    /* a reader may have loaded them just before they were replaced */
+    if (old_text != NULL)
+        epoch_retire(readers, shard, old_text, history_unref);
+    if (old_frame != NULL)
+        epoch_retire(readers, shard, old_frame, history_unref);
+}
+
+size_t room_history(unsigned shard, uint32_t room, int binary,
+        struct message **history, size_t max)
+{
+    struct room *r;
+    struct room_entry *e;
+    struct message *m;
+    unsigned long head, seq;
+    size_t n = 0;
+
+    r = &rooms[room & ROOM_SLOT_MASK];
+
+    epoch_enter(readers, shard);
+    if (atomic_load(&r->id) != room) {
+        epoch_exit(readers, shard);
+        return 0;
+    }
+
+    head = atomic_load(&r->head);
+    seq = head > ROOM_HISTORY ? head - ROOM_HISTORY : 0;
+    if (head - seq > max)
+        seq = head - max;
+
+    for (; seq < head; seq++) {
+        e = &r->history[seq & (ROOM_HISTORY - 1)];
+        if (atomic_load(&e->seq) != seq + 1)
+            continue;
+
+        m = atomic_load(binary ? &e->frame : &e->text);
+
+        /* the entry was rewritten while we loaded it */
+        if (m == NULL || atomic_load(&e->seq) != seq + 1)
+            continue;
+
+        history[n++] = message_ref(m);
+    }
+    epoch_exit(readers, shard);
+
+    return n;
+}
+
+int room_join(unsigned shard, const char *name, const char *handle,
+        struct client_info *ci, uint32_t *room, unsigned long *member)
+{
+    return room_enter(shard, name, ROOM_ANY, handle, ci, room, member);
+}
+
+int room_rejoin(unsigned shard, const char *name, uint32_t id,
+        const char *handle, struct client_info *ci, uint32_t *room,
+        unsigned long *member)
+{
+    return room_enter(shard, name, id, handle, ci, room, member);
+}
+
+/**
+ * Adds a connection to a room, creating the room in want's slot if
+ * nobody is in it yet, see room_alloc
+ */
+static int room_enter(unsigned shard, const char *name, uint32_t want,
+        const char *handle, struct client_info *ci, uint32_t *room,
+        unsigned long *member)
+{
+    struct room *r;
+    struct slotmap **sm;
+    size_t sizes[MEMBER_COLUMNS];
+    unsigned long id, rosterid;
+    uint32_t rid;
+    long long locked;
+    int created = 0;
+
+    pthread_mutex_lock(&mtx_rooms);
+    locked = stats_now();
+    r = hash_get(names, (void*)name);
+    if (r == NULL) {
+        r = room_alloc(name, want);
+        created = 1;
+    }
+    if (r != NULL) {
+        r->members++;
+        atomic_fetch_add_explicit(&r->local[shard], 1, memory_order_relaxed);
+        rid = atomic_load_explicit(&r->id, memory_order_relaxed);
+    }
+    pthread_mutex_unlock(&mtx_rooms);
+    stats_time(shard, STAT_LOCK_HOLD, stats_now() - locked);
+
+    if (r == NULL)
+        return -1;
+
+    /* a shard only indexes the rooms its users have been in */
+    sm = &members[(size_t)shard * MAX_ROOMS + (rid & ROOM_SLOT_MASK)];
+    if (*sm == NULL) {
+        sizes[MEMBER_CI] = sizeof(struct client_info*);
+        sizes[MEMBER_ROSTER] = sizeof(unsigned long);
+        slotmap_init(sm, MEMBER_COLUMNS, sizes);
+        if (*sm == NULL) {
+            perror("[room:join:slotmap_init]");
+            room_release(shard, rid);
+            return -1;
+        }
+    }
+
+    id = slotmap_insert(*sm);
+    if (id == SLOTMAP_NONE) {
+        perror("[room:join:slotmap_insert]");
+        room_release(shard, rid);
+        return -1;
+    }
+
+    rosterid = roster_add(shard, r, handle);
+    if (rosterid == SLOTMAP_NONE) {
+        slotmap_remove(*sm, id);
+        room_release(shard, rid);
+        return -1;
+    }
+
+    *(struct client_info**)slotmap_at(*sm, id, MEMBER_CI) = ci;
+    *(unsigned long*)slotmap_at(*sm, id, MEMBER_ROSTER) = rosterid;
+    *room = rid;
+    *member = id;
+    return created;
+}
+
+void room_leave(unsigned shard, uint32_t room, unsigned long member)
+{
+    struct slotmap *sm;
+
+    sm = members[(size_t)shard * MAX_ROOMS + (room & ROOM_SLOT_MASK)];
+    roster_remove(shard, &rooms[room & ROOM_SLOT_MASK],
+            *(unsigned long*)slotmap_at(sm, member, MEMBER_ROSTER));
+    slotmap_remove(sm, member);
+    room_release(shard, room);
+}
+
+int room_present(uint32_t room, unsigned shard)
+{
+    return atomic_load_explicit(&rooms[room & ROOM_SLOT_MASK].local[shard],
+            memory_order_relaxed) > 0;
+}
+
+struct client_info **room_members(unsigned shard, uint32_t room, size_t *n)
+{
+    struct slotmap *sm;
+
+    /* messages for a room that has gone away are dropped */
+    if (atomic_load_explicit(&rooms[room & ROOM_SLOT_MASK].id,
+                memory_order_relaxed) != room)
+        return NULL;
+
+    sm = members[(size_t)shard * MAX_ROOMS + (room & ROOM_SLOT_MASK)];
+    if (sm == NULL || slotmap_size(sm) == 0)
+        return NULL;
+
+    *n = slotmap_size(sm);
+    return slotmap_column(sm, MEMBER_CI);
+}
+
+void room_name(uint32_t room, char name[ROOM_NAME_LEN])
+{
+    struct room *r;
+
+    r = &rooms[room & ROOM_SLOT_MASK];
+
+    pthread_mutex_lock(&mtx_rooms);
+    if (atomic_load_explicit(&r->id, memory_order_relaxed) == room)
+        memcpy(name, r->name, ROOM_NAME_LEN);
+    else
+        name[0] = '\0';
+    pthread_mutex_unlock(&mtx_rooms);
+}
+
+char *room_list(size_t *len)
+{
+    char *list;
+    size_t n;
+    unsigned i;
+
+    pthread_mutex_lock(&mtx_rooms);
+    list = malloc(hash_size(names) * ROOM_LINE_LEN + 1);
+    if (list == NULL) {
+        pthread_mutex_unlock(&mtx_rooms);
+        return NULL;
+    }
+
+    for (i = 0, n = 0; i < MAX_ROOMS; i++) {
+        if (rooms[i].name[0] != '\0')
+            n += (size_t)snprintf(list + n, ROOM_LINE_LEN + 1, "%s (%u)\n",
+                    rooms[i].name, rooms[i].members);
+    }
+    pthread_mutex_unlock(&mtx_rooms);
+
+    *len = n;
+    return list;
+}
+
+/**
+ * Adds a handle to a room's roster
+ *
+ * \return          Id of the handle in the roster, SLOTMAP_NONE on failure
+ */
+static unsigned long roster_add(unsigned shard, struct room *r,
+        const char *handle)
+{
+    size_t sizes[ROSTER_COLUMNS];
+    unsigned long id;
+    char *entry;
+    long long locked;
+
+    pthread_mutex_lock(&r->mtx_roster);
+    locked = stats_now();
+    if (r->roster == NULL) {
+        sizes[ROSTER_HANDLE] = ROOM_HANDLE_LEN;
+        slotmap_init(&r->roster, ROSTER_COLUMNS, sizes);
+        if (r->roster == NULL) {
+            pthread_mutex_unlock(&r->mtx_roster);
+            perror("[room:roster_add:slotmap_init]");
+            return SLOTMAP_NONE;
+        }
+    }
+
+    id = slotmap_insert(r->roster);
+    if (id == SLOTMAP_NONE) {
+        pthread_mutex_unlock(&r->mtx_roster);
+        perror("[room:roster_add:slotmap_insert]");
+        return SLOTMAP_NONE;
+    }
+
+    entry = slotmap_at(r->roster, id, ROSTER_HANDLE);
+    strncpy(entry, handle, ROOM_HANDLE_LEN - 1);
+    entry[ROOM_HANDLE_LEN - 1] = '\0';
+    r->version++;
+    pthread_mutex_unlock(&r->mtx_roster);
+    stats_time(shard, STAT_LOCK_HOLD, stats_now() - locked);
+
+    return id;
+}
+
+/**
+ * Removes a handle from a room's roster
+ */
+static void roster_remove(unsigned shard, struct room *r, unsigned long id)
+{
+    long long locked;
+
+    pthread_mutex_lock(&r->mtx_roster);
+    locked = stats_now();
+    slotmap_remove(r->roster, id);
+    r->version++;
+    pthread_mutex_unlock(&r->mtx_roster);
+    stats_time(shard, STAT_LOCK_HOLD, stats_now() - locked);
+}
+
+/**
+ * Releases every page built of a room's roster.  Must be called with
+ * mtx_roster held, or by the last thread using rooms
+ */
+static void roster_drop_pages(struct room *r)
+{
+    size_t i;
+
+    for (i = 0; i < r->npages; i++) {
+        message_unref(r->pages[i].text);
+        message_unref(r->pages[i].frame);
+    }
+
+    free(r->pages);
+    r->pages = NULL;
+    r->npages = 0;
+}
+
+/**
+ * Returns a page of a room's roster, serializing it again if a member
+ * joined or left since it was last built.  Only the handles on the
+ * page are copied.  Must be called with mtx_roster held
+ *
+ * \return          The page, NULL if there is no such page or on failure
+ */
+static struct roster_page *roster_page(struct room *r, uint32_t room,
+        size_t page)
+{
+    struct roster_page *pg, *pages;
+    struct message *text, *frame;
+    const char *handles;
+    size_t n, total, first, last, i, len;
+
+    n = r->roster != NULL ? slotmap_size(r->roster) : 0;
+    total = n > 0 ? (n + ROOM_WHO_PAGE - 1) / ROOM_WHO_PAGE : 1;
+    if (page >= total)
+        return NULL;
+
+    if (page >= r->npages) {
+        pages = realloc(r->pages, total * sizeof(*pages));
+        if (pages == NULL) {
+            perror("[room:roster_page:realloc]");
+            return NULL;
+        }
+        memset(pages + r->npages, 0, (total - r->npages) * sizeof(*pages));
+        r->pages = pages;
+        r->npages = total;
+    }
+
+    pg = &r->pages[page];
+    if (pg->version == r->version)
+        return pg;
+
+    first = page * ROOM_WHO_PAGE;
+    last = first + ROOM_WHO_PAGE < n ? first + ROOM_WHO_PAGE : n;
+
+    text = message_alloc(ROOM_WHO_LEN + (last - first) * ROOM_HANDLE_LEN);
+    if (text == NULL) {
+        perror("[room:roster_page:malloc]");
+        return NULL;
+    }
+
+    len = (size_t)snprintf(text->data, ROOM_WHO_LEN, "%s (%zu), page %zu of %zu\n",
+            r->name, n, page + 1, total);
+    if (len >= ROOM_WHO_LEN)
+        len = ROOM_WHO_LEN - 1;
+
+    handles = n > 0 ? slotmap_column(r->roster, ROSTER_HANDLE) : NULL;
+    for (i = first; i < last; i++) {
+        strcpy(text->data + len, handles + i * ROOM_HANDLE_LEN);
+        len += strlen(text->data + len);
+        text->data[len++] = '\n';
+    }
+    text->len = len;
+
+    /* binary clients get notices without the last newline */
+    frame = proto_message(FRAME_INFO, 0, room, text->data, len - 1);
+    if (frame == NULL) {
+        perror("[room:roster_page:malloc]");
+        message_unref(text);
+        return NULL;
+    }
+
+    message_unref(pg->text);
+    message_unref(pg->frame);
+    pg->text = text;
+    pg->frame = frame;
+    pg->version = r->version;
+    return pg;
+}
+
+struct message *room_who(unsigned shard, uint32_t room, size_t page,
+        int binary)
+{
+    struct room *r;
+    struct roster_page *pg;
+    struct message *m = NULL;
+    long long locked;
+
+    r = &rooms[room & ROOM_SLOT_MASK];
+
+    pthread_mutex_lock(&r->mtx_roster);
+    locked = stats_now();
+    if (atomic_load(&r->id) == room) {
+        pg = roster_page(r, room, page);
+        if (pg != NULL)
+            m = message_ref(binary ? pg->frame : pg->text);
+    }
+    pthread_mutex_unlock(&r->mtx_roster);
+    stats_time(shard, STAT_LOCK_HOLD, stats_now() - locked);
+
+    return m;
+}
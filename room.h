@@ -0,0 +1,180 @@
+/**
+ * file: room.h
+ *
+ * Rooms users chat in.  Room names are registered once for every
+ * shard, but each shard keeps its own index of the members it owns,
+ * so a message to a room is only fanned out by the shards that have
+ * members in it, and by each of them only to those members.  Each
+ * room also remembers the last messages said in it, which anyone
+ * can read back without taking a lock, and a roster of who is in it
+ */
+
+#ifndef ALLISONK_ROOM_H
+#define ALLISONK_ROOM_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "message.h"
+#include "server.h"
+
+/* Room every user starts in */
+#define ROOM_LOBBY      0
+#define ROOM_LOBBY_NAME "lobby"
+/* Longest room name, including the terminator */
+#define ROOM_NAME_LEN   24
+/* Messages a room remembers, a power of two */
+#define ROOM_HISTORY    32
+/* Longest handle a roster keeps, including the terminator */
+#define ROOM_HANDLE_LEN 32
+/* Handles on each page of a roster */
+#define ROOM_WHO_PAGE   100
+
+/**
+ * Initializes the room registry with just the lobby
+ *
+ * \param nshards   Number of shards that will own members
+ * \return          0 on success, -1 on failure
+ */
+int room_global_init(unsigned nshards);
+
+/**
+ * Adds a connection to a room, creating the room if nobody is in
+ * it yet.  The connection is not moved out of any room it is in.
+ * Must be called from the shard's reactor thread
+ *
+ * \param shard     Shard that owns the connection
+ * \param name      Name of the room, shorter than ROOM_NAME_LEN
+ * \param handle    Handle the room's roster lists the connection under
+ * \param ci        Connection joining
+ * \param room      Set to the id of the room
+ * \param member    Set to the id of the connection in the shard's
+ *                  index of the room, needed to leave it again
+ * \return          1 if the room was created, 0 if it already existed,
+ *                  -1 if there is no room for another room or on failure
+ */
+int room_join(unsigned shard, const char *name, const char *handle,
+        struct client_info *ci, uint32_t *room, unsigned long *member);
+
+/**
+ * Adds a connection to a room like room_join, except that a room
+ * that has to be created takes the id it had in the server this one
+ * took over from, as long as its slot is free.  Binary clients name
+ * rooms by id, so theirs keep working across the handover
+ *
+ * \param shard     Shard that owns the connection
+ * \param name      Name of the room, shorter than ROOM_NAME_LEN
+ * \param id        Id the room had
+ * \param handle    Handle the room's roster lists the connection under
+ * \param ci        Connection joining
+ * \param room      Set to the id of the room
+ * \param member    Set to the id of the connection in the shard's
+ *                  index of the room
+ * \return          1 if the room was created, 0 if it already existed,
+ *                  -1 if there is no room for another room or on failure
+ */
+int room_rejoin(unsigned shard, const char *name, uint32_t id,
+        const char *handle, struct client_info *ci, uint32_t *room,
+        unsigned long *member);
+
+/**
+ * Removes a connection from a room, which goes away with its last
+ * member unless it is the lobby.  Must be called from the shard's
+ * reactor thread
+ *
+ * \param shard     Shard that owns the connection
+ * \param room      Id of the room
+ * \param member    Id room_join returned for the connection
+ */
+void room_leave(unsigned shard, uint32_t room, unsigned long member);
+
+/**
+ * Tells whether a shard has members in a room.  Takes no lock, a
+ * member joining meanwhile may be missed
+ *
+ * \param room      Id of the room
+ * \param shard     Shard to check
+ * \return          Non-zero if the shard has members in the room
+ */
+int room_present(uint32_t room, unsigned shard);
+
+/**
+ * Returns a shard's members of a room.  Must be called from the
+ * shard's reactor thread; the array stays valid until a member
+ * joins or leaves
+ *
+ * \param shard     Shard to look in
+ * \param room      Id of the room
+ * \param n         Set to the number of members
+ * \return          Connections of the members, NULL if the shard
+ *                  has none or the room has gone away
+ */
+struct client_info **room_members(unsigned shard, uint32_t room, size_t *n);
+
+/**
+ * Remembers a message said in a room, forgetting the oldest one once
+ * ROOM_HISTORY are remembered.  The room takes a reference to each
+ * form of the message
+ *
+ * \param shard     Shard of the calling thread
+ * \param room      Id of the room
+ * \param text      Message for text clients
+ * \param frame     Message for binary clients, may be NULL
+ */
+void room_record(unsigned shard, uint32_t room, struct message *text,
+        struct message *frame);
+
+/**
+ * Reads back the messages a room remembers, oldest first.  Takes no
+ * lock; a message recorded meanwhile may be missed
+ *
+ * \param shard     Shard of the calling thread
+ * \param room      Id of the room
+ * \param binary    Non-zero for the binary form of each message, which
+ *                  is skipped where there is none
+ * \param history   Filled with the messages, the caller holds a
+ *                  reference to each
+ * \param max       Number of entries in history
+ * \return          Number of messages read
+ */
+size_t room_history(unsigned shard, uint32_t room, int binary,
+        struct message **history, size_t max);
+
+/**
+ * Returns a page of the handles in a room, ROOM_WHO_PAGE to a page
+ * after a line naming the room, its number of members and the page.
+ * A page is built once and then shared until a member joins or
+ * leaves, so asking again costs a reference
+ *
+ * \param shard     Shard of the calling thread
+ * \param room      Id of the room
+ * \param page      Page to return, counting from 0
+ * \param binary    Non-zero for the page as an INFO frame, zero for text
+ * \return          Page the caller holds a reference to, NULL if there
+ *                  is no such page, the room has gone away or on failure
+ */
+struct message *room_who(unsigned shard, uint32_t room, size_t page,
+        int binary);
+
+/**
+ * Copies the name of a room
+ *
+ * \param room      Id of the room
+ * \param name      Filled with the name, empty if the room has gone away
+ */
+void room_name(uint32_t room, char name[ROOM_NAME_LEN]);
+
+/**
+ * Lists every room with its number of members, one per line
+ *
+ * \param len       Set to the length of the listing
+ * \return          Listing the caller must free, NULL on failure
+ */
+char *room_list(size_t *len);
+
+/**
+ * Global cleanup for rooms.  No thread may be using them
+ */
+void room_global_destroy(void);
+
+#endif
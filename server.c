@@ -4,6 +4,9 @@
  * A Chat Server
  */
 
+#define _GNU_SOURCE
+
+#include <fcntl.h>
 #include <poll.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -19,29 +22,77 @@
 
 #include "server.h"
 #include "chat.h"
-#include "generic/generic_list.h"
+#include "handoff.h"
+#include "message.h"
+#include "msglog.h"
+#include "reactor.h"
+#include "stats.h"
 
 #define DEFAULT_PORT    9004
-#define BACKLOG         5
+#define BACKLOG         SOMAXCONN
 #define BASE_10         10
+#define MAX_REACTORS    256
+#define DEFAULT_OUT_HIGH    (64 * 1024)
+#define DEFAULT_OUT_LOW     (16 * 1024)
+#define MAX_OUT_BYTES       (64L * 1024 * 1024)
+#define DEFAULT_FLUSH_MS    0
+#define DEFAULT_FLUSH_BYTES (16 * 1024)
+#define DEFAULT_FSYNC_MS    1000
+#define MAX_FLUSH_MS        1000
+#define MAX_FSYNC_MS        60000
+#define DEFAULT_IDLE_MS     60000
+#define MAX_IDLE_MS         3600000
+#define DEFAULT_MSG_RATE    20
+#define MAX_MSG_RATE        1000000
+#define DEFAULT_BYTE_RATE   65536
+#define MAX_BYTE_RATE       1073741824L
 
 /* Declarations */
 void usage(char *prog_name);
 void sig_handler(int signo);
-void* handle_client(void *arg);
-void server_loop(int sock);
+int server_listen(unsigned short port);
+void* reactor_thread(void *arg);
+int server_loop(const struct server_config *cfg);
+int parse_number(const char *str, long min, long max, long *value);
 
 /* Definitions */
-static int stop = 0;
-static pthread_mutex_t mtx_thread_list;
-static struct list *threads;
+static volatile sig_atomic_t stop = 0;
 
 /**
  * Prints a usage statement for the server
  */
 void usage(char *prog_name)
 {
-    fprintf(stderr, "usage: %s [port]\n", prog_name);
+    fprintf(stderr, "usage: %s [-H high] [-L low] [-s drop-oldest|drop-connection]"
+            " [-i flush_ms] [-b flush_bytes] [-I epoll|uring]\n"
+            "       [-l log_dir] [-f always|never|fsync_ms] [-S stats_socket]"
+            " [-k idle_ms]\n       [-r msgs_per_s] [-R bytes_per_s]"
+            " [-U handoff_socket] [-v] [port] [reactors]\n",
+            prog_name);
+    fprintf(stderr, "  -H   outbound bytes queued per client before -s applies (default %d)\n",
+            DEFAULT_OUT_HIGH);
+    fprintf(stderr, "  -L   outbound bytes drop-oldest trims a queue down to (default %d)\n",
+            DEFAULT_OUT_LOW);
+    fprintf(stderr, "  -s   slow consumer policy (default drop-oldest)\n");
+    fprintf(stderr, "  -i   ms queued output may wait to be coalesced (default %d)\n",
+            DEFAULT_FLUSH_MS);
+    fprintf(stderr, "  -b   queued bytes that force an immediate flush (default %d)\n",
+            DEFAULT_FLUSH_BYTES);
+    fprintf(stderr, "  -I   I/O backend, uring falls back to epoll if unavailable"
+            " (default epoll)\n");
+    fprintf(stderr, "  -l   directory to log messages to so history survives a restart\n");
+    fprintf(stderr, "  -f   when the log syncs to disk: every group of messages,"
+            " never, or at most fsync_ms apart (default %d)\n", DEFAULT_FSYNC_MS);
+    fprintf(stderr, "  -S   Unix socket that hands a stats report to whoever connects\n");
+    fprintf(stderr, "  -k   ms a client may stay silent before it is pinged, or probed"
+            " with TCP keepalive,\n       0 never (default %d)\n", DEFAULT_IDLE_MS);
+    fprintf(stderr, "  -r   messages and commands a client may send per second,"
+            " 0 no limit (default %d)\n", DEFAULT_MSG_RATE);
+    fprintf(stderr, "  -R   bytes a client may send per second, 0 no limit (default %d)\n",
+            DEFAULT_BYTE_RATE);
+    fprintf(stderr, "  -U   Unix socket to take over a running server's clients through,"
+            " and to hand\n       them over to the next server through\n");
+    fprintf(stderr, "  -v   print every connection as it comes and goes\n");
 }
 
 /**
@@ -59,93 +110,227 @@ void sig_handler(int signo)
 }
 
 /**
- * Handle the client
+ * Creates a non-blocking listening socket.  Every reactor binds
+ * its own socket to the same port with SO_REUSEPORT so the kernel
+ * spreads incoming connections across them
+ *
+ * \param port      Port to listen on
+ * \return          Listening socket, -1 on failure
  */
-void* handle_client(void *arg)
+int server_listen(unsigned short port)
 {
-    struct client_info *ci;
-    pthread_t thread_id;
+    int sock, err, sockopt;
+    struct sockaddr_in saddr;
 
-    ci = (struct client_info*)arg;
+    sock = socket(AF_INET, SOCK_STREAM, 0);
+    if (sock == -1) {
+        perror("[server:socket]");
+        return -1;
+    }
 
-    print_connection("connected", &(ci->caddr));
-    chat_run(ci);
-    print_connection("disconnected", &(ci->caddr));
+    sockopt = 1;
+    setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, &sockopt, sizeof(sockopt));
+    err = setsockopt(sock, SOL_SOCKET, SO_REUSEPORT, &sockopt, sizeof(sockopt));
+    if (err == -1) {
+        perror("[server:setsockopt]");
+        goto shutdown_socket;
+    }
 
-    /* remove from list */
-    pthread_mutex_lock(&mtx_thread_list);
-    thread_id = pthread_self();
-    list_remove(threads, (void*)thread_id);
-    pthread_mutex_unlock(&mtx_thread_list);
+    memset(&saddr, 0, sizeof(saddr));
+    saddr.sin_family = AF_INET;
+    saddr.sin_port = htons(port);
+    saddr.sin_addr.s_addr = INADDR_ANY;
+    err = bind(sock, (const struct sockaddr*)&saddr, sizeof(saddr));
+    if (err == -1) {
+        perror("[server:bind]");
+        goto shutdown_socket;
+    }
+
+    err = fcntl(sock, F_SETFL, fcntl(sock, F_GETFL) | O_NONBLOCK);
+    if (err == -1) {
+        perror("[server:fcntl]");
+        goto shutdown_socket;
+    }
+
+    err = listen(sock, BACKLOG);
+    if (err == -1) {
+        perror("[server:listen]");
+        goto shutdown_socket;
+    }
+
+    return sock;
 
-    free(ci);
+shutdown_socket:
+    close(sock);
+    return -1;
+}
 
+/**
+ * Entry point for a reactor thread
+ */
+void* reactor_thread(void *arg)
+{
+    reactor_run((struct reactor*)arg, &stop);
     return NULL;
 }
 
 /**
  * Main event loop of our server
  *
- * \param sock      Server's listening socket
+ * \param cfg       Server configuration
+ * \return          0 on a clean shutdown, -1 if the server failed to start
  */
-void server_loop(int sock)
+int server_loop(const struct server_config *cfg)
 {
-    int nset;
-    struct pollfd pfds[1];
-
-    pfds[0].fd = sock;
-    pfds[0].events = POLLIN;
+    unsigned i, nstarted;
+    int err, ret = -1;
+    int handoff_sock = -1, successor = -1, handing_off;
+    struct reactor **reactors;
+    struct handoff *taken = NULL;
+    struct pollfd pfd;
+    pthread_t *threads;
+    sigset_t mask, oldmask;
+
+    reactors = calloc(cfg->nreactors, sizeof(*reactors));
+    threads = calloc(cfg->nreactors, sizeof(*threads));
+    if (reactors == NULL || threads == NULL) {
+        perror("[server:calloc]");
+        goto free_arrays;
+    }
 
-    pthread_mutex_init(&mtx_thread_list, NULL);
+    /* connections and messages come from pools shared by every reactor */
+    if (message_global_init() == -1 || reactor_global_init() == -1
+            || stats_global_init(cfg->nreactors) == -1) {
+        fprintf(stderr, "[server:init]: failed to create pools\n");
+        goto destroy_pools;
+    }
 
-    list_init(&threads, NULL, NULL);
-    chat_global_init();
+    /* a server already running on the handoff socket gives us its clients */
+    if (cfg->handoff_path != NULL && handoff_receive(&taken, cfg->handoff_path) == -1)
+        goto destroy_pools;
 
     /**
-     * Accepts connections from clients and starts a new
-     * thread for each successful conenction.  Additionaly,
-     * we track each thread identifier in a list to cleanup
-     * if the server exits before all connections are closed */
-    do {
-        nset = poll(pfds, ARR_SIZE(pfds), -1);
-        if (nset >= 1) { 
-            if (pfds[0].revents & POLLIN) {
-
-                int err;
-                pthread_t thread;
-                struct client_info *ci;
-                socklen_t sz;
-
-
-                ci = malloc(sizeof(struct client_info));
-                sz = sizeof(ci->caddr);
-               
-                ci->sock = accept(sock, (struct sockaddr*)&(ci->caddr), &sz);
-                if (ci->sock== -1) {
-                    perror("[server:accept]");
-                    continue;
-                }
+     * Every reactor owns its own listening socket and the shard of
+     * users that connect through it.  Accepts, reads and writes are
+     * all non-blocking and driven by epoll readiness events, or
+     * submitted to io_uring when it is selected */
+    for (i = 0; i < cfg->nreactors; i++) {
+        int sock;
+
+        sock = taken != NULL ? handoff_listener(taken, i) : -1;
+        if (sock == -1)
+            sock = server_listen(cfg->port);
+        if (sock == -1)
+            goto destroy_reactors;
+
+        err = reactor_init(&reactors[i], i, sock, cfg);
+        if (err == -1) {
+            fprintf(stderr, "[server:reactor_init]: failed to create event loop\n");
+            close(sock);
+            goto destroy_reactors;
+        }
+    }
 
-                err = pthread_create(&thread, NULL, handle_client, ci);
-                if (err != 0) {
-                   fprintf(stderr, "[server:pthread_create]: failed to create thread\n");
-                } else {
-                    pthread_mutex_lock(&mtx_thread_list);
-                    list_add(threads, (void*)thread);                    
-                    pthread_mutex_unlock(&mtx_thread_list);
-                } 
+    chat_global_init(reactors, cfg->nreactors, cfg);
+
+    if (taken != NULL) {
+        handoff_restore(taken, reactors, cfg->nreactors);
+        handoff_destroy(&taken);
+    }
+
+    if (cfg->stats_path != NULL && stats_serve(cfg->stats_path) == -1)
+        goto destroy_reactors;
+
+    if (cfg->handoff_path != NULL
+            && (handoff_sock = handoff_serve(cfg->handoff_path)) == -1)
+        goto destroy_reactors;
+
+    /* only the main thread handles SIGINT; reactors are woken explicitly */
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGINT);
+    pthread_sigmask(SIG_BLOCK, &mask, &oldmask);
+    sigdelset(&oldmask, SIGINT);
+
+    pfd.fd = handoff_sock;
+    pfd.events = POLLIN;
+
+    /**
+     * Reactors stop for SIGINT or for a new server taking over.  They
+     * leave their connections open when they stop, so if the handover
+     * fails they simply start again
+     */
+    for (;;) {
+        for (nstarted = 0; nstarted < cfg->nreactors; nstarted++) {
+            err = pthread_create(&threads[nstarted], NULL, reactor_thread,
+                    reactors[nstarted]);
+            if (err != 0) {
+                fprintf(stderr, "[server:pthread_create]: failed to create thread\n");
+                stop = 1;
+                break;
             }
         }
 
-    } while (!stop);
+        while (!stop) {
+            if (ppoll(&pfd, handoff_sock != -1, NULL, &oldmask) > 0
+                    && (pfd.revents & POLLIN))
+                break;
+        }
+
+        handing_off = !stop;
+        stop = 1;
+        printf(handing_off ? "Handing connections over\n" : "Closing connections\n");
+
+        for (i = 0; i < nstarted; i++)
+            reactor_wake(reactors[i]);
+
+        for (i = 0; i < nstarted; i++)
+            pthread_join(threads[i], NULL);
+
+        if (!handing_off)
+            break;
+
+        successor = handoff_send(handoff_sock, reactors, cfg->nreactors);
+        if (successor != -1)
+            break;
+
+        /* a SIGINT meanwhile is still pending, and stops us in ppoll */
+        fprintf(stderr, "[server] handover failed, carrying on\n");
+        stop = 0;
+    }
+    pthread_sigmask(SIG_SETMASK, &oldmask, NULL);
+
+    ret = 0;
 
-    printf("Destroying threads\n");
+destroy_reactors:
+    for (i = 0; i < cfg->nreactors; i++) {
+        /* the clients now belong to the new server, which must not hear us go */
+        if (successor != -1 && reactors[i] != NULL)
+            reactor_release(reactors[i]);
+        reactor_destroy(&reactors[i]);
+    }
 
-    /* signal all threads to disconnect and shutdown */
-    list_destroy(&threads);
     chat_global_destroy();
+    handoff_destroy(&taken);
+
+destroy_pools:
+    stats_global_destroy();
+    reactor_global_destroy();
+    message_global_destroy();
+
+    if (handoff_sock != -1) {
+        close(handoff_sock);
+        unlink(cfg->handoff_path);
+    }
+
+    /* lets the new server open the log and start serving */
+    if (successor != -1)
+        close(successor);
+
+free_arrays:
+    free(threads);
+    free(reactors);
 
-    pthread_mutex_destroy(&mtx_thread_list);
+    return ret;
 }
 
 /**
@@ -156,70 +341,200 @@ void server_loop(int sock)
 void print_connection(const char *msg, struct sockaddr_in *addr)
 {
     char ip_str[INET_ADDRSTRLEN];
-    inet_ntop(AF_INET, addr, ip_str, sizeof(*addr));
+    inet_ntop(AF_INET, &addr->sin_addr, ip_str, sizeof(ip_str));
     printf("[server] connection %s:%u %s\n", ip_str, ntohs(addr->sin_port), msg);
 }
 
+/**
+ * Parses a base 10 number between min and max
+ *
+ * \param str       String to parse
+ * \param min       Smallest accepted value
+ * \param max       Largest accepted value
+ * \param value     Where to store the parsed value
+ * \return          0 on success, -1 on failure
+ */
+int parse_number(const char *str, long min, long max, long *value)
+{
+    char *canary = NULL;
+    long v;
+
+    v = strtol(str, &canary, BASE_10);
+    if (canary == str || *canary != '\0' || v < min || v > max)
+        return -1;
+
+    *value = v;
+    return 0;
+}
+
 /**
  * Entry point for our main program
  */
 int main(int argc, char *argv[])
 {
-    int sock, err, ret, sockopt;
-    unsigned short port = DEFAULT_PORT;
-    struct sockaddr_in saddr;
+    int opt;
+    long value;
+    struct server_config cfg;
+
+    cfg.port = DEFAULT_PORT;
+    value = sysconf(_SC_NPROCESSORS_ONLN);
+    cfg.nreactors = value > 0 ? (unsigned)value : 1;
+    cfg.out_high = DEFAULT_OUT_HIGH;
+    cfg.out_low = DEFAULT_OUT_LOW;
+    cfg.slow = SLOW_DROP_OLDEST;
+    cfg.flush_ms = DEFAULT_FLUSH_MS;
+    cfg.flush_bytes = DEFAULT_FLUSH_BYTES;
+    cfg.io = IO_EPOLL;
+    cfg.log_dir = NULL;
+    cfg.log_fsync = DEFAULT_FSYNC_MS;
+    cfg.stats_path = NULL;
+    cfg.idle_ms = DEFAULT_IDLE_MS;
+    cfg.msg_rate = DEFAULT_MSG_RATE;
+    cfg.byte_rate = DEFAULT_BYTE_RATE;
+    cfg.handoff_path = NULL;
+    cfg.verbose = 0;
+
+    while ((opt = getopt(argc, argv, "H:L:s:i:b:I:l:f:S:k:r:R:U:v")) != -1) {
+        switch (opt) {
+            case 'H':
+            case 'L':
+                if (parse_number(optarg, 1, MAX_OUT_BYTES, &value) == -1) {
+                    fprintf(stderr, "[server] -%c invalid.  Must be 1-%ld\n",
+                            opt, MAX_OUT_BYTES);
+                    return EXIT_FAILURE;
+                }
 
-    if (argc == 2) {
-        char *canary = NULL;
-        long lport;
-       
-        lport  = strtol(argv[1], &canary, BASE_10);
-        if (canary == argv[1]  || lport > 65535) {
-            fprintf(stderr, "[server] port field invalid.  Must be below 65535\n");
-            return EXIT_FAILURE;
-        }
+                if (opt == 'H')
+                    cfg.out_high = (size_t)value;
+                else
+                    cfg.out_low = (size_t)value;
+                break;
+            case 's':
+                if (strcmp(optarg, "drop-oldest") == 0) {
+                    cfg.slow = SLOW_DROP_OLDEST;
+                } else if (strcmp(optarg, "drop-connection") == 0) {
+                    cfg.slow = SLOW_DROP_CONNECTION;
+                } else {
+                    usage(argv[0]);
+                    return EXIT_FAILURE;
+                }
+                break;
+            case 'i':
+                if (parse_number(optarg, 0, MAX_FLUSH_MS, &value) == -1) {
+                    fprintf(stderr, "[server] -i invalid.  Must be 0-%d\n", MAX_FLUSH_MS);
+                    return EXIT_FAILURE;
+                }
 
-        port = (unsigned short)lport;
-    } else if (argc > 2) {
-        usage(argv[0]);
-    }
+                cfg.flush_ms = value;
+                break;
+            case 'b':
+                if (parse_number(optarg, 1, MAX_OUT_BYTES, &value) == -1) {
+                    fprintf(stderr, "[server] -b invalid.  Must be 1-%ld\n", MAX_OUT_BYTES);
+                    return EXIT_FAILURE;
+                }
 
-    ret = EXIT_SUCCESS;
+                cfg.flush_bytes = (size_t)value;
+                break;
+            case 'I':
+                if (strcmp(optarg, "epoll") == 0) {
+                    cfg.io = IO_EPOLL;
+                } else if (strcmp(optarg, "uring") == 0) {
+                    cfg.io = IO_URING;
+                } else {
+                    usage(argv[0]);
+                    return EXIT_FAILURE;
+                }
+                break;
+            case 'l':
+                cfg.log_dir = optarg;
+                break;
+            case 'f':
+                if (strcmp(optarg, "always") == 0) {
+                    cfg.log_fsync = MSGLOG_FSYNC_ALWAYS;
+                } else if (strcmp(optarg, "never") == 0) {
+                    cfg.log_fsync = MSGLOG_FSYNC_NEVER;
+                } else if (parse_number(optarg, 1, MAX_FSYNC_MS, &value) == 0) {
+                    cfg.log_fsync = value;
+                } else {
+                    fprintf(stderr, "[server] -f invalid.  Must be always, never"
+                            " or 1-%d\n", MAX_FSYNC_MS);
+                    return EXIT_FAILURE;
+                }
+                break;
+            case 'S':
+                cfg.stats_path = optarg;
+                break;
+            case 'k':
+                if (parse_number(optarg, 0, MAX_IDLE_MS, &value) == -1) {
+                    fprintf(stderr, "[server] -k invalid.  Must be 0-%d\n", MAX_IDLE_MS);
+                    return EXIT_FAILURE;
+                }
 
-    printf("[server] listening on 0.0.0.0:%u\n", port);
+                cfg.idle_ms = value;
+                break;
+            case 'r':
+                if (parse_number(optarg, 0, MAX_MSG_RATE, &value) == -1) {
+                    fprintf(stderr, "[server] -r invalid.  Must be 0-%d\n", MAX_MSG_RATE);
+                    return EXIT_FAILURE;
+                }
 
-    sock = socket(AF_INET, SOCK_STREAM, 0);
-    if (sock == -1) {
-        perror("[server:socket]");
+                cfg.msg_rate = value;
+                break;
+            case 'R':
+                if (parse_number(optarg, 0, MAX_BYTE_RATE, &value) == -1) {
+                    fprintf(stderr, "[server] -R invalid.  Must be 0-%ld\n", MAX_BYTE_RATE);
+                    return EXIT_FAILURE;
+                }
+
+                cfg.byte_rate = value;
+                break;
+            case 'U':
+                cfg.handoff_path = optarg;
+                break;
+            case 'v':
+                cfg.verbose = 1;
+                break;
+            default:
+                usage(argv[0]);
+                return EXIT_FAILURE;
+        }
+    }
+
+    if (cfg.out_low > cfg.out_high) {
+        fprintf(stderr, "[server] low watermark must not exceed the high watermark\n");
         return EXIT_FAILURE;
     }
 
-    sockopt = 1;
-    setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, &sockopt, sizeof(sockopt));
+    if (argc - optind > 2) {
+        usage(argv[0]);
+        return EXIT_FAILURE;
+    }
 
-    saddr.sin_family = AF_INET;
-    saddr.sin_port = htons(port);
-    saddr.sin_addr.s_addr = INADDR_ANY;
-    err = bind(sock, (const struct sockaddr*)&saddr, sizeof(saddr));
-    if (err == -1) {
-        perror("[server:bind]");
-        ret = EXIT_FAILURE;
-        goto shutdown_socket;
+    if (argc - optind >= 1) {
+        if (parse_number(argv[optind], 1, 65535, &value) == -1) {
+            fprintf(stderr, "[server] port field invalid.  Must be below 65535\n");
+            return EXIT_FAILURE;
+        }
+
+        cfg.port = (unsigned short)value;
     }
 
-    err = listen(sock, BACKLOG);
-    if (err == -1) {
-        perror("[server:listen]");
-        ret = EXIT_FAILURE;
-        goto shutdown_socket;
+    if (argc - optind == 2) {
+        if (parse_number(argv[optind + 1], 1, MAX_REACTORS, &value) == -1) {
+            fprintf(stderr, "[server] reactor count invalid.  Must be 1-%d\n", MAX_REACTORS);
+            return EXIT_FAILURE;
+        }
+
+        cfg.nreactors = (unsigned)value;
     }
 
-    signal(SIGINT, sig_handler);
+    printf("[server] listening on 0.0.0.0:%u with %u reactor(s)\n",
+            cfg.port, cfg.nreactors);
 
-    server_loop(sock);
+    signal(SIGINT, sig_handler);
 
-shutdown_socket:
-    close(sock);
+    if (server_loop(&cfg) == -1)
+        return EXIT_FAILURE;
 
-    return ret;
+    return EXIT_SUCCESS;
 }
@@ -7,19 +7,190 @@
 #ifndef ALLISONK_SERVER_H
 #define ALLISONK_SERVER_H
 
+#include <stdint.h>
+
 #include <netinet/in.h>
 
+#include "bucket.h"
+#include "framer.h"
+#include "outq.h"
+#include "generic/generic_wheel.h"
+
 #define ARR_SIZE(a)     (sizeof(a) / sizeof(*a))
 
+#define HANDLE_BUFFER   32
+
+struct reactor;
+
+/**
+ * What to do with a client whose outbound queue passes the high watermark
+ *
+ * SLOW_DROP_OLDEST     Drop its oldest queued messages down to the low watermark
+ * SLOW_DROP_CONNECTION Disconnect it
+ */
+enum slow_policy {
+    SLOW_DROP_OLDEST,
+    SLOW_DROP_CONNECTION
+};
+
+/**
+ * How reactors wait for and perform I/O
+ *
+ * IO_EPOLL     Readiness events from epoll, then one syscall per read or write
+ * IO_URING     Multishot accept and receive plus batched sends through
+ *              io_uring, falling back to IO_EPOLL where it is unavailable
+ */
+enum io_backend {
+    IO_EPOLL,
+    IO_URING
+};
+
+/**
+ * Represents the server's runtime configuration
+ *
+ * port      Port every reactor listens on
+ * nreactors Number of event loops (and user shards) to run
+ * out_high  Outbound bytes a client may have queued before slow_policy applies
+ * out_low   Outbound bytes SLOW_DROP_OLDEST trims a queue down to
+ * slow      Policy applied to clients that are not draining their queue
+ * flush_ms  How long queued output may wait to be coalesced before it is
+ *           written.  0 writes at the end of every batch of events
+ * flush_bytes Queued bytes that make a client flush immediately
+ * io        I/O backend the reactors run on
+ * log_dir   Directory of the message log, NULL to keep no log
+ * log_fsync fsync policy of the message log, see msglog_open
+ * stats_path Unix socket to serve stats on, NULL to serve none
+ * idle_ms   How long a registered client may stay silent before it is
+ *           checked on, 0 to never check
+ * msg_rate  Messages and commands a client may send per second, 0 for
+ *           no limit
+ * byte_rate Bytes a client may send per second, 0 for no limit
+ * handoff_path Unix socket to take over from a running server on, then
+ *           to hand over to the next one on, NULL for neither
+ * verbose   Set to print every connection as it comes and goes
+ */
+struct server_config {
+    unsigned short port;
+    unsigned nreactors;
+    size_t out_high;
+    size_t out_low;
+    enum slow_policy slow;
+    long flush_ms;
+    size_t flush_bytes;
+    enum io_backend io;
+    const char *log_dir;
+    long log_fsync;
+    const char *stats_path;
+    long idle_ms;
+    long msg_rate;
+    long byte_rate;
+    const char *handoff_path;
+    int verbose;
+};
+
+/**
+ * Lifecycle of a client connection
+ *
+ * CLIENT_AWAITING_HANDLE   Prompted for a handle, must answer before its timer fires
+ * CLIENT_ACTIVE            Registered and chatting
+ * CLIENT_CLOSED            Torn down, waiting for its outstanding io_uring
+ *                          requests to complete before it is freed
+ */
+enum client_state {
+    CLIENT_AWAITING_HANDLE,
+    CLIENT_ACTIVE,
+    CLIENT_CLOSED
+};
+
+/**
+ * How a connection frames its traffic, chosen by its first byte
+ *
+ * FRAMING_UNKNOWN  Nothing received yet
+ * FRAMING_TEXT     Newline terminated text
+ * FRAMING_BINARY   Length-prefixed frames, see proto.h
+ */
+enum client_framing {
+    FRAMING_UNKNOWN,
+    FRAMING_TEXT,
+    FRAMING_BINARY
+};
+
 /**
  * Represents a client's connection information
  *
  * sock      Client's socket
  * caddr     Client's address information
+ * reactor   Event loop that owns this connection
+ * user      Id of the chat session bound to this connection in its
+ *           shard's user table (0 until registered)
+ * room      Id of the room the user is in
+ * member    Id of the user in its shard's index of that room
+ * closing   Set once the connection has been scheduled for teardown
+ * state     Where the connection is in its lifecycle
+ * timer     Registration deadline, then when to check an idle client
+ * last_rx   Monotonic time (ms) of the batch input last arrived in
+ * pinged    Monotonic time (ms) of an unanswered ping to a binary
+ *           client, 0 if there is none
+ * msgs      Flood control budget of messages and commands
+ * bytes     Flood control budget of bytes read
+ * resume    When a throttled connection may be read from again
+ * throttled Set while the connection is not read from for having used
+ *           up its budget, so TCP pushes back on the sender
+ * flooded   Set once the client has been told its messages are being
+ *           dropped, until it has saved up a second of budget again
+ * readable  Set while the connection is on its reactor's read list
+ * hangup    Set once the peer has shut down its side
+ * receiving Set while an io_uring receive is armed or waiting to be
+ *           re-armed
+ * framing   Protocol the client speaks
+ * in        Unfinished line or frame carried over from earlier reads
+ * out       Messages waiting to be written
+ * blocked   Set while the socket is full and we are waiting on EPOLLOUT,
+ *           or while an io_uring send is in flight
+ * dirty     Set while the connection is on its reactor's flush list
+ * inflight  io_uring requests that still refer to this connection
+ * sending   io_uring sends in flight, linked so they run in order
+ * progress  io_uring batch in which a send last completed or was queued
+ * prev/next Links in the owning reactor's connection list
+ * dirty_prev/dirty_next Links in the owning reactor's flush list
+ * read_prev/read_next Links in the owning reactor's read list
+ * starved_next Link in the owning reactor's list of receives to re-arm
  */
 struct client_info {
     int sock;
     struct sockaddr_in caddr;
+    struct reactor *reactor;
+    unsigned long user;
+    uint32_t room;
+    unsigned long member;
+    int closing;
+    enum client_state state;
+    struct timer timer;
+    long long last_rx;
+    long long pinged;
+    struct bucket msgs;
+    struct bucket bytes;
+    struct timer resume;
+    int throttled;
+    int flooded;
+    int readable;
+    int hangup;
+    int receiving;
+    enum client_framing framing;
+    struct framer in;
+    struct outq out;
+    int blocked;
+    int dirty;
+    unsigned inflight;
+    unsigned sending;
+    unsigned long progress;
+    struct client_info *prev;
+    struct client_info *next;
+    struct client_info *dirty_prev;
+    struct client_info *dirty_next;
+    struct client_info *read_prev;
+    struct client_info *read_next;
+    struct client_info *starved_next;
 };
 
 /**
@@ -0,0 +1,335 @@
+/**
+ * file: stats.c
+ *
+ * Counters and latency histograms for watching the server work.
+ * Histograms keep STATS_SUB_BITS bits of every sample below its
+ * highest set bit, so percentiles come out within about 3% of the
+ * true value whatever the scale, like an HDR histogram
+ */
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "stats.h"
+
+#define STATS_SUB_BITS      5
+#define STATS_BUCKETS       (64 << STATS_SUB_BITS)
+#define STATS_ALIGN         64
+#define STATS_REPORT_LEN    2048
+#define STATS_BACKLOG       8
+
+/** Type definitions **/
+
+/**
+ * Samples of one timer
+ *
+ * count     Number of samples
+ * sum       Sum of the samples (ns)
+ * max       Largest sample (ns)
+ * buckets   Samples by bucket_of
+ */
+struct histogram {
+    atomic_ulong count;
+    atomic_ulong sum;
+    atomic_ulong max;
+    atomic_ulong buckets[STATS_BUCKETS];
+};
+
+/**
+ * Stats kept by one thread, aligned so no two threads write to the
+ * same cache line
+ */
+struct shard_stats {
+    _Alignas(STATS_ALIGN) atomic_ulong counters[STAT_COUNTERS];
+    struct histogram timers[STAT_TIMERS];
+};
+
+/** Declarations **/
+
+static unsigned bucket_of(unsigned long ns);
+static unsigned long bucket_value(unsigned b);
+static unsigned long percentile(const unsigned long *buckets,
+        unsigned long count, unsigned long max, double p);
+static void *stats_server(void *arg);
+
+/** Definitions **/
+
+static const char *counter_names[STAT_COUNTERS] = {
+    "accepts",
+    "active",
+    "bytes_in",
+    "bytes_out",
+    "messages_in",
+    "messages_out",
+    "queue_drops",
+    "evictions",
+    "timeouts",
+    "throttles",
+    "flood_drops"
+};
+
+static const char *timer_names[STAT_TIMERS] = {
+    "fanout_ns",
+    "lock_hold_ns"
+};
+
+static struct shard_stats *shards;
+static unsigned nshards;
+
+/* Report socket, -1 while it is not being served */
+static int listen_sock = -1;
+static pthread_t server;
+static atomic_int stopping;
+static struct sockaddr_un listen_addr;
+
+/** Helper functions **/
+
+static unsigned bucket_of(unsigned long ns)
+{
+    unsigned msb;
+
+    if (ns < (1UL << STATS_SUB_BITS))
+        return (unsigned)ns;
+
+    msb = 63U - (unsigned)__builtin_clzl(ns);
+    return ((msb - STATS_SUB_BITS + 1) << STATS_SUB_BITS)
+        + (unsigned)((ns >> (msb - STATS_SUB_BITS)) & ((1UL << STATS_SUB_BITS) - 1));
+}
+
+/**
+ * Returns the smallest sample that falls in a bucket
+ */
+static unsigned long bucket_value(unsigned b)
+{
+    unsigned shift;
+
+    if (b < (1U << STATS_SUB_BITS))
+        return b;
+
+    shift = (b >> STATS_SUB_BITS) - 1;
+    return ((1UL << STATS_SUB_BITS) | (b & ((1UL << STATS_SUB_BITS) - 1))) << shift;
+}
+
+static unsigned long percentile(const unsigned long *buckets,
+        unsigned long count, unsigned long max, double p)
+{
+    unsigned long want, seen = 0;
+    unsigned b;
+
+    if (count == 0)
+        return 0;
+
+    want = (unsigned long)(p * (double)count);
+    if (want >= count)
+        want = count - 1;
+
+    for (b = 0; b < STATS_BUCKETS; b++) {
+        seen += buckets[b];
+        if (seen > want)
+            return bucket_value(b) < max ? bucket_value(b) : max;
+    }
+
+    return max;
+}
+
+/** Stats functions **/
+
+int stats_global_init(unsigned n)
+{
+    shards = aligned_alloc(STATS_ALIGN, n * sizeof(*shards));
+    if (shards == NULL)
+        return -1;
+
+    memset(shards, 0, n * sizeof(*shards));
+    nshards = n;
+    return 0;
+}
+
+void stats_add(unsigned shard, enum stat_counter c, long n)
+{
+    atomic_fetch_add_explicit(&shards[shard].counters[c], (unsigned long)n,
+            memory_order_relaxed);
+}
+
+void stats_time(unsigned shard, enum stat_timer t, long long ns)
+{
+    struct histogram *h;
+    unsigned long v;
+
+    h = &shards[shard].timers[t];
+    v = ns > 0 ? (unsigned long)ns : 0;
+
+    atomic_fetch_add_explicit(&h->count, 1, memory_order_relaxed);
+    atomic_fetch_add_explicit(&h->sum, v, memory_order_relaxed);
+    atomic_fetch_add_explicit(&h->buckets[bucket_of(v)], 1, memory_order_relaxed);
+    if (v > atomic_load_explicit(&h->max, memory_order_relaxed))
+        atomic_store_explicit(&h->max, v, memory_order_relaxed);
+}
+
+long long stats_now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+char *stats_report(size_t *len)
+{
+    static unsigned long buckets[STATS_BUCKETS];
+    static pthread_mutex_t mtx_report = PTHREAD_MUTEX_INITIALIZER;
+    struct histogram *h;
+    unsigned long total, count, sum, max, v;
+    unsigned i, c, b;
+    char *report;
+    int n;
+
+    report = malloc(STATS_REPORT_LEN);
+    if (report == NULL)
+        return NULL;
+
+    *len = 0;
+    for (c = 0; c < STAT_COUNTERS; c++) {
+        total = 0;
+        for (i = 0; i < nshards; i++)
+            total += atomic_load_explicit(&shards[i].counters[c], memory_order_relaxed);
+
+        n = snprintf(report + *len, STATS_REPORT_LEN - *len, "%s %lu\n",
+                counter_names[c], total);
+        *len += (size_t)n;
+    }
+
+    /* the merged buckets are too big for the stack */
+    pthread_mutex_lock(&mtx_report);
+    for (c = 0; c < STAT_TIMERS; c++) {
+        count = sum = max = 0;
+        memset(buckets, 0, sizeof(buckets));
+
+        for (i = 0; i < nshards; i++) {
+            h = &shards[i].timers[c];
+            count += atomic_load_explicit(&h->count, memory_order_relaxed);
+            sum += atomic_load_explicit(&h->sum, memory_order_relaxed);
+            v = atomic_load_explicit(&h->max, memory_order_relaxed);
+            max = v > max ? v : max;
+            for (b = 0; b < STATS_BUCKETS; b++)
+                buckets[b] += atomic_load_explicit(&h->buckets[b], memory_order_relaxed);
+        }
+
+        /* samples recorded meanwhile may be in the buckets but not the count */
+        for (total = 0, b = 0; b < STATS_BUCKETS; b++)
+            total += buckets[b];
+
+        n = snprintf(report + *len, STATS_REPORT_LEN - *len,
+                "%s count %lu mean %lu p50 %lu p99 %lu p999 %lu max %lu\n",
+                timer_names[c], count, count ? sum / count : 0,
+                percentile(buckets, total, max, 0.5),
+                percentile(buckets, total, max, 0.99),
+                percentile(buckets, total, max, 0.999), max);
+        *len += (size_t)n;
+    }
+    pthread_mutex_unlock(&mtx_report);
+
+    return report;
+}
+
+/**
+ * Writes a report to every connection accepted until stopped
+ */
+static void *stats_server(void *arg)
+{
+    char *report;
+    size_t len, off;
+    ssize_t n;
+    int sock;
+
+    (void)arg;
+
+    while (!atomic_load(&stopping)) {
+        sock = accept(listen_sock, NULL, NULL);
+        if (sock == -1) {
+            if (errno != EINTR && !atomic_load(&stopping))
+                perror("[stats:accept]");
+            if (errno == EINTR || errno == ECONNABORTED)
+                continue;
+            break;
+        }
+
+        report = stats_report(&len);
+        for (off = 0; report != NULL && off < len; off += (size_t)n) {
+            n = send(sock, report + off, len - off, MSG_NOSIGNAL);
+            if (n == -1)
+                break;
+        }
+
+        free(report);
+        close(sock);
+    }
+
+    return NULL;
+}
+
+int stats_serve(const char *path)
+{
+    if (strlen(path) >= sizeof(listen_addr.sun_path)) {
+        fprintf(stderr, "[stats:serve]: socket path too long\n");
+        return -1;
+    }
+
+    listen_addr.sun_family = AF_UNIX;
+    strcpy(listen_addr.sun_path, path);
+
+    listen_sock = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (listen_sock == -1) {
+        perror("[stats:serve:socket]");
+        return -1;
+    }
+
+    /* a socket left behind by a crash would make bind fail */
+    unlink(path);
+    if (bind(listen_sock, (struct sockaddr*)&listen_addr, sizeof(listen_addr)) == -1
+            || listen(listen_sock, STATS_BACKLOG) == -1) {
+        perror("[stats:serve:bind]");
+        close(listen_sock);
+        listen_sock = -1;
+        return -1;
+    }
+
+    if (pthread_create(&server, NULL, stats_server, NULL) != 0) {
+        fprintf(stderr, "[stats:serve:pthread_create]: failed to create thread\n");
+        close(listen_sock);
+        listen_sock = -1;
+        unlink(path);
+        return -1;
+    }
+
+    return 0;
+}
+
+void stats_global_destroy(void)
+{
+    if (listen_sock != -1) {
+        /* wakes the server thread out of accept */
+        atomic_store(&stopping, 1);
+        shutdown(listen_sock, SHUT_RDWR);
+        pthread_join(server, NULL);
+
+        close(listen_sock);
+        unlink(listen_addr.sun_path);
+        listen_sock = -1;
+    }
+
+    free(shards);
+    shards = NULL;
+    nshards = 0;
+}
@@ -0,0 +1,119 @@
+/**
+ * file: stats.h
+ *
+ * Counters and latency histograms for watching the server work.
+ * Every reactor thread updates its own copy on its own cache lines
+ * without taking a lock; the copies are only summed when a report
+ * is asked for, which can be done through a local Unix socket
+ */
+
+#ifndef ALLISONK_STATS_H
+#define ALLISONK_STATS_H
+
+#include <stddef.h>
+
+/**
+ * What is counted
+ *
+ * STAT_ACCEPTS     Connections accepted
+ * STAT_ACTIVE      Connections open right now
+ * STAT_BYTES_IN    Bytes received from clients
+ * STAT_BYTES_OUT   Bytes written to clients
+ * STAT_MSGS_IN     Messages said by users, to rooms or to one user
+ * STAT_MSGS_OUT    Messages completely written to a client
+ * STAT_DROPS       Messages dropped from slow consumers' queues or
+ *                  because a shard's inbox was full
+ * STAT_EVICTIONS   Slow consumers disconnected
+ * STAT_TIMEOUTS    Connections closed for registering too slowly or
+ *                  for not answering a ping
+ * STAT_THROTTLES   Times a connection stopped being read from for
+ *                  spending its flood control budget
+ * STAT_FLOOD_DROPS Messages and commands dropped for going over a
+ *                  client's flood control budget
+ */
+enum stat_counter {
+    STAT_ACCEPTS,
+    STAT_ACTIVE,
+    STAT_BYTES_IN,
+    STAT_BYTES_OUT,
+    STAT_MSGS_IN,
+    STAT_MSGS_OUT,
+    STAT_DROPS,
+    STAT_EVICTIONS,
+    STAT_TIMEOUTS,
+    STAT_THROTTLES,
+    STAT_FLOOD_DROPS,
+    STAT_COUNTERS
+};
+
+/**
+ * What is timed
+ *
+ * STAT_FANOUT      From a message being received to a copy of it
+ *                  being written to a recipient
+ * STAT_LOCK_HOLD   How long a shared lock is held
+ */
+enum stat_timer {
+    STAT_FANOUT,
+    STAT_LOCK_HOLD,
+    STAT_TIMERS
+};
+
+/**
+ * Global setup for stats, with every counter at zero
+ *
+ * \param nshards   Number of threads that keep stats
+ * \return          0 on success, -1 on failure
+ */
+int stats_global_init(unsigned nshards);
+
+/**
+ * Adds to a counter
+ *
+ * \param shard     Shard of the calling thread
+ * \param c         Counter to add to
+ * \param n         Amount to add, negative for STAT_ACTIVE only
+ */
+void stats_add(unsigned shard, enum stat_counter c, long n);
+
+/**
+ * Records one sample of a timer
+ *
+ * \param shard     Shard of the calling thread
+ * \param t         Timer to record
+ * \param ns        Time taken in ns
+ */
+void stats_time(unsigned shard, enum stat_timer t, long long ns);
+
+/**
+ * Returns a monotonic time to time things against
+ *
+ * \return          Time in ns
+ */
+long long stats_now(void);
+
+/**
+ * Sums every shard's stats into a report, one stat per line
+ *
+ * \param len       Set to the length of the report
+ * \return          Report the caller must free, NULL on failure
+ */
+char *stats_report(size_t *len);
+
+/**
+ * Starts handing out the report to whoever connects to a Unix
+ * socket, from a thread of its own
+ *
+ * \param path      Path to bind the socket to, replacing any
+ *                  socket left there by an earlier run
+ * \return          0 on success, -1 on failure
+ */
+int stats_serve(const char *path);
+
+/**
+ * Global cleanup for stats.  Stops serving the report and removes
+ * its socket
+ */
+void stats_global_destroy(void);
+
+#endif
@@ -0,0 +1,426 @@
+/**
+ * file: uring.c
+ *
+ * Minimal io_uring wrapper over the raw system calls
+ */
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <linux/io_uring.h>
+
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+#include "uring.h"
+
+#define URING_BGID      0
+
+/** Type definitions **/
+
+/**
+ * fd        io_uring descriptor
+ * sq_*      Submission ring shared with the kernel
+ * cq_*      Completion ring shared with the kernel
+ * queued    Requests queued since the last submission
+ * br        Ring of provided receive buffers shared with the kernel
+ * bufs      Memory of the provided buffers
+ */
+struct uring {
+    int fd;
+    unsigned sq_entries;
+    unsigned *sq_head;
+    unsigned *sq_tail;
+    unsigned *sq_mask;
+    unsigned *sq_array;
+    struct io_uring_sqe *sqes;
+    unsigned *cq_head;
+    unsigned *cq_tail;
+    unsigned *cq_mask;
+    struct io_uring_cqe *cqes;
+    void *sq_ring;
+    size_t sq_ring_sz;
+    void *cq_ring;
+    size_t cq_ring_sz;
+    size_t sqes_sz;
+    unsigned queued;
+    struct io_uring_buf_ring *br;
+    size_t br_sz;
+    unsigned nbufs;
+    size_t bufsize;
+    char *bufs;
+};
+
+/** Declarations **/
+
+static int uring_setup_buffers(struct uring *u, unsigned nbufs, size_t bufsize);
+static struct io_uring_sqe *uring_sqe(struct uring *u);
+static int uring_submit(struct uring *u);
+
+/** Ring functions **/
+
+int uring_init(struct uring **u, unsigned entries, unsigned nbufs, size_t bufsize)
+{
+    struct io_uring_params p;
+    struct uring *ur;
+    int fd;
+
+    if (u == NULL)
+        return -1;
+
+    /**
+     * Only the owning thread submits, so completion work can wait
+     * until it asks for events instead of interrupting it */
+    memset(&p, 0, sizeof(p));
+    p.flags = IORING_SETUP_SINGLE_ISSUER | IORING_SETUP_DEFER_TASKRUN;
+    fd = (int)syscall(__NR_io_uring_setup, entries, &p);
+    if (fd == -1 && errno == EINVAL) {
+        memset(&p, 0, sizeof(p));
+        fd = (int)syscall(__NR_io_uring_setup, entries, &p);
+    }
+    if (fd == -1)
+        return -1;
+
+    /* waiting with a timeout needs the extended enter arguments */
+    if (!(p.features & IORING_FEAT_EXT_ARG)) {
+        close(fd);
+        return -1;
+    }
+
+    ur = calloc(1, sizeof(*ur));
+    if (ur == NULL) {
+        close(fd);
+        return -1;
+    }
+
+    ur->fd = fd;
+    ur->sq_entries = p.sq_entries;
+    ur->sq_ring_sz = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    ur->cq_ring_sz = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    ur->sqes_sz = p.sq_entries * sizeof(struct io_uring_sqe);
+
+    ur->sq_ring = mmap(NULL, ur->sq_ring_sz, PROT_READ | PROT_WRITE,
+            MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+    ur->cq_ring = mmap(NULL, ur->cq_ring_sz, PROT_READ | PROT_WRITE,
+            MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+    ur->sqes = mmap(NULL, ur->sqes_sz, PROT_READ | PROT_WRITE,
+            MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+    if (ur->sq_ring == MAP_FAILED || ur->cq_ring == MAP_FAILED
+            || ur->sqes == MAP_FAILED) {
+        uring_destroy(&ur);
+        return -1;
+    }
+
+    ur->sq_head = (unsigned*)((char*)ur->sq_ring + p.sq_off.head);
+    ur->sq_tail = (unsigned*)((char*)ur->sq_ring + p.sq_off.tail);
+    ur->sq_mask = (unsigned*)((char*)ur->sq_ring + p.sq_off.ring_mask);
+    ur->sq_array = (unsigned*)((char*)ur->sq_ring + p.sq_off.array);
+    ur->cq_head = (unsigned*)((char*)ur->cq_ring + p.cq_off.head);
+    ur->cq_tail = (unsigned*)((char*)ur->cq_ring + p.cq_off.tail);
+    ur->cq_mask = (unsigned*)((char*)ur->cq_ring + p.cq_off.ring_mask);
+    ur->cqes = (struct io_uring_cqe*)((char*)ur->cq_ring + p.cq_off.cqes);
+
+    if (uring_setup_buffers(ur, nbufs, bufsize) == -1) {
+        uring_destroy(&ur);
+        return -1;
+    }
+
+    *u = ur;
+    return 0;
+}
+
+/**
+ * Registers a ring of provided buffers and hands every buffer
+ * to the kernel
+ */
+static int uring_setup_buffers(struct uring *u, unsigned nbufs, size_t bufsize)
+{
+    struct io_uring_buf_reg reg;
+    unsigned i;
+
+    u->br_sz = nbufs * sizeof(struct io_uring_buf);
+    u->br = mmap(NULL, u->br_sz, PROT_READ | PROT_WRITE,
+            MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (u->br == MAP_FAILED) {
+        u->br = NULL;
+        return -1;
+    }
+
+    u->bufs = malloc(nbufs * bufsize);
+    if (u->bufs == NULL)
+        return -1;
+
+    memset(&reg, 0, sizeof(reg));
+    reg.ring_addr = (uint64_t)(uintptr_t)u->br;
+    reg.ring_entries = nbufs;
+    reg.bgid = URING_BGID;
+    if (syscall(__NR_io_uring_register, u->fd, IORING_REGISTER_PBUF_RING,
+                &reg, 1) == -1)
+        return -1;
+
+    u->nbufs = nbufs;
+    u->bufsize = bufsize;
+    for (i = 0; i < nbufs; i++)
+        uring_recycle(u, i);
+
+    return 0;
+}
+
+/**
+ * Returns a cleared submission entry, submitting what is queued
+ * first if the ring is full
+ */
+static struct io_uring_sqe *uring_sqe(struct uring *u)
+{
+    struct io_uring_sqe *sqe;
+    unsigned head, tail, idx;
+
+    tail = *u->sq_tail;
+    head = __atomic_load_n(u->sq_head, __ATOMIC_ACQUIRE);
+    if (tail - head >= u->sq_entries) {
+        if (uring_submit(u) == -1)
+            return NULL;
+
+        head = __atomic_load_n(u->sq_head, __ATOMIC_ACQUIRE);
+        if (tail - head >= u->sq_entries)
+            return NULL;
+    }
+
+    idx = tail & *u->sq_mask;
+    sqe = &u->sqes[idx];
+    memset(sqe, 0, sizeof(*sqe));
+    u->sq_array[idx] = idx;
+
+    /* the kernel only looks at the ring when we enter it */
+    __atomic_store_n(u->sq_tail, tail + 1, __ATOMIC_RELEASE);
+    u->queued++;
+    return sqe;
+}
+
+static int uring_submit(struct uring *u)
+{
+    int ret;
+
+    do {
+        ret = (int)syscall(__NR_io_uring_enter, u->fd, u->queued, 0, 0, NULL, 0);
+    } while (ret == -1 && errno == EINTR);
+
+    if (ret == -1)
+        return -1;
+
+    u->queued -= (unsigned)ret;
+    return 0;
+}
+
+int uring_reserve(struct uring *u, unsigned n)
+{
+    unsigned head;
+
+    if (n > u->sq_entries)
+        return -1;
+
+    head = __atomic_load_n(u->sq_head, __ATOMIC_ACQUIRE);
+    if (*u->sq_tail - head + n <= u->sq_entries)
+        return 0;
+
+    if (uring_submit(u) == -1)
+        return -1;
+
+    head = __atomic_load_n(u->sq_head, __ATOMIC_ACQUIRE);
+    return *u->sq_tail - head + n <= u->sq_entries ? 0 : -1;
+}
+
+int uring_prep_accept(struct uring *u, int fd, uint64_t data)
+{
+    struct io_uring_sqe *sqe;
+
+    sqe = uring_sqe(u);
+    if (sqe == NULL)
+        return -1;
+
+    sqe->opcode = IORING_OP_ACCEPT;
+    sqe->fd = fd;
+    sqe->accept_flags = SOCK_NONBLOCK | SOCK_CLOEXEC;
+    sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+    sqe->user_data = data;
+    return 0;
+}
+
+int uring_prep_recv(struct uring *u, int fd, uint64_t data)
+{
+    struct io_uring_sqe *sqe;
+
+    sqe = uring_sqe(u);
+    if (sqe == NULL)
+        return -1;
+
+    sqe->opcode = IORING_OP_RECV;
+    sqe->fd = fd;
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = URING_BGID;
+    sqe->ioprio = IORING_RECV_MULTISHOT;
+    sqe->user_data = data;
+    return 0;
+}
+
+int uring_prep_sendmsg(struct uring *u, int fd, const struct msghdr *msg,
+        int link, uint64_t data)
+{
+    struct io_uring_sqe *sqe;
+
+    sqe = uring_sqe(u);
+    if (sqe == NULL)
+        return -1;
+
+    sqe->opcode = IORING_OP_SENDMSG;
+    sqe->fd = fd;
+    sqe->addr = (uint64_t)(uintptr_t)msg;
+    sqe->len = 1;
+    /* a short send would let the next linked one tear the stream */
+    sqe->msg_flags = MSG_NOSIGNAL | MSG_WAITALL;
+    if (link)
+        sqe->flags = IOSQE_IO_LINK;
+    sqe->user_data = data;
+    return 0;
+}
+
+int uring_prep_read(struct uring *u, int fd, void *buf, unsigned len,
+        uint64_t data)
+{
+    struct io_uring_sqe *sqe;
+
+    sqe = uring_sqe(u);
+    if (sqe == NULL)
+        return -1;
+
+    sqe->opcode = IORING_OP_READ;
+    sqe->fd = fd;
+    sqe->addr = (uint64_t)(uintptr_t)buf;
+    sqe->len = len;
+    sqe->user_data = data;
+    return 0;
+}
+
+int uring_prep_cancel(struct uring *u, uint64_t target, uint64_t data)
+{
+    struct io_uring_sqe *sqe;
+
+    sqe = uring_sqe(u);
+    if (sqe == NULL)
+        return -1;
+
+    sqe->opcode = IORING_OP_ASYNC_CANCEL;
+    sqe->addr = target;
+    sqe->user_data = data;
+    return 0;
+}
+
+int uring_prep_cancel_all(struct uring *u, uint64_t data)
+{
+    struct io_uring_sqe *sqe;
+
+    sqe = uring_sqe(u);
+    if (sqe == NULL)
+        return -1;
+
+    sqe->opcode = IORING_OP_ASYNC_CANCEL;
+    sqe->cancel_flags = IORING_ASYNC_CANCEL_ANY;
+    sqe->user_data = data;
+    return 0;
+}
+
+int uring_wait(struct uring *u, int timeout)
+{
+    struct io_uring_getevents_arg arg;
+    struct __kernel_timespec ts;
+    unsigned flags, wait;
+    int ret;
+
+    /* completions already waiting only need the queue submitted */
+    wait = *u->cq_head == __atomic_load_n(u->cq_tail, __ATOMIC_ACQUIRE);
+
+    flags = IORING_ENTER_GETEVENTS | IORING_ENTER_EXT_ARG;
+    memset(&arg, 0, sizeof(arg));
+    if (timeout >= 0) {
+        ts.tv_sec = timeout / 1000;
+        ts.tv_nsec = (long long)(timeout % 1000) * 1000000;
+        arg.ts = (uint64_t)(uintptr_t)&ts;
+    }
+
+    ret = (int)syscall(__NR_io_uring_enter, u->fd, u->queued, wait, flags,
+            &arg, sizeof(arg));
+    if (ret == -1)
+        return errno == EINTR || errno == ETIME || errno == EBUSY ? 0 : -1;
+
+    u->queued -= (unsigned)ret;
+    return 0;
+}
+
+int uring_next(struct uring *u, struct uring_event *ev)
+{
+    struct io_uring_cqe *cqe;
+    unsigned head;
+
+    head = *u->cq_head;
+    if (head == __atomic_load_n(u->cq_tail, __ATOMIC_ACQUIRE))
+        return 0;
+
+    cqe = &u->cqes[head & *u->cq_mask];
+    ev->data = cqe->user_data;
+    ev->res = cqe->res;
+    ev->more = (cqe->flags & IORING_CQE_F_MORE) != 0;
+    ev->buffered = (cqe->flags & IORING_CQE_F_BUFFER) != 0;
+    ev->bid = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+
+    __atomic_store_n(u->cq_head, head + 1, __ATOMIC_RELEASE);
+    return 1;
+}
+
+char *uring_buffer(struct uring *u, unsigned bid)
+{
+    return u->bufs + (size_t)bid * u->bufsize;
+}
+
+void uring_recycle(struct uring *u, unsigned bid)
+{
+    struct io_uring_buf *b;
+    unsigned short tail;
+
+    tail = u->br->tail;
+    b = &u->br->bufs[tail & (u->nbufs - 1)];
+    b->addr = (uint64_t)(uintptr_t)uring_buffer(u, bid);
+    b->len = (uint32_t)u->bufsize;
+    b->bid = (uint16_t)bid;
+
+    __atomic_store_n(&u->br->tail, (unsigned short)(tail + 1), __ATOMIC_RELEASE);
+}
+
+void uring_destroy(struct uring **u)
+{
+    struct uring *ur;
+
+    if (u == NULL || *u == NULL)
+        return;
+
+    ur = *u;
+    if (ur->sqes != NULL && ur->sqes != MAP_FAILED)
+        munmap(ur->sqes, ur->sqes_sz);
+    if (ur->cq_ring != NULL && ur->cq_ring != MAP_FAILED)
+        munmap(ur->cq_ring, ur->cq_ring_sz);
+    if (ur->sq_ring != NULL && ur->sq_ring != MAP_FAILED)
+        munmap(ur->sq_ring, ur->sq_ring_sz);
+
+    /* closing the ring cancels whatever is still outstanding */
+    close(ur->fd);
+
+    if (ur->br != NULL)
+        munmap(ur->br, ur->br_sz);
+    free(ur->bufs);
+    free(ur);
+    *u = NULL;
+}
@@ -0,0 +1,175 @@
+/**
+ * file: uring.h
+ *
+ * Minimal io_uring wrapper over the raw system calls.  Requests are
+ * queued with the uring_prep functions and submitted together by the
+ * next uring_wait, so a whole batch costs one system call
+ */
+
+#ifndef ALLISONK_URING_H
+#define ALLISONK_URING_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <sys/socket.h>
+
+/**
+ * Represents an io_uring instance with one group of provided
+ * receive buffers
+ */
+struct uring;
+
+/**
+ * A completed request
+ *
+ * data      Value the request was queued with
+ * res       Result, a negated errno on failure
+ * more      Set while a multishot request stays armed
+ * buffered  Set when the result landed in a provided buffer
+ * bid       Index of that buffer
+ */
+struct uring_event {
+    uint64_t data;
+    int res;
+    int more;
+    int buffered;
+    unsigned bid;
+};
+
+/**
+ * Initializes an io_uring instance. Will allocate an instance
+ * and store it in the dereferenced parameter.  The instance may only
+ * be used by the calling thread
+ *
+ * \param u         Instance to initialize
+ * \param entries   Submission queue size
+ * \param nbufs     Number of provided receive buffers, a power of two
+ * \param bufsize   Size of each receive buffer
+ * \return          0 on success, -1 if io_uring is unavailable
+ */
+int uring_init(struct uring **u, unsigned entries, unsigned nbufs, size_t bufsize);
+
+/**
+ * Makes room for n requests, submitting what is queued if needed,
+ * so that n requests linked into a chain reach the kernel together
+ *
+ * \param u         Instance to reserve on
+ * \param n         Number of requests about to be queued
+ * \return          0 on success, -1 on failure or if n will never fit
+ */
+int uring_reserve(struct uring *u, unsigned n);
+
+/**
+ * Queues a multishot accept.  Accepted sockets are non-blocking
+ *
+ * \param u         Instance to queue on
+ * \param fd        Listening socket
+ * \param data      Value to complete with
+ * \return          0 on success, -1 if the queue is full
+ */
+int uring_prep_accept(struct uring *u, int fd, uint64_t data);
+
+/**
+ * Queues a multishot receive into the provided buffers
+ *
+ * \param u         Instance to queue on
+ * \param fd        Socket to receive from
+ * \param data      Value to complete with
+ * \return          0 on success, -1 if the queue is full
+ */
+int uring_prep_recv(struct uring *u, int fd, uint64_t data);
+
+/**
+ * Queues a gather send.  Everything msg describes is sent unless the
+ * connection fails.  msg and its iovecs must stay valid until the
+ * request completes
+ *
+ * \param u         Instance to queue on
+ * \param fd        Socket to send on
+ * \param msg       Message header describing the data
+ * \param link      Non-zero to start the next queued request only once
+ *                  this one has completed; if this one fails the next
+ *                  completes with -ECANCELED
+ * \param data      Value to complete with
+ * \return          0 on success, -1 if the queue is full
+ */
+int uring_prep_sendmsg(struct uring *u, int fd, const struct msghdr *msg,
+        int link, uint64_t data);
+
+/**
+ * Queues a read.  buf must stay valid until the request completes
+ *
+ * \param u         Instance to queue on
+ * \param fd        Descriptor to read from
+ * \param buf       Buffer to read into
+ * \param len       Size of buf
+ * \param data      Value to complete with
+ * \return          0 on success, -1 if the queue is full
+ */
+int uring_prep_read(struct uring *u, int fd, void *buf, unsigned len,
+        uint64_t data);
+
+/**
+ * Queues cancellation of an outstanding request
+ *
+ * \param u         Instance to queue on
+ * \param target    Value the request to cancel completes with
+ * \param data      Value the cancellation itself completes with
+ * \return          0 on success, -1 if the queue is full
+ */
+int uring_prep_cancel(struct uring *u, uint64_t target, uint64_t data);
+
+/**
+ * Queues cancellation of every outstanding request
+ *
+ * \param u         Instance to queue on
+ * \param data      Value the cancellation itself completes with
+ * \return          0 on success, -1 if the queue is full
+ */
+int uring_prep_cancel_all(struct uring *u, uint64_t data);
+
+/**
+ * Submits every queued request and waits for a completion
+ *
+ * \param u         Instance to wait on
+ * \param timeout   Longest wait in milliseconds, -1 to wait indefinitely
+ * \return          0 on success or timeout, -1 on failure
+ */
+int uring_wait(struct uring *u, int timeout);
+
+/**
+ * Takes the next completion
+ *
+ * \param u         Instance to take from
+ * \param ev        Filled with the completion
+ * \return          1 if there was one, 0 otherwise
+ */
+int uring_next(struct uring *u, struct uring_event *ev);
+
+/**
+ * Returns a provided buffer that a completion landed in
+ *
+ * \param u         Instance the buffer belongs to
+ * \param bid       Index of the buffer
+ */
+char *uring_buffer(struct uring *u, unsigned bid);
+
+/**
+ * Hands a provided buffer back to the kernel once its data
+ * has been consumed
+ *
+ * \param u         Instance the buffer belongs to
+ * \param bid       Index of the buffer
+ */
+void uring_recycle(struct uring *u, unsigned bid);
+
+/**
+ * Destroy an io_uring instance, abandoning outstanding requests.
+ * Sets dereference parameter to NULL
+ *
+ * \param u         Instance to deallocate
+ */
+void uring_destroy(struct uring **u);
+
+#endif